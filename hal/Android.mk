@@ -27,8 +27,12 @@ LOCAL_SHARED_LIBRARIES := \
 	libexpat \
 
 LOCAL_SRC_FILES := \
+	audio_bringup.c \
+	audio_cards.c \
+	audio_convert.c \
 	audio_hw.c \
-	audio_route.c
+	audio_route.c \
+	audio_stats.c
 
 LOCAL_C_INCLUDES := \
 	external/expat/lib \
@@ -38,3 +42,5 @@ LOCAL_C_INCLUDES := \
 LOCAL_CFLAGS := -Wno-unused-variable
 
 include $(BUILD_SHARED_LIBRARY)
+
+include $(call all-makefiles-under,$(LOCAL_PATH))
@@ -0,0 +1,240 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_hw_primary"
+/*#define LOG_NDEBUG 0*/
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <cutils/log.h>
+
+#include "audio_bringup.h"
+
+/* anything longer is more likely a typo than an amplifier ramp */
+#define MAX_SLEEP_MS 1000
+
+enum bringup_op {
+    BRINGUP_CTL,
+    BRINGUP_SLEEP,
+    BRINGUP_WRITE,
+};
+
+struct bringup_step {
+    enum bringup_op op;
+    const char *arg; /* ctl name or path, points into bringup_script.text */
+    const char *value;
+    unsigned int ms;
+};
+
+struct bringup_script {
+    char *command;
+    char *text; /* copy of command, cut into the step arguments */
+    bool shell;
+    unsigned int num_steps;
+    struct bringup_step steps[];
+};
+
+static char *trim(char *str)
+{
+    char *end;
+
+    while (isspace((unsigned char)*str))
+        str++;
+    end = str + strlen(str);
+    while (end > str && isspace((unsigned char)end[-1]))
+        end--;
+    *end = '\0';
+    return str;
+}
+
+/* splits "<keyword> <rest>", returns rest or NULL if the keyword differs */
+static char *match_keyword(char *stmt, const char *keyword)
+{
+    size_t len = strlen(keyword);
+
+    if (strncmp(stmt, keyword, len) != 0 || !isspace((unsigned char)stmt[len]))
+        return NULL;
+    return trim(stmt + len);
+}
+
+static int parse_step(char *stmt, struct bringup_step *step)
+{
+    char *rest;
+    char *sep;
+
+    if ((rest = match_keyword(stmt, "ctl")) != NULL) {
+        sep = strchr(rest, '=');
+        if (!sep)
+            return -EINVAL;
+        *sep = '\0';
+        step->op = BRINGUP_CTL;
+        step->arg = trim(rest);
+        step->value = trim(sep + 1);
+        return *step->arg && *step->value ? 0 : -EINVAL;
+    }
+    if ((rest = match_keyword(stmt, "msleep")) != NULL) {
+        char *end;
+        long ms = strtol(rest, &end, 10);
+
+        if (end == rest || *end != '\0' || ms < 0 || ms > MAX_SLEEP_MS)
+            return -EINVAL;
+        step->op = BRINGUP_SLEEP;
+        step->ms = ms;
+        return 0;
+    }
+    if ((rest = match_keyword(stmt, "write")) != NULL) {
+        sep = rest + strcspn(rest, " \t");
+        if (*rest != '/' || *sep == '\0')
+            return -EINVAL;
+        *sep = '\0';
+        step->op = BRINGUP_WRITE;
+        step->arg = rest;
+        step->value = trim(sep + 1);
+        return 0;
+    }
+
+    return -EINVAL;
+}
+
+struct bringup_script *bringup_script_parse(const char *command)
+{
+    struct bringup_script *script;
+    unsigned int max_steps = 1;
+    const char *c;
+    char *stmt;
+    char *next;
+
+    for (c = command; *c; c++)
+        if (*c == ';')
+            max_steps++;
+
+    script = calloc(1, sizeof(*script) + max_steps * sizeof(struct bringup_step));
+    if (!script)
+        return NULL;
+    script->command = strdup(command);
+    script->text = strdup(command);
+    if (!script->command || !script->text) {
+        bringup_script_free(script);
+        return NULL;
+    }
+
+    for (stmt = script->text; stmt; stmt = next) {
+        next = strchr(stmt, ';');
+        if (next)
+            *next++ = '\0';
+        stmt = trim(stmt);
+        if (*stmt == '\0')
+            continue;
+        if (parse_step(stmt, &script->steps[script->num_steps]) < 0) {
+            script->shell = true;
+            script->num_steps = 0;
+            break;
+        }
+        script->num_steps++;
+    }
+
+    return script;
+}
+
+void bringup_script_free(struct bringup_script *script)
+{
+    if (!script)
+        return;
+    free(script->command);
+    free(script->text);
+    free(script);
+}
+
+const char *bringup_script_command(const struct bringup_script *script)
+{
+    return script->command;
+}
+
+bool bringup_script_is_shell(const struct bringup_script *script)
+{
+    return script->shell;
+}
+
+static int write_file(const char *path, const char *value)
+{
+    size_t len = strlen(value);
+    ssize_t written;
+    int fd;
+
+    fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        ALOGE("unable to open %s: %s", path, strerror(errno));
+        return -errno;
+    }
+    written = write(fd, value, len);
+    if (written < 0 || (size_t)written != len) {
+        int ret = written < 0 ? -errno : -EIO;
+
+        ALOGE("unable to write '%s' to %s: %s", value, path, strerror(-ret));
+        close(fd);
+        return ret;
+    }
+    close(fd);
+
+    return 0;
+}
+
+int bringup_script_run(const struct bringup_script *script, struct audio_route *ar)
+{
+    bool dirty = false;
+    unsigned int i;
+    int ret = 0;
+
+    if (script->shell) {
+        ret = system(script->command);
+        if (ret != 0) {
+            ALOGW("{%s} returned %d", script->command, ret);
+            return -EIO;
+        }
+        return 0;
+    }
+
+    for (i = 0; i < script->num_steps && ret == 0; i++) {
+        const struct bringup_step *step = &script->steps[i];
+
+        if (step->op != BRINGUP_CTL && dirty) {
+            update_mixer_state(ar);
+            dirty = false;
+        }
+        switch (step->op) {
+        case BRINGUP_CTL:
+            ret = audio_route_set_ctl(ar, step->arg, step->value);
+            dirty = true;
+            break;
+        case BRINGUP_SLEEP:
+            usleep(step->ms * 1000);
+            break;
+        case BRINGUP_WRITE:
+            ret = write_file(step->arg, step->value);
+            break;
+        }
+    }
+    if (dirty)
+        update_mixer_state(ar);
+
+    return ret;
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef AUDIO_BRINGUP_H
+#define AUDIO_BRINGUP_H
+
+#include <stdbool.h>
+
+#include "audio_route.h"
+
+/*
+ * Bringup commands, from the hal.audio.*.command properties. A command is
+ * a list of statements separated by ';':
+ *
+ *   ctl <name>=<values>   sets a mixer ctl, values as in the mixer paths
+ *   msleep <ms>           waits, e.g. for an amplifier to power up
+ *   write <path> <value>  writes value to a file, usually in sysfs
+ *
+ * e.g. "ctl Speaker Switch=1; msleep 20; write /sys/class/amp/enable 1".
+ * These run in-process on the mixer of the audio_route. A command with any
+ * other statement is taken as a shell command line, as the older versions
+ * of the HAL did, and runs through system().
+ */
+
+struct bringup_script;
+
+/* compiles a command, returns NULL only when out of memory */
+struct bringup_script *bringup_script_parse(const char *command);
+void bringup_script_free(struct bringup_script *script);
+
+/* the command as it was given */
+const char *bringup_script_command(const struct bringup_script *script);
+
+/* true if the command needs a shell */
+bool bringup_script_is_shell(const struct bringup_script *script);
+
+/*
+ * Runs the script, stopping at the first statement that fails. The mixer
+ * ctls are written before each msleep and write, and at the end, so the
+ * statements take effect in order. Returns 0 or a negative errno.
+ */
+int bringup_script_run(const struct bringup_script *script, struct audio_route *ar);
+
+#endif
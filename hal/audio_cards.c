@@ -0,0 +1,682 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_hw_primary"
+/*#define LOG_NDEBUG 0*/
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cutils/log.h>
+#include <cutils/properties.h>
+
+#include <sound/asound.h>
+
+#include "audio_cards.h"
+
+#define SND_DEV_DIR "/dev/snd"
+/* nodes come and go in bursts on hotplug, rescan once they settled */
+#define RESCAN_DELAY_MS 200
+/*
+ * Lookups hand out pointers into the snapshot they read, which callers only
+ * keep for the duration of a call. A replaced snapshot is freed by the first
+ * rescan that comes this long after it was replaced.
+ */
+#define RETIRED_GRACE_MS 10000
+
+struct audio_card_pcm {
+    char node[16]; /* pcmC<card>D<device><p|c>, like the /dev/snd entry */
+    bool hdmi;
+    struct snd_pcm_info info;
+    /* filled on the first audio_cards_get_caps(), under registry.lock */
+    bool has_caps;
+    struct audio_pcm_caps caps;
+};
+
+static const unsigned int common_rates[] = {
+    8000, 11025, 12000, 16000, 22050, 24000, 32000, 44100,
+    48000, 64000, 88200, 96000, 176400, 192000,
+};
+
+struct audio_card_snapshot {
+    struct audio_card_snapshot *retired_next;
+    uint64_t retired_ms; /* CLOCK_MONOTONIC, once on the retired list */
+    unsigned int generation;
+    int primary_hdmi; /* -1 if hal.audio.primary.hdmi is not set */
+    char node_prop[AUDIO_CARD_SLOT_COUNT][PROPERTY_VALUE_MAX];
+    unsigned int num_cards;
+    struct audio_card card[AUDIO_CARDS_MAX];
+    unsigned int num_pcms;
+    struct audio_card_pcm pcm[];
+};
+
+static const struct {
+    const char *prop;
+    const char *fallback_prop;
+    int stream;
+    bool hdmi;
+} slot_info[AUDIO_CARD_SLOT_COUNT] = {
+    [AUDIO_CARD_OUT_SPEAKER] =
+        { "hal.audio.out.speaker", "hal.audio.out", SNDRV_PCM_STREAM_PLAYBACK, false },
+    [AUDIO_CARD_OUT_HEADPHONE] =
+        { "hal.audio.out.headphone", "hal.audio.out", SNDRV_PCM_STREAM_PLAYBACK, false },
+    [AUDIO_CARD_OUT_DOCK] =
+        { "hal.audio.out.dock", "hal.audio.out", SNDRV_PCM_STREAM_PLAYBACK, false },
+    [AUDIO_CARD_IN_MIC] =
+        { "hal.audio.in.mic", "hal.audio.in", SNDRV_PCM_STREAM_CAPTURE, false },
+    [AUDIO_CARD_IN_HEADSET] =
+        { "hal.audio.in.headset", "hal.audio.in", SNDRV_PCM_STREAM_CAPTURE, false },
+    [AUDIO_CARD_OUT_HDMI] =
+        { "hal.audio.out.hdmi", NULL, SNDRV_PCM_STREAM_PLAYBACK, true },
+    [AUDIO_CARD_IN_HDMI] =
+        { "hal.audio.in.hdmi", NULL, SNDRV_PCM_STREAM_CAPTURE, true },
+};
+
+static struct {
+    pthread_mutex_t lock; /* serializes init, release and the rescans */
+    unsigned int refs;
+    _Atomic(struct audio_card_snapshot *) current;
+    /* replaced snapshots, newest first, kept for RETIRED_GRACE_MS */
+    struct audio_card_snapshot *retired;
+    int inotify_fd;
+    int event_fd;
+    pthread_t thread;
+    bool thread_started;
+    struct {
+        audio_cards_listener_t fn;
+        void *context;
+    } listeners[AUDIO_CARDS_MAX_LISTENERS];
+} registry = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .inotify_fd = -1,
+    .event_fd = -1,
+};
+
+static int compare_ints(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+static int add_pcm(struct audio_card_pcm **pcms, unsigned int *num_pcms,
+                   unsigned int *size, const struct snd_pcm_info *info)
+{
+    struct audio_card_pcm *pcm;
+
+    if (*num_pcms >= *size) {
+        unsigned int new_size = *size ? *size * 2 : 8;
+        struct audio_card_pcm *new_pcms = realloc(*pcms, new_size * sizeof(*pcm));
+        if (!new_pcms)
+            return -ENOMEM;
+        /* snapshots are compared with memcmp(), keep the padding zeroed */
+        memset(new_pcms + *size, 0, (new_size - *size) * sizeof(*pcm));
+        *pcms = new_pcms;
+        *size = new_size;
+    }
+
+    pcm = &(*pcms)[(*num_pcms)++];
+    snprintf(pcm->node, sizeof(pcm->node), "pcmC%uD%u%c", info->card, info->device,
+             info->stream == SNDRV_PCM_STREAM_CAPTURE ? 'c' : 'p');
+    pcm->hdmi = strcasestr((const char *)info->id, "HDMI") != NULL;
+    pcm->info = *info;
+    return 0;
+}
+
+/*
+ * Lists the PCMs of a card through its control node, unlike opening the
+ * PCM nodes this works while they are in use and never blocks.
+ */
+static void scan_card(int card, struct audio_card *card_info, struct audio_card_pcm **pcms,
+                      unsigned int *num_pcms, unsigned int *size)
+{
+    struct snd_ctl_card_info ctl_info;
+    char path[PATH_MAX];
+    int device = -1;
+    int fd;
+
+    snprintf(path, sizeof(path), SND_DEV_DIR "/controlC%d", card);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        ALOGV("can't open %s: %s", path, strerror(errno));
+        return;
+    }
+
+    memset(card_info, 0, sizeof(*card_info));
+    card_info->card = card;
+    memset(&ctl_info, 0, sizeof(ctl_info));
+    if (ioctl(fd, SNDRV_CTL_IOCTL_CARD_INFO, &ctl_info) == 0) {
+        snprintf(card_info->id, sizeof(card_info->id), "%s", (const char *)ctl_info.id);
+        snprintf(card_info->driver, sizeof(card_info->driver), "%s",
+                 (const char *)ctl_info.driver);
+    }
+
+    while (ioctl(fd, SNDRV_CTL_IOCTL_PCM_NEXT_DEVICE, &device) == 0 && device >= 0) {
+        int stream;
+
+        for (stream = SNDRV_PCM_STREAM_PLAYBACK; stream <= SNDRV_PCM_STREAM_CAPTURE; stream++) {
+            struct snd_pcm_info info;
+
+            memset(&info, 0, sizeof(info));
+            info.device = device;
+            info.subdevice = 0;
+            info.stream = stream;
+            if (ioctl(fd, SNDRV_CTL_IOCTL_PCM_INFO, &info) < 0)
+                continue;
+            /* ignore IntelHDMI */
+            if (strstr((const char *)info.id, "IntelHDMI"))
+                continue;
+            ALOGD("found audio %s at pcmC%dD%d\ncard: %d/%d id: %s\nname: %s\nsubname: %s\nstream: %d",
+                    stream == SNDRV_PCM_STREAM_CAPTURE ? "in" : "out", card, device,
+                    info.card, info.device, info.id, info.name, info.subname, info.stream);
+            if (add_pcm(pcms, num_pcms, size, &info) < 0) {
+                ALOGE("unable to grow PCM list");
+                break;
+            }
+        }
+    }
+
+    close(fd);
+}
+
+static struct audio_card_snapshot *build_snapshot(void)
+{
+    struct audio_card_snapshot *snap;
+    struct audio_card_pcm *pcms = NULL;
+    unsigned int num_pcms = 0;
+    unsigned int size = 0;
+    struct audio_card card_info[AUDIO_CARDS_MAX];
+    unsigned int num_card_info = 0;
+    int cards[64];
+    unsigned int num_cards = 0;
+    unsigned int i;
+    struct dirent *de;
+    DIR *dir;
+
+    dir = opendir(SND_DEV_DIR);
+    if (dir) {
+        while ((de = readdir(dir)) != NULL && num_cards < sizeof(cards) / sizeof(cards[0])) {
+            int card;
+            if (sscanf(de->d_name, "controlC%d", &card) == 1)
+                cards[num_cards++] = card;
+        }
+        closedir(dir);
+    } else {
+        ALOGW("can't open %s: %s", SND_DEV_DIR, strerror(errno));
+    }
+
+    qsort(cards, num_cards, sizeof(cards[0]), compare_ints);
+    for (i = 0; i < num_cards; i++) {
+        unsigned int first_pcm = num_pcms;
+        struct audio_card info;
+
+        scan_card(cards[i], &info, &pcms, &num_pcms, &size);
+        if (num_pcms > first_pcm && num_card_info < AUDIO_CARDS_MAX)
+            card_info[num_card_info++] = info;
+    }
+
+    snap = calloc(1, sizeof(*snap) + num_pcms * sizeof(*pcms));
+    if (!snap) {
+        free(pcms);
+        return NULL;
+    }
+    if (num_pcms)
+        memcpy(snap->pcm, pcms, num_pcms * sizeof(*pcms));
+    snap->num_pcms = num_pcms;
+    free(pcms);
+    memcpy(snap->card, card_info, num_card_info * sizeof(card_info[0]));
+    snap->num_cards = num_card_info;
+
+    for (i = 0; i < AUDIO_CARD_SLOT_COUNT; i++) {
+        if (!property_get(slot_info[i].prop, snap->node_prop[i], NULL) &&
+                slot_info[i].fallback_prop)
+            property_get(slot_info[i].fallback_prop, snap->node_prop[i], NULL);
+    }
+
+    char prop[PROPERTY_VALUE_MAX];
+    if (property_get("hal.audio.primary.hdmi", prop, NULL))
+        snap->primary_hdmi = property_get_bool("hal.audio.primary.hdmi", false);
+    else
+        snap->primary_hdmi = -1;
+
+    return snap;
+}
+
+static bool same_snapshot(const struct audio_card_snapshot *a,
+                          const struct audio_card_snapshot *b)
+{
+    unsigned int i;
+
+    if (a->num_pcms != b->num_pcms || a->primary_hdmi != b->primary_hdmi ||
+            memcmp(a->node_prop, b->node_prop, sizeof(a->node_prop)) ||
+            a->num_cards != b->num_cards ||
+            memcmp(a->card, b->card, a->num_cards * sizeof(a->card[0])))
+        return false;
+
+    /* the caps are only filled on demand, they don't count */
+    for (i = 0; i < a->num_pcms; i++) {
+        if (strcmp(a->pcm[i].node, b->pcm[i].node) || a->pcm[i].hdmi != b->pcm[i].hdmi ||
+                memcmp(&a->pcm[i].info, &b->pcm[i].info, sizeof(a->pcm[i].info)))
+            return false;
+    }
+    return true;
+}
+
+static uint64_t monotonic_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* called with registry.lock held, frees the snapshots past their grace period */
+static void reclaim_retired_l(uint64_t now_ms)
+{
+    struct audio_card_snapshot **link = &registry.retired;
+    struct audio_card_snapshot *snap;
+
+    /* the list is sorted by retirement, everything after the first stale one is too */
+    while ((snap = *link) != NULL && now_ms - snap->retired_ms < RETIRED_GRACE_MS)
+        link = &snap->retired_next;
+    *link = NULL;
+    while (snap) {
+        struct audio_card_snapshot *next = snap->retired_next;
+        ALOGV("freeing sound cards generation %u", snap->generation);
+        free(snap);
+        snap = next;
+    }
+}
+
+/* called with registry.lock held */
+static int refresh_l(void)
+{
+    struct audio_card_snapshot *snap = build_snapshot();
+    struct audio_card_snapshot *old = atomic_load(&registry.current);
+    uint64_t now_ms = monotonic_ms();
+
+    reclaim_retired_l(now_ms);
+    if (!snap) {
+        ALOGE("unable to allocate a sound card snapshot");
+        return -ENOMEM;
+    }
+
+    if (old && same_snapshot(old, snap)) {
+        free(snap);
+        return 0;
+    }
+
+    snap->generation = old ? old->generation + 1 : 1;
+    atomic_store_explicit(&registry.current, snap, memory_order_release);
+    if (old) {
+        old->retired_ms = now_ms;
+        old->retired_next = registry.retired;
+        registry.retired = old;
+    }
+    ALOGI("sound cards generation %u: %u PCMs", snap->generation, snap->num_pcms);
+
+    /* the first scan is not news, nobody could have listened yet */
+    if (old) {
+        unsigned int i;
+
+        for (i = 0; i < AUDIO_CARDS_MAX_LISTENERS; i++)
+            if (registry.listeners[i].fn)
+                registry.listeners[i].fn(registry.listeners[i].context);
+    }
+    return 0;
+}
+
+int audio_cards_add_listener(audio_cards_listener_t fn, void *context)
+{
+    unsigned int i;
+    int ret = -ENOSPC;
+
+    pthread_mutex_lock(&registry.lock);
+    for (i = 0; i < AUDIO_CARDS_MAX_LISTENERS; i++) {
+        if (!registry.listeners[i].fn) {
+            registry.listeners[i].fn = fn;
+            registry.listeners[i].context = context;
+            ret = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&registry.lock);
+
+    return ret;
+}
+
+void audio_cards_remove_listener(audio_cards_listener_t fn, void *context)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&registry.lock);
+    for (i = 0; i < AUDIO_CARDS_MAX_LISTENERS; i++) {
+        if (registry.listeners[i].fn == fn && registry.listeners[i].context == context) {
+            registry.listeners[i].fn = NULL;
+            registry.listeners[i].context = NULL;
+        }
+    }
+    pthread_mutex_unlock(&registry.lock);
+}
+
+void audio_cards_refresh(void)
+{
+    pthread_mutex_lock(&registry.lock);
+    refresh_l();
+    pthread_mutex_unlock(&registry.lock);
+}
+
+static void *watch_thread(void *arg __unused)
+{
+    struct pollfd fds[2];
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int ret;
+
+    fds[0].fd = registry.event_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = registry.inotify_fd;
+    fds[1].events = POLLIN;
+
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            ALOGE("sound card watch failed: %s", strerror(errno));
+            break;
+        }
+        if (fds[0].revents)
+            break;
+        if (!(fds[1].revents & POLLIN))
+            continue;
+
+        /* the nodes are created, then chmod'ed by ueventd: wait for quiet */
+        do {
+            while (read(registry.inotify_fd, buf, sizeof(buf)) > 0)
+                ;
+            ret = poll(fds, 2, RESCAN_DELAY_MS);
+        } while (ret > 0 && !fds[0].revents);
+        if (ret > 0)
+            break;
+
+        audio_cards_refresh();
+    }
+
+    return NULL;
+}
+
+int audio_cards_init(void)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&registry.lock);
+    if (registry.refs++ > 0)
+        goto exit;
+
+    ret = refresh_l();
+
+    registry.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (registry.inotify_fd < 0 ||
+            inotify_add_watch(registry.inotify_fd, SND_DEV_DIR,
+                              IN_CREATE | IN_DELETE | IN_ATTRIB) < 0) {
+        ALOGW("unable to watch %s: %s, rescanning on demand", SND_DEV_DIR, strerror(errno));
+        goto err_watch;
+    }
+
+    registry.event_fd = eventfd(0, EFD_CLOEXEC);
+    if (registry.event_fd < 0) {
+        ALOGW("eventfd failed: %s, rescanning on demand", strerror(errno));
+        goto err_watch;
+    }
+
+    if (pthread_create(&registry.thread, NULL, watch_thread, NULL) != 0) {
+        ALOGW("unable to start the sound card watch, rescanning on demand");
+        goto err_watch;
+    }
+    registry.thread_started = true;
+    goto exit;
+
+err_watch:
+    if (registry.event_fd >= 0)
+        close(registry.event_fd);
+    registry.event_fd = -1;
+    if (registry.inotify_fd >= 0)
+        close(registry.inotify_fd);
+    registry.inotify_fd = -1;
+exit:
+    pthread_mutex_unlock(&registry.lock);
+    return ret;
+}
+
+void audio_cards_release(void)
+{
+    struct audio_card_snapshot *snap;
+    bool thread_started;
+
+    pthread_mutex_lock(&registry.lock);
+    if (registry.refs == 0 || --registry.refs > 0) {
+        pthread_mutex_unlock(&registry.lock);
+        return;
+    }
+    thread_started = registry.thread_started;
+    registry.thread_started = false;
+    pthread_mutex_unlock(&registry.lock);
+
+    /* the watch thread takes registry.lock to rescan */
+    if (thread_started) {
+        uint64_t one = 1;
+        if (write(registry.event_fd, &one, sizeof(one)) != sizeof(one))
+            ALOGE("unable to stop the sound card watch");
+        else
+            pthread_join(registry.thread, NULL);
+    }
+
+    pthread_mutex_lock(&registry.lock);
+    if (registry.event_fd >= 0)
+        close(registry.event_fd);
+    registry.event_fd = -1;
+    if (registry.inotify_fd >= 0)
+        close(registry.inotify_fd);
+    registry.inotify_fd = -1;
+
+    free(atomic_exchange(&registry.current, NULL));
+    while ((snap = registry.retired) != NULL) {
+        registry.retired = snap->retired_next;
+        free(snap);
+    }
+    pthread_mutex_unlock(&registry.lock);
+}
+
+static bool snapshot_has_stream(const struct audio_card_snapshot *snap, int stream)
+{
+    unsigned int i;
+
+    for (i = 0; i < snap->num_pcms; i++)
+        if (snap->pcm[i].info.stream == stream)
+            return true;
+    return false;
+}
+
+struct snd_pcm_info *audio_cards_find(enum audio_card_slot slot)
+{
+    struct audio_card_snapshot *snap;
+    const char *node;
+    unsigned int i;
+
+    snap = atomic_load_explicit(&registry.current, memory_order_acquire);
+
+    /* without a watch, a card showing up late is only seen by rescanning */
+    if (registry.inotify_fd < 0 &&
+            (!snap || !snapshot_has_stream(snap, slot_info[slot].stream))) {
+        audio_cards_refresh();
+        snap = atomic_load_explicit(&registry.current, memory_order_acquire);
+    }
+    if (!snap)
+        return NULL;
+
+    node = snap->node_prop[slot];
+    if (node[0]) {
+        for (i = 0; i < snap->num_pcms; i++) {
+            if (snap->pcm[i].info.stream == slot_info[slot].stream &&
+                    !strcmp(snap->pcm[i].node, node))
+                return &snap->pcm[i].info;
+        }
+        ALOGW("%s from property not found", node);
+    }
+
+    for (i = 0; i < snap->num_pcms; i++) {
+        if (snap->pcm[i].info.stream == slot_info[slot].stream &&
+                snap->pcm[i].hdmi == slot_info[slot].hdmi)
+            return &snap->pcm[i].info;
+    }
+
+    return NULL;
+}
+
+bool audio_cards_primary_hdmi(bool def)
+{
+    struct audio_card_snapshot *snap =
+            atomic_load_explicit(&registry.current, memory_order_acquire);
+
+    if (!snap || snap->primary_hdmi < 0)
+        return def;
+    return snap->primary_hdmi;
+}
+
+unsigned int audio_cards_list(struct audio_card *cards, unsigned int max)
+{
+    struct audio_card_snapshot *snap =
+            atomic_load_explicit(&registry.current, memory_order_acquire);
+    unsigned int n;
+
+    if (!snap)
+        return 0;
+    n = snap->num_cards < max ? snap->num_cards : max;
+    memcpy(cards, snap->card, n * sizeof(cards[0]));
+    return n;
+}
+
+unsigned int audio_cards_generation(void)
+{
+    struct audio_card_snapshot *snap =
+            atomic_load_explicit(&registry.current, memory_order_acquire);
+
+    return snap ? snap->generation : 0;
+}
+
+static void hw_params_any(struct snd_pcm_hw_params *params)
+{
+    int i;
+
+    memset(params, 0, sizeof(*params));
+    for (i = SNDRV_PCM_HW_PARAM_FIRST_MASK; i <= SNDRV_PCM_HW_PARAM_LAST_MASK; i++) {
+        struct snd_mask *mask = &params->masks[i - SNDRV_PCM_HW_PARAM_FIRST_MASK];
+        memset(mask->bits, 0xff, sizeof(mask->bits));
+    }
+    for (i = SNDRV_PCM_HW_PARAM_FIRST_INTERVAL; i <= SNDRV_PCM_HW_PARAM_LAST_INTERVAL; i++) {
+        struct snd_interval *interval =
+                &params->intervals[i - SNDRV_PCM_HW_PARAM_FIRST_INTERVAL];
+        interval->min = 0;
+        interval->max = UINT_MAX;
+    }
+    params->rmask = ~0U;
+    params->info = ~0U;
+}
+
+/*
+ * Refines the hw_params of the PCM node. Unlike pcm_params_get(), the node
+ * is opened non blocking so that a PCM in use fails right away.
+ */
+static int query_caps(const struct audio_card_pcm *pcm, struct audio_pcm_caps *caps)
+{
+    struct snd_pcm_hw_params params;
+    const struct snd_interval *channels;
+    const struct snd_mask *formats;
+    char path[PATH_MAX];
+    unsigned int i;
+    int fd;
+
+    snprintf(path, sizeof(path), SND_DEV_DIR "/%s", pcm->node);
+    fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+        return -errno;
+
+    hw_params_any(&params);
+    if (ioctl(fd, SNDRV_PCM_IOCTL_HW_REFINE, &params) < 0) {
+        int ret = -errno;
+        ALOGW("can't refine the hw_params of %s: %s", pcm->node, strerror(errno));
+        close(fd);
+        return ret;
+    }
+
+    memset(caps, 0, sizeof(*caps));
+    channels = &params.intervals[SNDRV_PCM_HW_PARAM_CHANNELS - SNDRV_PCM_HW_PARAM_FIRST_INTERVAL];
+    caps->channels_min = channels->min;
+    caps->channels_max = channels->max;
+    formats = &params.masks[SNDRV_PCM_HW_PARAM_FORMAT - SNDRV_PCM_HW_PARAM_FIRST_MASK];
+    caps->formats = formats->bits[0] | (uint64_t)formats->bits[1] << 32;
+
+    /* the rate is an interval, check the rates AudioFlinger uses one by one */
+    for (i = 0; i < sizeof(common_rates) / sizeof(common_rates[0]); i++) {
+        struct snd_interval *rate =
+                &params.intervals[SNDRV_PCM_HW_PARAM_RATE - SNDRV_PCM_HW_PARAM_FIRST_INTERVAL];
+
+        hw_params_any(&params);
+        rate->min = rate->max = common_rates[i];
+        rate->integer = 1;
+        if (ioctl(fd, SNDRV_PCM_IOCTL_HW_REFINE, &params) == 0 &&
+                caps->num_rates < AUDIO_PCM_CAPS_MAX_RATES)
+            caps->rates[caps->num_rates++] = common_rates[i];
+    }
+
+    close(fd);
+    ALOGI("%s: %u rates from %u to %u Hz, %u to %u channels, formats %#llx", pcm->node,
+          caps->num_rates, caps->num_rates ? caps->rates[0] : 0,
+          caps->num_rates ? caps->rates[caps->num_rates - 1] : 0,
+          caps->channels_min, caps->channels_max, (unsigned long long)caps->formats);
+    return 0;
+}
+
+int audio_cards_get_caps(const struct snd_pcm_info *info, struct audio_pcm_caps *caps)
+{
+    /* info always points into a snapshot entry, see audio_cards_find() */
+    struct audio_card_pcm *pcm = (struct audio_card_pcm *)
+            ((char *)info - offsetof(struct audio_card_pcm, info));
+    int ret = 0;
+
+    pthread_mutex_lock(&registry.lock);
+    if (!pcm->has_caps) {
+        ret = query_caps(pcm, &pcm->caps);
+        pcm->has_caps = ret == 0;
+    }
+    if (ret == 0)
+        *caps = pcm->caps;
+    pthread_mutex_unlock(&registry.lock);
+
+    return ret;
+}
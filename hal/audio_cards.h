@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef AUDIO_CARDS_H
+#define AUDIO_CARDS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <sound/asound.h>
+
+/*
+ * Registry of the PCM devices of all the sound cards, and of the
+ * hal.audio.* properties that pick among them.
+ *
+ * The cards are scanned once by audio_cards_init(), then again from a
+ * background thread whenever /dev/snd changes. Lookups read the latest
+ * snapshot without taking a lock and never touch the filesystem, except
+ * when no PCM of the wanted direction is known yet.
+ */
+
+/* the endpoint a PCM is picked for, each has its own hal.audio.* property */
+enum audio_card_slot {
+    AUDIO_CARD_OUT_SPEAKER,
+    AUDIO_CARD_OUT_HEADPHONE,
+    AUDIO_CARD_OUT_DOCK,
+    AUDIO_CARD_IN_MIC,
+    AUDIO_CARD_IN_HEADSET,
+    AUDIO_CARD_OUT_HDMI,
+    AUDIO_CARD_IN_HDMI,
+    AUDIO_CARD_SLOT_COUNT,
+};
+
+/* starts the registry, calls can be nested */
+int audio_cards_init(void);
+void audio_cards_release(void);
+
+/* rescans the cards and re-reads the properties */
+void audio_cards_refresh(void);
+
+/*
+ * Returns the PCM to use for an endpoint: the node named by its property
+ * if there is one, otherwise the first HDMI (for the HDMI slots) or
+ * non HDMI PCM of the right direction. The result points into the
+ * snapshot it was found in: use it right away and don't keep it, it is
+ * freed some time after a rescan replaces that snapshot.
+ */
+struct snd_pcm_info *audio_cards_find(enum audio_card_slot slot);
+
+/* hw_params constraints of a PCM node */
+#define AUDIO_PCM_CAPS_MAX_RATES 16
+struct audio_pcm_caps {
+    unsigned int num_rates;
+    unsigned int rates[AUDIO_PCM_CAPS_MAX_RATES]; /* in increasing order */
+    unsigned int channels_min;
+    unsigned int channels_max;
+    uint64_t formats; /* 1 << SNDRV_PCM_FORMAT_* for each supported format */
+};
+
+/*
+ * Fills caps with what the PCM accepts among the common sample rates.
+ * The PCM node is only opened the first time, and the answer is kept until
+ * the PCM goes away. Returns -EBUSY if it is in use and wasn't queried yet.
+ */
+int audio_cards_get_caps(const struct snd_pcm_info *info, struct audio_pcm_caps *caps);
+
+/* a sound card with at least one PCM */
+#define AUDIO_CARDS_MAX 32
+struct audio_card {
+    int card;
+    char id[16]; /* short name, e.g. "PCH" */
+    char driver[16]; /* e.g. "USB-Audio" */
+};
+
+/* copies up to max cards, in increasing order, and returns how many */
+unsigned int audio_cards_list(struct audio_card *cards, unsigned int max);
+
+/* value of hal.audio.primary.hdmi, or def when it is not set */
+bool audio_cards_primary_hdmi(bool def);
+
+/* bumped every time a rescan finds a different set of PCMs */
+unsigned int audio_cards_generation(void);
+
+/*
+ * Called after the generation was bumped, from the thread that rescanned and
+ * with the registry locked: it must not call back into the registry, only
+ * hand the work to another thread. Once audio_cards_remove_listener()
+ * returns, the listener is not running and won't be called again.
+ */
+#define AUDIO_CARDS_MAX_LISTENERS 4
+typedef void (*audio_cards_listener_t)(void *context);
+int audio_cards_add_listener(audio_cards_listener_t fn, void *context);
+void audio_cards_remove_listener(audio_cards_listener_t fn, void *context);
+
+#endif
@@ -0,0 +1,1285 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_hw_primary"
+/*#define LOG_NDEBUG 0*/
+
+#include <errno.h>
+#include <string.h>
+
+#include <cutils/log.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "audio_convert.h"
+
+/*
+ * The 8 bit kernels produce offset binary samples, like
+ * memcpy_by_audio_format() to AUDIO_FORMAT_PCM_8_BIT always did for
+ * PCM_FORMAT_S8 cards.
+ */
+
+static inline int16_t downmix_sample(int16_t left, int16_t right)
+{
+    return (int16_t)(((int32_t)left + right) >> 1);
+}
+
+static inline uint8_t u8_sample(int16_t sample)
+{
+    return (uint8_t)((sample >> 8) + 0x80);
+}
+
+/* the gains are applied in 1.15 fixed point, unity is left alone by the callers */
+static inline int16_t gain_q15(int32_t gain)
+{
+    gain >>= 15;
+    return gain > INT16_MAX ? INT16_MAX : gain;
+}
+
+static inline int16_t gain_sample(int16_t sample, int16_t gain)
+{
+    return (int16_t)(((int32_t)sample * gain) >> 15);
+}
+
+/* the float samples are in [-1, 1), with all the bits of the captured ones */
+#define FLOAT_FROM_I16 (1.0f / 32768.0f)
+#define FLOAT_FROM_I32 (1.0f / 2147483648.0f)
+#define FLOAT_FROM_Q8_24 (1.0f / 8388608.0f)
+
+/*
+ * Back from float, anything out of [-1, 1) is clamped and the rest is
+ * truncated, which the SIMD conversions do the same way. I32_MAX_FLOAT is
+ * the largest float below 2^31.
+ */
+#define I32_MAX_FLOAT 2147483520.0f
+
+static inline int16_t i16_sample(float sample)
+{
+    float v = sample * 32768.0f;
+
+    return (int16_t)(v > 32767.0f ? 32767.0f : v < -32768.0f ? -32768.0f : v);
+}
+
+static inline int32_t i32_sample(float sample)
+{
+    float v = sample * 2147483648.0f;
+
+    return (int32_t)(v > I32_MAX_FLOAT ? I32_MAX_FLOAT : v < -2147483648.0f ? -2147483648.0f : v);
+}
+
+static inline uint8_t u8_float_sample(float sample)
+{
+    float v = sample * 128.0f;
+
+    return (uint8_t)((int)(v > 127.0f ? 127.0f : v < -128.0f ? -128.0f : v) + 0x80);
+}
+
+/* scalar tails, also used for the whole buffer when there is no SIMD */
+
+static void stereo_to_mono_i16_c(int16_t *dst, const int16_t *src, size_t frames)
+{
+    size_t i;
+
+    for (i = 0; i < frames; i++)
+        dst[i] = downmix_sample(src[i * 2], src[i * 2 + 1]);
+}
+
+static void stereo_to_mono_i32_c(int32_t *dst, const int16_t *src, size_t frames)
+{
+    size_t i;
+
+    for (i = 0; i < frames; i++)
+        dst[i] = (int32_t)downmix_sample(src[i * 2], src[i * 2 + 1]) << 16;
+}
+
+static void stereo_to_mono_u8_c(uint8_t *dst, const int16_t *src, size_t frames)
+{
+    size_t i;
+
+    for (i = 0; i < frames; i++)
+        dst[i] = u8_sample(downmix_sample(src[i * 2], src[i * 2 + 1]));
+}
+
+static void i32_from_i16_c(int32_t *dst, const int16_t *src, size_t samples)
+{
+    size_t i;
+
+    for (i = 0; i < samples; i++)
+        dst[i] = (int32_t)src[i] << 16;
+}
+
+static void mix_i16_c(int16_t *dst, const int16_t *src, size_t samples)
+{
+    size_t i;
+
+    for (i = 0; i < samples; i++) {
+        int32_t sum = (int32_t)dst[i] + src[i];
+        dst[i] = sum > INT16_MAX ? INT16_MAX : sum < INT16_MIN ? INT16_MIN : sum;
+    }
+}
+
+static void u8_from_i16_c(uint8_t *dst, const int16_t *src, size_t samples)
+{
+    size_t i;
+
+    for (i = 0; i < samples; i++)
+        dst[i] = u8_sample(src[i]);
+}
+
+/*
+ * Capture kernels: channel c of the output is channel c of the input, or
+ * its last channel when the input has fewer.
+ */
+
+/* even samples take gain0, odd ones gain1 */
+static void gain_i16_c(int16_t *dst, const int16_t *src, size_t samples,
+                       int16_t gain0, int16_t gain1)
+{
+    size_t i;
+
+    for (i = 0; i + 2 <= samples; i += 2) {
+        dst[i] = gain_sample(src[i], gain0);
+        dst[i + 1] = gain_sample(src[i + 1], gain1);
+    }
+    if (i < samples)
+        dst[i] = gain_sample(src[i], gain0);
+}
+
+static void capture_i16_c(int16_t *dst, const void *src, size_t frames,
+                          unsigned int src_channels, unsigned int dst_channels)
+{
+    const int16_t *in = src;
+    size_t i;
+    unsigned int c;
+
+    for (i = 0; i < frames; i++, in += src_channels)
+        for (c = 0; c < dst_channels; c++)
+            *dst++ = in[c < src_channels ? c : src_channels - 1];
+}
+
+static void capture_i32_c(int16_t *dst, const void *src, size_t frames,
+                          unsigned int src_channels, unsigned int dst_channels)
+{
+    const int32_t *in = src;
+    size_t i;
+    unsigned int c;
+
+    for (i = 0; i < frames; i++, in += src_channels)
+        for (c = 0; c < dst_channels; c++)
+            *dst++ = in[c < src_channels ? c : src_channels - 1] >> 16;
+}
+
+static void capture_u8_c(int16_t *dst, const void *src, size_t frames,
+                         unsigned int src_channels, unsigned int dst_channels)
+{
+    const uint8_t *in = src;
+    size_t i;
+    unsigned int c;
+
+    for (i = 0; i < frames; i++, in += src_channels)
+        for (c = 0; c < dst_channels; c++)
+            *dst++ = (int16_t)((in[c < src_channels ? c : src_channels - 1] - 0x80) << 8);
+}
+
+/* from the last sample, so that dst may be src */
+static void float_from_i16_c(float *dst, const int16_t *src, size_t samples)
+{
+    size_t i;
+
+    for (i = samples; i-- > 0;)
+        dst[i] = src[i] * FLOAT_FROM_I16;
+}
+
+/* scale is FLOAT_FROM_I32, or FLOAT_FROM_Q8_24 for AUDIO_FORMAT_PCM_8_24_BIT */
+static void float_from_i32_c(float *dst, const int32_t *src, size_t samples, float scale)
+{
+    size_t i;
+
+    for (i = 0; i < samples; i++)
+        dst[i] = src[i] * scale;
+}
+
+static void float_from_p24_c(float *dst, const uint8_t *src, size_t samples)
+{
+    size_t i;
+
+    for (i = 0; i < samples; i++, src += 3)
+        dst[i] = (int32_t)((uint32_t)src[0] << 8 | (uint32_t)src[1] << 16 |
+                           (uint32_t)src[2] << 24) * FLOAT_FROM_I32;
+}
+
+static void i16_from_float_c(int16_t *dst, const float *src, size_t samples)
+{
+    size_t i;
+
+    for (i = 0; i < samples; i++)
+        dst[i] = i16_sample(src[i]);
+}
+
+static void i32_from_float_c(int32_t *dst, const float *src, size_t samples)
+{
+    size_t i;
+
+    for (i = 0; i < samples; i++)
+        dst[i] = i32_sample(src[i]);
+}
+
+static void capture_float_i16_c(float *dst, const void *src, size_t frames,
+                                unsigned int src_channels, unsigned int dst_channels)
+{
+    const int16_t *in = src;
+    size_t i;
+    unsigned int c;
+
+    for (i = 0; i < frames; i++, in += src_channels)
+        for (c = 0; c < dst_channels; c++)
+            *dst++ = in[c < src_channels ? c : src_channels - 1] * FLOAT_FROM_I16;
+}
+
+static void capture_float_i32_c(float *dst, const void *src, size_t frames,
+                                unsigned int src_channels, unsigned int dst_channels)
+{
+    const int32_t *in = src;
+    size_t i;
+    unsigned int c;
+
+    for (i = 0; i < frames; i++, in += src_channels)
+        for (c = 0; c < dst_channels; c++)
+            *dst++ = in[c < src_channels ? c : src_channels - 1] * FLOAT_FROM_I32;
+}
+
+static void capture_float_u8_c(float *dst, const void *src, size_t frames,
+                               unsigned int src_channels, unsigned int dst_channels)
+{
+    const uint8_t *in = src;
+    size_t i;
+    unsigned int c;
+
+    for (i = 0; i < frames; i++, in += src_channels)
+        for (c = 0; c < dst_channels; c++)
+            *dst++ = (in[c < src_channels ? c : src_channels - 1] - 0x80) * (1.0f / 128.0f);
+}
+
+#if defined(__SSE2__)
+
+/* averages 4 interleaved stereo frames into 4 mono samples in 32 bit lanes */
+static inline __m128i downmix4_epi32(__m128i frames)
+{
+    __m128i right = _mm_srai_epi32(frames, 16);
+    __m128i left = _mm_srai_epi32(_mm_slli_epi32(frames, 16), 16);
+
+    return _mm_srai_epi32(_mm_add_epi32(left, right), 1);
+}
+
+static inline __m128i downmix8(const int16_t *src)
+{
+    __m128i lo = downmix4_epi32(_mm_loadu_si128((const __m128i *)src));
+    __m128i hi = downmix4_epi32(_mm_loadu_si128((const __m128i *)(src + 8)));
+
+    return _mm_packs_epi32(lo, hi);
+}
+
+static inline void store_i32x8(int32_t *dst, __m128i samples)
+{
+    __m128i zero = _mm_setzero_si128();
+
+    _mm_storeu_si128((__m128i *)dst, _mm_unpacklo_epi16(zero, samples));
+    _mm_storeu_si128((__m128i *)(dst + 4), _mm_unpackhi_epi16(zero, samples));
+}
+
+static inline __m128i u8_from_i16x16(__m128i lo, __m128i hi)
+{
+    __m128i packed = _mm_packs_epi16(_mm_srai_epi16(lo, 8), _mm_srai_epi16(hi, 8));
+
+    return _mm_xor_si128(packed, _mm_set1_epi8((char)0x80));
+}
+
+static void stereo_to_mono_i16(void *dst, const int16_t *src, size_t frames)
+{
+    int16_t *out = dst;
+    size_t i = 0;
+
+    for (; i + 8 <= frames; i += 8)
+        _mm_storeu_si128((__m128i *)(out + i), downmix8(src + i * 2));
+    stereo_to_mono_i16_c(out + i, src + i * 2, frames - i);
+}
+
+static void stereo_to_mono_i32(void *dst, const int16_t *src, size_t frames)
+{
+    int32_t *out = dst;
+    size_t i = 0;
+
+    for (; i + 8 <= frames; i += 8)
+        store_i32x8(out + i, downmix8(src + i * 2));
+    stereo_to_mono_i32_c(out + i, src + i * 2, frames - i);
+}
+
+static void stereo_to_mono_u8(void *dst, const int16_t *src, size_t frames)
+{
+    uint8_t *out = dst;
+    size_t i = 0;
+
+    for (; i + 16 <= frames; i += 16)
+        _mm_storeu_si128((__m128i *)(out + i),
+                         u8_from_i16x16(downmix8(src + i * 2), downmix8(src + i * 2 + 16)));
+    stereo_to_mono_u8_c(out + i, src + i * 2, frames - i);
+}
+
+static void i32_from_i16(int32_t *dst, const int16_t *src, size_t samples)
+{
+    size_t i = 0;
+
+    for (; i + 8 <= samples; i += 8)
+        store_i32x8(dst + i, _mm_loadu_si128((const __m128i *)(src + i)));
+    i32_from_i16_c(dst + i, src + i, samples - i);
+}
+
+static void u8_from_i16(uint8_t *dst, const int16_t *src, size_t samples)
+{
+    size_t i = 0;
+
+    for (; i + 16 <= samples; i += 16)
+        _mm_storeu_si128((__m128i *)(dst + i),
+                         u8_from_i16x16(_mm_loadu_si128((const __m128i *)(src + i)),
+                                        _mm_loadu_si128((const __m128i *)(src + i + 8))));
+    u8_from_i16_c(dst + i, src + i, samples - i);
+}
+
+/* left samples of 8 stereo frames */
+static void capture_left_i16(int16_t *dst, const void *src, size_t frames,
+                             unsigned int src_channels __unused,
+                             unsigned int dst_channels __unused)
+{
+    const int16_t *in = src;
+    size_t i = 0;
+
+    for (; i + 8 <= frames; i += 8) {
+        __m128i lo = _mm_loadu_si128((const __m128i *)(in + i * 2));
+        __m128i hi = _mm_loadu_si128((const __m128i *)(in + i * 2 + 8));
+
+        lo = _mm_srai_epi32(_mm_slli_epi32(lo, 16), 16);
+        hi = _mm_srai_epi32(_mm_slli_epi32(hi, 16), 16);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(lo, hi));
+    }
+    capture_i16_c(dst + i, in + i * 2, frames - i, 2, 1);
+}
+
+/* high halves of 8 32 bit samples */
+static inline __m128i i16_from_i32x8(__m128i lo, __m128i hi)
+{
+    return _mm_packs_epi32(_mm_srai_epi32(lo, 16), _mm_srai_epi32(hi, 16));
+}
+
+static void capture_same_i32(int16_t *dst, const void *src, size_t frames,
+                             unsigned int src_channels, unsigned int dst_channels __unused)
+{
+    const int32_t *in = src;
+    size_t samples = frames * src_channels;
+    size_t i = 0;
+
+    for (; i + 8 <= samples; i += 8)
+        _mm_storeu_si128((__m128i *)(dst + i),
+                         i16_from_i32x8(_mm_loadu_si128((const __m128i *)(in + i)),
+                                        _mm_loadu_si128((const __m128i *)(in + i + 4))));
+    capture_i32_c(dst + i, in + i, samples - i, 1, 1);
+}
+
+/* left samples of 4 stereo frames, in 32 bit lanes */
+static inline __m128i left_epi32(const int32_t *src)
+{
+    __m128i a = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)src), _MM_SHUFFLE(3, 1, 2, 0));
+    __m128i b = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)(src + 4)),
+                                  _MM_SHUFFLE(3, 1, 2, 0));
+
+    return _mm_unpacklo_epi64(a, b);
+}
+
+static void capture_left_i32(int16_t *dst, const void *src, size_t frames,
+                             unsigned int src_channels __unused,
+                             unsigned int dst_channels __unused)
+{
+    const int32_t *in = src;
+    size_t i = 0;
+
+    for (; i + 8 <= frames; i += 8)
+        _mm_storeu_si128((__m128i *)(dst + i),
+                         i16_from_i32x8(left_epi32(in + i * 2), left_epi32(in + i * 2 + 8)));
+    capture_i32_c(dst + i, in + i * 2, frames - i, 2, 1);
+}
+
+void audio_mix_i16(int16_t *dst, const int16_t *src, size_t samples)
+{
+    size_t i = 0;
+
+    for (; i + 8 <= samples; i += 8) {
+        __m128i sum = _mm_adds_epi16(_mm_loadu_si128((const __m128i *)(dst + i)),
+                                     _mm_loadu_si128((const __m128i *)(src + i)));
+        _mm_storeu_si128((__m128i *)(dst + i), sum);
+    }
+    mix_i16_c(dst + i, src + i, samples - i);
+}
+
+static void gain_i16(int16_t *dst, const int16_t *src, size_t samples,
+                     int16_t gain0, int16_t gain1)
+{
+    const __m128i gains = _mm_set_epi16(gain1, gain0, gain1, gain0, gain1, gain0, gain1, gain0);
+    size_t i = 0;
+
+    for (; i + 8 <= samples; i += 8) {
+        __m128i in = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i lo = _mm_mullo_epi16(in, gains);
+        __m128i hi = _mm_mulhi_epi16(in, gains);
+        __m128i out = _mm_packs_epi32(_mm_srai_epi32(_mm_unpacklo_epi16(lo, hi), 15),
+                                      _mm_srai_epi32(_mm_unpackhi_epi16(lo, hi), 15));
+        _mm_storeu_si128((__m128i *)(dst + i), out);
+    }
+    gain_i16_c(dst + i, src + i, samples - i, gain0, gain1);
+}
+
+/* by blocks of 8 from the end, each loaded before it is stored over, so that dst may be src */
+static void float_from_i16(float *dst, const int16_t *src, size_t samples)
+{
+    const __m128 scale = _mm_set1_ps(FLOAT_FROM_I16);
+    size_t i = samples & ~(size_t)7;
+
+    float_from_i16_c(dst + i, src + i, samples - i);
+    while (i > 0) {
+        __m128i in;
+
+        i -= 8;
+        in = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(
+                _mm_srai_epi32(_mm_unpacklo_epi16(in, in), 16)), scale));
+        _mm_storeu_ps(dst + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(
+                _mm_srai_epi32(_mm_unpackhi_epi16(in, in), 16)), scale));
+    }
+}
+
+static void float_from_i32(float *dst, const int32_t *src, size_t samples, float scale)
+{
+    const __m128 vscale = _mm_set1_ps(scale);
+    size_t i = 0;
+
+    for (; i + 4 <= samples; i += 4)
+        _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(
+                _mm_loadu_si128((const __m128i *)(src + i))), vscale));
+    float_from_i32_c(dst + i, src + i, samples - i, scale);
+}
+
+/* the stores stay behind the loads, so that dst may be src */
+static void i16_from_float(int16_t *dst, const float *src, size_t samples)
+{
+    const __m128 scale = _mm_set1_ps(32768.0f);
+    const __m128 max = _mm_set1_ps(32767.0f);
+    const __m128 min = _mm_set1_ps(-32768.0f);
+    size_t i = 0;
+
+    for (; i + 8 <= samples; i += 8) {
+        __m128 lo = _mm_mul_ps(_mm_loadu_ps(src + i), scale);
+        __m128 hi = _mm_mul_ps(_mm_loadu_ps(src + i + 4), scale);
+
+        lo = _mm_max_ps(_mm_min_ps(lo, max), min);
+        hi = _mm_max_ps(_mm_min_ps(hi, max), min);
+        _mm_storeu_si128((__m128i *)(dst + i),
+                         _mm_packs_epi32(_mm_cvttps_epi32(lo), _mm_cvttps_epi32(hi)));
+    }
+    i16_from_float_c(dst + i, src + i, samples - i);
+}
+
+static void i32_from_float(int32_t *dst, const float *src, size_t samples)
+{
+    const __m128 scale = _mm_set1_ps(2147483648.0f);
+    const __m128 max = _mm_set1_ps(I32_MAX_FLOAT);
+    const __m128 min = _mm_set1_ps(-2147483648.0f);
+    size_t i = 0;
+
+    for (; i + 4 <= samples; i += 4) {
+        __m128 v = _mm_mul_ps(_mm_loadu_ps(src + i), scale);
+
+        _mm_storeu_si128((__m128i *)(dst + i),
+                         _mm_cvttps_epi32(_mm_max_ps(_mm_min_ps(v, max), min)));
+    }
+    i32_from_float_c(dst + i, src + i, samples - i);
+}
+
+#elif defined(__ARM_NEON)
+
+static inline int16x8_t downmix8(const int16_t *src)
+{
+    int16x8x2_t frames = vld2q_s16(src);
+
+    return vhaddq_s16(frames.val[0], frames.val[1]);
+}
+
+static inline void store_i32x8(int32_t *dst, int16x8_t samples)
+{
+    vst1q_s32(dst, vshll_n_s16(vget_low_s16(samples), 16));
+    vst1q_s32(dst + 4, vshll_n_s16(vget_high_s16(samples), 16));
+}
+
+static inline uint8x8_t u8_from_i16x8(int16x8_t samples)
+{
+    return veor_u8(vreinterpret_u8_s8(vshrn_n_s16(samples, 8)), vdup_n_u8(0x80));
+}
+
+static void stereo_to_mono_i16(void *dst, const int16_t *src, size_t frames)
+{
+    int16_t *out = dst;
+    size_t i = 0;
+
+    for (; i + 8 <= frames; i += 8)
+        vst1q_s16(out + i, downmix8(src + i * 2));
+    stereo_to_mono_i16_c(out + i, src + i * 2, frames - i);
+}
+
+static void stereo_to_mono_i32(void *dst, const int16_t *src, size_t frames)
+{
+    int32_t *out = dst;
+    size_t i = 0;
+
+    for (; i + 8 <= frames; i += 8)
+        store_i32x8(out + i, downmix8(src + i * 2));
+    stereo_to_mono_i32_c(out + i, src + i * 2, frames - i);
+}
+
+static void stereo_to_mono_u8(void *dst, const int16_t *src, size_t frames)
+{
+    uint8_t *out = dst;
+    size_t i = 0;
+
+    for (; i + 8 <= frames; i += 8)
+        vst1_u8(out + i, u8_from_i16x8(downmix8(src + i * 2)));
+    stereo_to_mono_u8_c(out + i, src + i * 2, frames - i);
+}
+
+static void i32_from_i16(int32_t *dst, const int16_t *src, size_t samples)
+{
+    size_t i = 0;
+
+    for (; i + 8 <= samples; i += 8)
+        store_i32x8(dst + i, vld1q_s16(src + i));
+    i32_from_i16_c(dst + i, src + i, samples - i);
+}
+
+static void u8_from_i16(uint8_t *dst, const int16_t *src, size_t samples)
+{
+    size_t i = 0;
+
+    for (; i + 8 <= samples; i += 8)
+        vst1_u8(dst + i, u8_from_i16x8(vld1q_s16(src + i)));
+    u8_from_i16_c(dst + i, src + i, samples - i);
+}
+
+static void capture_left_i16(int16_t *dst, const void *src, size_t frames,
+                             unsigned int src_channels __unused,
+                             unsigned int dst_channels __unused)
+{
+    const int16_t *in = src;
+    size_t i = 0;
+
+    for (; i + 8 <= frames; i += 8)
+        vst1q_s16(dst + i, vld2q_s16(in + i * 2).val[0]);
+    capture_i16_c(dst + i, in + i * 2, frames - i, 2, 1);
+}
+
+static void capture_same_i32(int16_t *dst, const void *src, size_t frames,
+                             unsigned int src_channels, unsigned int dst_channels __unused)
+{
+    const int32_t *in = src;
+    size_t samples = frames * src_channels;
+    size_t i = 0;
+
+    for (; i + 8 <= samples; i += 8)
+        vst1q_s16(dst + i, vcombine_s16(vshrn_n_s32(vld1q_s32(in + i), 16),
+                                        vshrn_n_s32(vld1q_s32(in + i + 4), 16)));
+    capture_i32_c(dst + i, in + i, samples - i, 1, 1);
+}
+
+static void capture_left_i32(int16_t *dst, const void *src, size_t frames,
+                             unsigned int src_channels __unused,
+                             unsigned int dst_channels __unused)
+{
+    const int32_t *in = src;
+    size_t i = 0;
+
+    for (; i + 8 <= frames; i += 8)
+        vst1q_s16(dst + i, vcombine_s16(vshrn_n_s32(vld2q_s32(in + i * 2).val[0], 16),
+                                        vshrn_n_s32(vld2q_s32(in + i * 2 + 8).val[0], 16)));
+    capture_i32_c(dst + i, in + i * 2, frames - i, 2, 1);
+}
+
+void audio_mix_i16(int16_t *dst, const int16_t *src, size_t samples)
+{
+    size_t i = 0;
+
+    for (; i + 8 <= samples; i += 8)
+        vst1q_s16(dst + i, vqaddq_s16(vld1q_s16(dst + i), vld1q_s16(src + i)));
+    mix_i16_c(dst + i, src + i, samples - i);
+}
+
+static void gain_i16(int16_t *dst, const int16_t *src, size_t samples,
+                     int16_t gain0, int16_t gain1)
+{
+    const int16_t pair[2] = { gain0, gain1 };
+    const int16x8_t gains = vreinterpretq_s16_s32(vld1q_dup_s32((const int32_t *)pair));
+    size_t i = 0;
+
+    /* (2 * a * b) >> 16, never saturates since the gains are below 1 */
+    for (; i + 8 <= samples; i += 8)
+        vst1q_s16(dst + i, vqdmulhq_s16(vld1q_s16(src + i), gains));
+    gain_i16_c(dst + i, src + i, samples - i, gain0, gain1);
+}
+
+/* by blocks of 8 from the end, each loaded before it is stored over, so that dst may be src */
+static void float_from_i16(float *dst, const int16_t *src, size_t samples)
+{
+    size_t i = samples & ~(size_t)7;
+
+    float_from_i16_c(dst + i, src + i, samples - i);
+    while (i > 0) {
+        int16x8_t in;
+
+        i -= 8;
+        in = vld1q_s16(src + i);
+        vst1q_f32(dst + i, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(in))),
+                                       FLOAT_FROM_I16));
+        vst1q_f32(dst + i + 4, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(in))),
+                                           FLOAT_FROM_I16));
+    }
+}
+
+static void float_from_i32(float *dst, const int32_t *src, size_t samples, float scale)
+{
+    size_t i = 0;
+
+    for (; i + 4 <= samples; i += 4)
+        vst1q_f32(dst + i, vmulq_n_f32(vcvtq_f32_s32(vld1q_s32(src + i)), scale));
+    float_from_i32_c(dst + i, src + i, samples - i, scale);
+}
+
+/* the stores stay behind the loads, so that dst may be src */
+static void i16_from_float(int16_t *dst, const float *src, size_t samples)
+{
+    const float32x4_t max = vdupq_n_f32(32767.0f);
+    const float32x4_t min = vdupq_n_f32(-32768.0f);
+    size_t i = 0;
+
+    for (; i + 8 <= samples; i += 8) {
+        float32x4_t lo = vmulq_n_f32(vld1q_f32(src + i), 32768.0f);
+        float32x4_t hi = vmulq_n_f32(vld1q_f32(src + i + 4), 32768.0f);
+
+        lo = vmaxq_f32(vminq_f32(lo, max), min);
+        hi = vmaxq_f32(vminq_f32(hi, max), min);
+        vst1q_s16(dst + i, vcombine_s16(vmovn_s32(vcvtq_s32_f32(lo)),
+                                        vmovn_s32(vcvtq_s32_f32(hi))));
+    }
+    i16_from_float_c(dst + i, src + i, samples - i);
+}
+
+static void i32_from_float(int32_t *dst, const float *src, size_t samples)
+{
+    const float32x4_t max = vdupq_n_f32(I32_MAX_FLOAT);
+    const float32x4_t min = vdupq_n_f32(-2147483648.0f);
+    size_t i = 0;
+
+    for (; i + 4 <= samples; i += 4) {
+        float32x4_t v = vmulq_n_f32(vld1q_f32(src + i), 2147483648.0f);
+
+        vst1q_s32(dst + i, vcvtq_s32_f32(vmaxq_f32(vminq_f32(v, max), min)));
+    }
+    i32_from_float_c(dst + i, src + i, samples - i);
+}
+
+#else
+
+static void stereo_to_mono_i16(void *dst, const int16_t *src, size_t frames)
+{
+    stereo_to_mono_i16_c(dst, src, frames);
+}
+
+static void stereo_to_mono_i32(void *dst, const int16_t *src, size_t frames)
+{
+    stereo_to_mono_i32_c(dst, src, frames);
+}
+
+static void stereo_to_mono_u8(void *dst, const int16_t *src, size_t frames)
+{
+    stereo_to_mono_u8_c(dst, src, frames);
+}
+
+static void i32_from_i16(int32_t *dst, const int16_t *src, size_t samples)
+{
+    i32_from_i16_c(dst, src, samples);
+}
+
+static void u8_from_i16(uint8_t *dst, const int16_t *src, size_t samples)
+{
+    u8_from_i16_c(dst, src, samples);
+}
+
+static void capture_left_i16(int16_t *dst, const void *src, size_t frames,
+                             unsigned int src_channels, unsigned int dst_channels)
+{
+    capture_i16_c(dst, src, frames, src_channels, dst_channels);
+}
+
+static void capture_same_i32(int16_t *dst, const void *src, size_t frames,
+                             unsigned int src_channels, unsigned int dst_channels)
+{
+    capture_i32_c(dst, src, frames, src_channels, dst_channels);
+}
+
+static void capture_left_i32(int16_t *dst, const void *src, size_t frames,
+                             unsigned int src_channels, unsigned int dst_channels)
+{
+    capture_i32_c(dst, src, frames, src_channels, dst_channels);
+}
+
+void audio_mix_i16(int16_t *dst, const int16_t *src, size_t samples)
+{
+    mix_i16_c(dst, src, samples);
+}
+
+static void gain_i16(int16_t *dst, const int16_t *src, size_t samples,
+                     int16_t gain0, int16_t gain1)
+{
+    gain_i16_c(dst, src, samples, gain0, gain1);
+}
+
+static void float_from_i16(float *dst, const int16_t *src, size_t samples)
+{
+    float_from_i16_c(dst, src, samples);
+}
+
+static void float_from_i32(float *dst, const int32_t *src, size_t samples, float scale)
+{
+    float_from_i32_c(dst, src, samples, scale);
+}
+
+static void i16_from_float(int16_t *dst, const float *src, size_t samples)
+{
+    i16_from_float_c(dst, src, samples);
+}
+
+static void i32_from_float(int32_t *dst, const float *src, size_t samples)
+{
+    i32_from_float_c(dst, src, samples);
+}
+
+#endif
+
+static void mono_to_i32(void *dst, const int16_t *src, size_t frames)
+{
+    i32_from_i16(dst, src, frames);
+}
+
+static void stereo_to_i32(void *dst, const int16_t *src, size_t frames)
+{
+    i32_from_i16(dst, src, frames * 2);
+}
+
+static void mono_to_u8(void *dst, const int16_t *src, size_t frames)
+{
+    u8_from_i16(dst, src, frames);
+}
+
+static void stereo_to_u8(void *dst, const int16_t *src, size_t frames)
+{
+    u8_from_i16(dst, src, frames * 2);
+}
+
+int audio_convert_select(unsigned int src_channels, unsigned int dst_channels,
+                         audio_format_t dst_format, audio_convert_func_t *func)
+{
+    static const struct {
+        unsigned int src_channels;
+        unsigned int dst_channels;
+        audio_format_t dst_format;
+        audio_convert_func_t func;
+    } kernels[] = {
+        { 1, 1, AUDIO_FORMAT_PCM_16_BIT, NULL },
+        { 2, 2, AUDIO_FORMAT_PCM_16_BIT, NULL },
+        { 2, 1, AUDIO_FORMAT_PCM_16_BIT, stereo_to_mono_i16 },
+        { 1, 1, AUDIO_FORMAT_PCM_32_BIT, mono_to_i32 },
+        { 2, 2, AUDIO_FORMAT_PCM_32_BIT, stereo_to_i32 },
+        { 2, 1, AUDIO_FORMAT_PCM_32_BIT, stereo_to_mono_i32 },
+        { 1, 1, AUDIO_FORMAT_PCM_8_BIT, mono_to_u8 },
+        { 2, 2, AUDIO_FORMAT_PCM_8_BIT, stereo_to_u8 },
+        { 2, 1, AUDIO_FORMAT_PCM_8_BIT, stereo_to_mono_u8 },
+    };
+    unsigned int i;
+
+    for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+        if (kernels[i].src_channels == src_channels &&
+                kernels[i].dst_channels == dst_channels &&
+                kernels[i].dst_format == dst_format) {
+            *func = kernels[i].func;
+            return 0;
+        }
+    }
+
+    ALOGE("no conversion from %u to %u channels in format %#x",
+          src_channels, dst_channels, dst_format);
+    *func = NULL;
+    return -EINVAL;
+}
+
+int audio_capture_select(unsigned int src_channels, audio_format_t src_format,
+                         unsigned int dst_channels, audio_capture_func_t *func)
+{
+    *func = NULL;
+    if (src_channels == 0 || dst_channels == 0)
+        return -EINVAL;
+
+    switch (src_format) {
+    case AUDIO_FORMAT_PCM_16_BIT:
+        if (src_channels == 2 && dst_channels == 1)
+            *func = capture_left_i16;
+        else if (src_channels != dst_channels)
+            *func = capture_i16_c;
+        return 0;
+    case AUDIO_FORMAT_PCM_32_BIT:
+        if (src_channels == dst_channels)
+            *func = capture_same_i32;
+        else if (src_channels == 2 && dst_channels == 1)
+            *func = capture_left_i32;
+        else
+            *func = capture_i32_c;
+        return 0;
+    case AUDIO_FORMAT_PCM_8_BIT:
+        *func = capture_u8_c;
+        return 0;
+    default:
+        ALOGE("no capture conversion from format %#x", src_format);
+        return -EINVAL;
+    }
+}
+
+static void capture_float_same_i16(float *dst, const void *src, size_t frames,
+                                   unsigned int src_channels,
+                                   unsigned int dst_channels __unused)
+{
+    float_from_i16(dst, src, frames * src_channels);
+}
+
+static void capture_float_same_i32(float *dst, const void *src, size_t frames,
+                                   unsigned int src_channels,
+                                   unsigned int dst_channels __unused)
+{
+    float_from_i32(dst, src, frames * src_channels, FLOAT_FROM_I32);
+}
+
+int audio_capture_float_select(unsigned int src_channels, audio_format_t src_format,
+                               unsigned int dst_channels, audio_capture_float_func_t *func)
+{
+    *func = NULL;
+    if (src_channels == 0 || dst_channels == 0)
+        return -EINVAL;
+
+    switch (src_format) {
+    case AUDIO_FORMAT_PCM_16_BIT:
+        *func = src_channels == dst_channels ? capture_float_same_i16 : capture_float_i16_c;
+        return 0;
+    case AUDIO_FORMAT_PCM_32_BIT:
+        *func = src_channels == dst_channels ? capture_float_same_i32 : capture_float_i32_c;
+        return 0;
+    case AUDIO_FORMAT_PCM_8_BIT:
+        *func = capture_float_u8_c;
+        return 0;
+    default:
+        ALOGE("no capture conversion to float from format %#x", src_format);
+        return -EINVAL;
+    }
+}
+
+void audio_float_from_i16(float *dst, const int16_t *src, size_t samples)
+{
+    float_from_i16(dst, src, samples);
+}
+
+int audio_float_from_format(float *dst, const void *src, size_t samples,
+                            audio_format_t src_format)
+{
+    switch (src_format) {
+    case AUDIO_FORMAT_PCM_16_BIT:
+        float_from_i16(dst, src, samples);
+        return 0;
+    case AUDIO_FORMAT_PCM_24_BIT_PACKED:
+        float_from_p24_c(dst, src, samples);
+        return 0;
+    case AUDIO_FORMAT_PCM_8_24_BIT:
+        float_from_i32(dst, src, samples, FLOAT_FROM_Q8_24);
+        return 0;
+    case AUDIO_FORMAT_PCM_32_BIT:
+        float_from_i32(dst, src, samples, FLOAT_FROM_I32);
+        return 0;
+    case AUDIO_FORMAT_PCM_FLOAT:
+        memcpy(dst, src, samples * sizeof(float));
+        return 0;
+    default:
+        return -EINVAL;
+    }
+}
+
+/* from float: the same channel count takes the SIMD kernels, the rest is scalar */
+
+static void float_to_i16(void *dst, const float *src, size_t frames)
+{
+    i16_from_float(dst, src, frames);
+}
+
+static void float_stereo_to_i16(void *dst, const float *src, size_t frames)
+{
+    i16_from_float(dst, src, frames * 2);
+}
+
+static void float_stereo_to_mono_i16(void *dst, const float *src, size_t frames)
+{
+    int16_t *out = dst;
+    size_t i;
+
+    for (i = 0; i < frames; i++)
+        out[i] = i16_sample((src[i * 2] + src[i * 2 + 1]) * 0.5f);
+}
+
+static void float_to_i32(void *dst, const float *src, size_t frames)
+{
+    i32_from_float(dst, src, frames);
+}
+
+static void float_stereo_to_i32(void *dst, const float *src, size_t frames)
+{
+    i32_from_float(dst, src, frames * 2);
+}
+
+static void float_stereo_to_mono_i32(void *dst, const float *src, size_t frames)
+{
+    int32_t *out = dst;
+    size_t i;
+
+    for (i = 0; i < frames; i++)
+        out[i] = i32_sample((src[i * 2] + src[i * 2 + 1]) * 0.5f);
+}
+
+static void float_to_u8(void *dst, const float *src, size_t frames)
+{
+    uint8_t *out = dst;
+    size_t i;
+
+    for (i = 0; i < frames; i++)
+        out[i] = u8_float_sample(src[i]);
+}
+
+static void float_stereo_to_u8(void *dst, const float *src, size_t frames)
+{
+    float_to_u8(dst, src, frames * 2);
+}
+
+static void float_stereo_to_mono_u8(void *dst, const float *src, size_t frames)
+{
+    uint8_t *out = dst;
+    size_t i;
+
+    for (i = 0; i < frames; i++)
+        out[i] = u8_float_sample((src[i * 2] + src[i * 2 + 1]) * 0.5f);
+}
+
+int audio_convert_float_select(unsigned int src_channels, unsigned int dst_channels,
+                               audio_format_t dst_format, audio_convert_float_func_t *func)
+{
+    static const struct {
+        unsigned int src_channels;
+        unsigned int dst_channels;
+        audio_format_t dst_format;
+        audio_convert_float_func_t func;
+    } kernels[] = {
+        { 1, 1, AUDIO_FORMAT_PCM_16_BIT, float_to_i16 },
+        { 2, 2, AUDIO_FORMAT_PCM_16_BIT, float_stereo_to_i16 },
+        { 2, 1, AUDIO_FORMAT_PCM_16_BIT, float_stereo_to_mono_i16 },
+        { 1, 1, AUDIO_FORMAT_PCM_32_BIT, float_to_i32 },
+        { 2, 2, AUDIO_FORMAT_PCM_32_BIT, float_stereo_to_i32 },
+        { 2, 1, AUDIO_FORMAT_PCM_32_BIT, float_stereo_to_mono_i32 },
+        { 1, 1, AUDIO_FORMAT_PCM_8_BIT, float_to_u8 },
+        { 2, 2, AUDIO_FORMAT_PCM_8_BIT, float_stereo_to_u8 },
+        { 2, 1, AUDIO_FORMAT_PCM_8_BIT, float_stereo_to_mono_u8 },
+    };
+    unsigned int i;
+
+    for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+        if (kernels[i].src_channels == src_channels &&
+                kernels[i].dst_channels == dst_channels &&
+                kernels[i].dst_format == dst_format) {
+            *func = kernels[i].func;
+            return 0;
+        }
+    }
+
+    ALOGE("no conversion from %u float channels to %u channels in format %#x",
+          src_channels, dst_channels, dst_format);
+    *func = NULL;
+    return -EINVAL;
+}
+
+static int32_t gain_from_float(float value)
+{
+    if (!(value > 0.0f))
+        return 0;
+    if (value >= 1.0f)
+        return AUDIO_GAIN_UNITY;
+    return (int32_t)(value * AUDIO_GAIN_UNITY);
+}
+
+void audio_gain_set(struct audio_gain *gain, float left, float right, uint32_t ramp_frames)
+{
+    unsigned int i;
+
+    gain->target[0] = gain_from_float(left);
+    gain->target[1] = gain_from_float(right);
+    if (gain->target[0] == gain->gain[0] && gain->target[1] == gain->gain[1])
+        ramp_frames = 0;
+    for (i = 0; i < 2; i++) {
+        if (ramp_frames == 0)
+            gain->gain[i] = gain->target[i];
+        gain->step[i] = ramp_frames ?
+                (gain->target[i] - gain->gain[i]) / (int32_t)ramp_frames : 0;
+    }
+    gain->ramp_frames = ramp_frames;
+}
+
+void audio_gain_apply(struct audio_gain *gain, int16_t *dst, const int16_t *src,
+                      size_t frames, unsigned int channels)
+{
+    unsigned int right = channels > 1 ? 1 : 0;
+    size_t i;
+    unsigned int c;
+
+    /* the ramp moves every frame */
+    for (i = 0; i < frames && gain->ramp_frames; i++) {
+        int16_t gains[2] = { gain_q15(gain->gain[0]), gain_q15(gain->gain[right]) };
+
+        for (c = 0; c < channels; c++)
+            dst[i * channels + c] = gain_sample(src[i * channels + c], gains[c & 1]);
+        if (--gain->ramp_frames == 0) {
+            gain->gain[0] = gain->target[0];
+            gain->gain[1] = gain->target[1];
+        } else {
+            gain->gain[0] += gain->step[0];
+            gain->gain[1] += gain->step[1];
+        }
+    }
+    if (i == frames)
+        return;
+    dst += i * channels;
+    src += i * channels;
+    frames -= i;
+
+    if (audio_gain_is_mute(gain)) {
+        memset(dst, 0, frames * channels * sizeof(int16_t));
+    } else if (audio_gain_is_unity(gain)) {
+        if (dst != src)
+            memmove(dst, src, frames * channels * sizeof(int16_t));
+    } else if (channels == 1 || !(channels & 1)) {
+        /* the channel of a sample has the parity of its index */
+        gain_i16(dst, src, frames * channels, gain_q15(gain->gain[0]),
+                 gain_q15(gain->gain[right]));
+    } else {
+        int16_t gains[2] = { gain_q15(gain->gain[0]), gain_q15(gain->gain[1]) };
+
+        for (i = 0; i < frames; i++)
+            for (c = 0; c < channels; c++)
+                dst[i * channels + c] = gain_sample(src[i * channels + c], gains[c & 1]);
+    }
+}
+
+void audio_gain_apply_float(struct audio_gain *gain, float *dst, const float *src,
+                            size_t frames, unsigned int channels)
+{
+    unsigned int right = channels > 1 ? 1 : 0;
+    float gains[2];
+    size_t i;
+    unsigned int c;
+
+    for (i = 0; i < frames && gain->ramp_frames; i++) {
+        gains[0] = gain->gain[0] * (1.0f / AUDIO_GAIN_UNITY);
+        gains[1] = gain->gain[right] * (1.0f / AUDIO_GAIN_UNITY);
+        for (c = 0; c < channels; c++)
+            dst[i * channels + c] = src[i * channels + c] * gains[c & 1];
+        if (--gain->ramp_frames == 0) {
+            gain->gain[0] = gain->target[0];
+            gain->gain[1] = gain->target[1];
+        } else {
+            gain->gain[0] += gain->step[0];
+            gain->gain[1] += gain->step[1];
+        }
+    }
+    if (i == frames)
+        return;
+    dst += i * channels;
+    src += i * channels;
+    frames -= i;
+
+    if (audio_gain_is_mute(gain)) {
+        memset(dst, 0, frames * channels * sizeof(float));
+    } else if (audio_gain_is_unity(gain)) {
+        if (dst != src)
+            memmove(dst, src, frames * channels * sizeof(float));
+    } else {
+        gains[0] = gain->gain[0] * (1.0f / AUDIO_GAIN_UNITY);
+        gains[1] = gain->gain[right] * (1.0f / AUDIO_GAIN_UNITY);
+        for (i = 0; i < frames; i++, dst += channels, src += channels)
+            for (c = 0; c < channels; c++)
+                dst[c] = src[c] * gains[c & 1];
+    }
+}
+
+/*
+ * Gain and conversion in one pass, for the steady part of the gain. The
+ * 32 bit kernels keep the bits below 16 that the gain produces.
+ */
+
+static void gain_to_i16(void *dst, const int16_t *src, size_t frames,
+                        int16_t gain0, int16_t gain1 __unused)
+{
+    gain_i16(dst, src, frames, gain0, gain0);
+}
+
+static void gain_stereo_to_i16(void *dst, const int16_t *src, size_t frames,
+                               int16_t gain0, int16_t gain1)
+{
+    gain_i16(dst, src, frames * 2, gain0, gain1);
+}
+
+static void gain_stereo_to_mono_i16(void *dst, const int16_t *src, size_t frames,
+                                    int16_t gain0, int16_t gain1)
+{
+    int16_t *out = dst;
+    size_t i;
+
+    for (i = 0; i < frames; i++)
+        out[i] = (int16_t)(((int32_t)src[i * 2] * gain0 + (int32_t)src[i * 2 + 1] * gain1) >> 16);
+}
+
+static void gain_to_i32(void *dst, const int16_t *src, size_t frames,
+                        int16_t gain0, int16_t gain1 __unused)
+{
+    int32_t *out = dst;
+    size_t i;
+
+    for (i = 0; i < frames; i++)
+        out[i] = ((int32_t)src[i] * gain0) << 1;
+}
+
+static void gain_stereo_to_i32(void *dst, const int16_t *src, size_t frames,
+                               int16_t gain0, int16_t gain1)
+{
+    int32_t *out = dst;
+    size_t i;
+
+    for (i = 0; i < frames; i++) {
+        out[i * 2] = ((int32_t)src[i * 2] * gain0) << 1;
+        out[i * 2 + 1] = ((int32_t)src[i * 2 + 1] * gain1) << 1;
+    }
+}
+
+/* the gains are below unity, the sum of the two products fits */
+static void gain_stereo_to_mono_i32(void *dst, const int16_t *src, size_t frames,
+                                    int16_t gain0, int16_t gain1)
+{
+    int32_t *out = dst;
+    size_t i;
+
+    for (i = 0; i < frames; i++)
+        out[i] = (int32_t)src[i * 2] * gain0 + (int32_t)src[i * 2 + 1] * gain1;
+}
+
+static void gain_to_u8(void *dst, const int16_t *src, size_t frames,
+                       int16_t gain0, int16_t gain1 __unused)
+{
+    uint8_t *out = dst;
+    size_t i;
+
+    for (i = 0; i < frames; i++)
+        out[i] = u8_sample(gain_sample(src[i], gain0));
+}
+
+static void gain_stereo_to_u8(void *dst, const int16_t *src, size_t frames,
+                              int16_t gain0, int16_t gain1)
+{
+    uint8_t *out = dst;
+    size_t i;
+
+    for (i = 0; i < frames; i++) {
+        out[i * 2] = u8_sample(gain_sample(src[i * 2], gain0));
+        out[i * 2 + 1] = u8_sample(gain_sample(src[i * 2 + 1], gain1));
+    }
+}
+
+static void gain_stereo_to_mono_u8(void *dst, const int16_t *src, size_t frames,
+                                   int16_t gain0, int16_t gain1)
+{
+    uint8_t *out = dst;
+    size_t i;
+
+    for (i = 0; i < frames; i++)
+        out[i] = u8_sample((int16_t)(((int32_t)src[i * 2] * gain0 +
+                                      (int32_t)src[i * 2 + 1] * gain1) >> 16));
+}
+
+int audio_convert_gain_select(unsigned int src_channels, unsigned int dst_channels,
+                              audio_format_t dst_format, audio_convert_gain_func_t *func)
+{
+    static const struct {
+        unsigned int src_channels;
+        unsigned int dst_channels;
+        audio_format_t dst_format;
+        audio_convert_gain_func_t func;
+    } kernels[] = {
+        { 1, 1, AUDIO_FORMAT_PCM_16_BIT, gain_to_i16 },
+        { 2, 2, AUDIO_FORMAT_PCM_16_BIT, gain_stereo_to_i16 },
+        { 2, 1, AUDIO_FORMAT_PCM_16_BIT, gain_stereo_to_mono_i16 },
+        { 1, 1, AUDIO_FORMAT_PCM_32_BIT, gain_to_i32 },
+        { 2, 2, AUDIO_FORMAT_PCM_32_BIT, gain_stereo_to_i32 },
+        { 2, 1, AUDIO_FORMAT_PCM_32_BIT, gain_stereo_to_mono_i32 },
+        { 1, 1, AUDIO_FORMAT_PCM_8_BIT, gain_to_u8 },
+        { 2, 2, AUDIO_FORMAT_PCM_8_BIT, gain_stereo_to_u8 },
+        { 2, 1, AUDIO_FORMAT_PCM_8_BIT, gain_stereo_to_mono_u8 },
+    };
+    unsigned int i;
+
+    for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+        if (kernels[i].src_channels == src_channels &&
+                kernels[i].dst_channels == dst_channels &&
+                kernels[i].dst_format == dst_format) {
+            *func = kernels[i].func;
+            return 0;
+        }
+    }
+
+    ALOGE("no conversion with gain from %u to %u channels in format %#x",
+          src_channels, dst_channels, dst_format);
+    *func = NULL;
+    return -EINVAL;
+}
+
+void audio_convert_gain(audio_convert_gain_func_t func, const struct audio_gain *gain,
+                        void *dst, const int16_t *src, size_t frames)
+{
+    func(dst, src, frames, gain_q15(gain->gain[0]), gain_q15(gain->gain[1]));
+}
@@ -0,0 +1,148 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef AUDIO_CONVERT_H
+#define AUDIO_CONVERT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <system/audio.h>
+
+/* Converts frames of interleaved 16 bit samples, dst and src must not overlap */
+typedef void (*audio_convert_func_t)(void *dst, const int16_t *src, size_t frames);
+
+/*
+ * Picks the kernel that reduces src_channels to dst_channels (averaging
+ * them) and converts to dst_format in a single pass. *func is set to NULL
+ * when no conversion is needed. Returns -EINVAL if the conversion is not
+ * supported.
+ */
+int audio_convert_select(unsigned int src_channels, unsigned int dst_channels,
+                         audio_format_t dst_format, audio_convert_func_t *func);
+
+/*
+ * Converts frames of src_channels interleaved samples to dst_channels 16
+ * bit samples, dst and src must not overlap. Each output channel is the
+ * input channel with the same index, or the last one if there are fewer.
+ */
+typedef void (*audio_capture_func_t)(int16_t *dst, const void *src, size_t frames,
+                                     unsigned int src_channels, unsigned int dst_channels);
+
+/*
+ * Picks the kernel that takes the stream channels out of frames captured
+ * in src_format in a single pass. *func is set to NULL when the frames can
+ * be used as they are. Returns -EINVAL if the format is not supported.
+ */
+int audio_capture_select(unsigned int src_channels, audio_format_t src_format,
+                         unsigned int dst_channels, audio_capture_func_t *func);
+
+/*
+ * Like audio_capture_func_t, to float samples in [-1, 1) that keep all the
+ * bits of the captured ones.
+ */
+typedef void (*audio_capture_float_func_t)(float *dst, const void *src, size_t frames,
+                                           unsigned int src_channels,
+                                           unsigned int dst_channels);
+
+/* Like audio_capture_select(), *func is never NULL on success */
+int audio_capture_float_select(unsigned int src_channels, audio_format_t src_format,
+                               unsigned int dst_channels, audio_capture_float_func_t *func);
+
+/* Widens 16 bit samples to float, dst may be src */
+void audio_float_from_i16(float *dst, const int16_t *src, size_t samples);
+
+/*
+ * Widens samples of a stream format to float, dst and src must not
+ * overlap. Returns -EINVAL if the format is not supported.
+ */
+int audio_float_from_format(float *dst, const void *src, size_t samples,
+                            audio_format_t src_format);
+
+/*
+ * Converts frames of interleaved float samples, clamped to [-1, 1). The 16
+ * bit kernels also run in place, dst may be src; dst and src must not
+ * overlap otherwise.
+ */
+typedef void (*audio_convert_float_func_t)(void *dst, const float *src, size_t frames);
+
+/* Like audio_convert_select() from float, *func is never NULL on success */
+int audio_convert_float_select(unsigned int src_channels, unsigned int dst_channels,
+                               audio_format_t dst_format, audio_convert_float_func_t *func);
+
+/* Adds src to dst, saturating to 16 bit */
+void audio_mix_i16(int16_t *dst, const int16_t *src, size_t samples);
+
+/*
+ * Gain of a stream, in 2.30 fixed point. A new setting is reached with a
+ * linear ramp over a number of frames, so that changes don't click. The
+ * even channels take the left gain, the odd ones the right gain, and mono
+ * frames the left gain.
+ */
+#define AUDIO_GAIN_UNITY (1 << 30)
+
+struct audio_gain {
+    int32_t gain[2]; /* left and right */
+    int32_t target[2];
+    int32_t step[2]; /* added every frame of the ramp */
+    uint32_t ramp_frames; /* left in the ramp */
+};
+
+/* sets the gains, clamped to [0, 1], over ramp_frames frames (0 to jump) */
+void audio_gain_set(struct audio_gain *gain, float left, float right, uint32_t ramp_frames);
+
+/* true if applying the gain leaves the frames as they are */
+static inline bool audio_gain_is_unity(const struct audio_gain *gain)
+{
+    return gain->ramp_frames == 0 && gain->gain[0] == AUDIO_GAIN_UNITY &&
+            gain->gain[1] == AUDIO_GAIN_UNITY;
+}
+
+/* true if applying the gain only produces silence */
+static inline bool audio_gain_is_mute(const struct audio_gain *gain)
+{
+    return gain->ramp_frames == 0 && gain->gain[0] == 0 && gain->gain[1] == 0;
+}
+
+/*
+ * Applies the gain to frames of 16 bit samples, moving along its ramp.
+ * dst may be src.
+ */
+void audio_gain_apply(struct audio_gain *gain, int16_t *dst, const int16_t *src,
+                      size_t frames, unsigned int channels);
+
+/* The same for float samples */
+void audio_gain_apply_float(struct audio_gain *gain, float *dst, const float *src,
+                            size_t frames, unsigned int channels);
+
+/*
+ * Like audio_convert_func_t, scaling by a gain on the way so that the two
+ * take a single pass. Mono sources only take gain0. dst and src must not
+ * overlap.
+ */
+typedef void (*audio_convert_gain_func_t)(void *dst, const int16_t *src, size_t frames,
+                                          int16_t gain0, int16_t gain1);
+
+/* Like audio_convert_select(), *func is never NULL on success */
+int audio_convert_gain_select(unsigned int src_channels, unsigned int dst_channels,
+                              audio_format_t dst_format, audio_convert_gain_func_t *func);
+
+/* Runs func with the gain, which must not be ramping */
+void audio_convert_gain(audio_convert_gain_func_t func, const struct audio_gain *gain,
+                        void *dst, const int16_t *src, size_t frames);
+
+#endif
@@ -17,13 +17,16 @@
 #define LOG_TAG "audio_hw_primary"
 /*#define LOG_NDEBUG 0*/
 
-#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
+#include <time.h>
 
 #include <cutils/log.h>
 #include <cutils/properties.h>
@@ -39,9 +42,12 @@
 #include <tinyalsa/asoundlib.h>
 
 #include <audio_utils/resampler.h>
-#include <audio_utils/format.h>
 
+#include "audio_bringup.h"
+#include "audio_cards.h"
+#include "audio_convert.h"
 #include "audio_route.h"
+#include "audio_stats.h"
 
 #define PCM_CARD 0
 #define PCM_DEVICE 0
@@ -52,15 +58,45 @@
 #define OUT_SHORT_PERIOD_COUNT 2
 #define OUT_LONG_PERIOD_COUNT 8
 #define OUT_SAMPLING_RATE 48000
+/* the playback conversions produce mono and stereo only */
+#define OUT_MAX_CHANNELS 2
+
+/* AUDIO_OUTPUT_FLAG_DEEP_BUFFER: 80 ms periods, one wakeup per period while the screen is off */
+#define DEEP_BUFFER_PERIOD_SIZE 3840
+#define DEEP_BUFFER_PERIOD_COUNT 4
 
 #define IN_PERIOD_SIZE 1024
 #define IN_PERIOD_COUNT 4
 #define IN_SAMPLING_RATE 48000
+#define IN_MAX_CHANNELS 4
 
 #define SCO_PERIOD_SIZE 256
 #define SCO_PERIOD_COUNT 4
 #define SCO_SAMPLING_RATE 8000
 
+/* MMAP_NOIRQ streams: the client writes straight into the hardware ring */
+#define MMAP_PERIOD_SIZE (OUT_SAMPLING_RATE / 500)
+#define MMAP_PERIOD_COUNT_MIN 32
+#define MMAP_PERIOD_COUNT_MAX 512
+
+/* outputs sharing the PCM keep about that many periods queued for mixing */
+#define MIX_QUEUE_PERIODS 2
+
+/* volume, gain and mute changes ramp over this long */
+#define GAIN_RAMP_MS 20
+
+/*
+ * hal.audio.out.threshold=adaptive: instead of a fixed short write
+ * threshold, each output looks for the lowest one it can sustain. An
+ * underrun raises it by a period and a near miss, less than a quarter
+ * period left in the kernel buffer, by a quarter period. It is lowered by
+ * a quarter period after a stable stretch, which doubles every time the
+ * threshold it led to didn't hold.
+ */
+#define ADAPT_FLOOR_MS 5 /* hal.audio.out.threshold.floor_ms */
+#define ADAPT_STABLE_MS 2000
+#define ADAPT_STABLE_MAX_MS 64000
+
 /* minimum sleep time in out_write() when write threshold is not reached */
 #define MIN_WRITE_SLEEP_US 2000
 #define MAX_WRITE_SLEEP_US ((OUT_PERIOD_SIZE * OUT_SHORT_PERIOD_COUNT * 1000000) \
@@ -72,6 +108,49 @@ enum {
     OUT_BUFFER_TYPE_LONG,
 };
 
+/*
+ * Resampler quality tiers, each can be overridden by its property with a
+ * value from RESAMPLER_QUALITY_MIN to RESAMPLER_QUALITY_MAX.
+ */
+enum {
+    RESAMPLER_TIER_SCO, /* 8 kHz narrow band, a short filter does */
+    RESAMPLER_TIER_VOICE, /* voice communication and recognition capture */
+    RESAMPLER_TIER_MEDIA, /* everything else */
+    RESAMPLER_TIER_COUNT,
+};
+
+static const struct {
+    const char *prop;
+    int quality;
+} resampler_tiers[RESAMPLER_TIER_COUNT] = {
+    [RESAMPLER_TIER_SCO] = { "hal.audio.resampler.sco", RESAMPLER_QUALITY_MIN },
+    [RESAMPLER_TIER_VOICE] = { "hal.audio.resampler.voice", RESAMPLER_QUALITY_VOIP },
+    [RESAMPLER_TIER_MEDIA] = { "hal.audio.resampler.media", RESAMPLER_QUALITY_DEFAULT },
+};
+
+/* what a resampler kept across standby was created for */
+struct resampler_setup {
+    uint32_t in_rate;
+    uint32_t out_rate;
+    unsigned int channels;
+    int quality;
+};
+
+/*
+ * How out_write() waits for the kernel buffer to drain down to
+ * cur_write_threshold:
+ * SLEEP: usleep() in a loop, re-reading the buffer level every time
+ * POLL: block on the PCM fd, avail_min is set so that it becomes
+ *       writable once the buffer drained down to the short threshold
+ * TIMER: sleep on a timerfd armed with an absolute deadline derived
+ *        from the PCM hardware timestamp
+ */
+enum {
+    OUT_PACING_SLEEP,
+    OUT_PACING_POLL,
+    OUT_PACING_TIMER,
+};
+
 struct pcm_config pcm_config_out = {
     .channels = 2,
     .rate = OUT_SAMPLING_RATE,
@@ -81,6 +160,15 @@ struct pcm_config pcm_config_out = {
     .start_threshold = OUT_PERIOD_SIZE * OUT_SHORT_PERIOD_COUNT,
 };
 
+struct pcm_config pcm_config_deep_buffer = {
+    .channels = 2,
+    .rate = OUT_SAMPLING_RATE,
+    .period_size = DEEP_BUFFER_PERIOD_SIZE,
+    .period_count = DEEP_BUFFER_PERIOD_COUNT,
+    .format = PCM_FORMAT_S16_LE,
+    .start_threshold = DEEP_BUFFER_PERIOD_SIZE,
+};
+
 struct pcm_config pcm_config_in = {
     .channels = 2,
     .rate = IN_SAMPLING_RATE,
@@ -99,6 +187,123 @@ struct pcm_config pcm_config_sco = {
     .format = PCM_FORMAT_S16_LE,
 };
 
+struct pcm_config pcm_config_mmap_out = {
+    .channels = 2,
+    .rate = OUT_SAMPLING_RATE,
+    .period_size = MMAP_PERIOD_SIZE,
+    .period_count = MMAP_PERIOD_COUNT_MAX,
+    .format = PCM_FORMAT_S16_LE,
+    .start_threshold = MMAP_PERIOD_SIZE * 8,
+    /* the HAL never moves the application pointer, don't stop on xrun */
+    .stop_threshold = INT32_MAX,
+    .avail_min = MMAP_PERIOD_SIZE,
+};
+
+#define ROUTE_QUEUE_SIZE 8
+
+/* mixer_paths_<card id>.xml, mixer_paths_<card number>.xml or, for USB
+ * cards, mixer_paths_usb.xml; the card of the speaker falls back to the
+ * older single file */
+#ifndef MIXER_XML_DIR
+#define MIXER_XML_DIR "/vendor/etc"
+#endif
+#ifndef MIXER_XML_PATH
+#define MIXER_XML_PATH "/system/etc/mixer_paths.xml"
+#endif
+
+/* bits of audio_device.state */
+#define ADEV_STATE_SCREEN_OFF (1u << 0)
+#define ADEV_STATE_CAPTURING (1u << 1) /* active_in is set */
+#define ADEV_STATE_SCO_OUT (1u << 2) /* out_device has a SCO device */
+#define ADEV_STATE_MIC_MUTE (1u << 3)
+
+/* the mixer paths, each applied on the card its endpoint plays or records on */
+enum route_path {
+    ROUTE_SPEAKER,
+    ROUTE_HEADPHONE,
+    ROUTE_DOCK,
+    ROUTE_MAIN_MIC,
+    ROUTE_HEADSET_MIC,
+    ROUTE_PATH_COUNT,
+};
+
+static const struct {
+    const char *name;
+    enum audio_card_slot slot;
+} route_paths[ROUTE_PATH_COUNT] = {
+    [ROUTE_SPEAKER] = { "speaker", AUDIO_CARD_OUT_SPEAKER },
+    [ROUTE_HEADPHONE] = { "headphone", AUDIO_CARD_OUT_HEADPHONE },
+    [ROUTE_DOCK] = { "dock", AUDIO_CARD_OUT_DOCK },
+    [ROUTE_MAIN_MIC] = { "main-mic", AUDIO_CARD_IN_MIC },
+    [ROUTE_HEADSET_MIC] = { "headset-mic", AUDIO_CARD_IN_HEADSET },
+};
+
+/* a sound card, and its mixer paths if it has a mixer xml */
+struct card_route {
+    struct audio_card card;
+    struct audio_route *ar; /* NULL without mixer xml */
+    unsigned int paths; /* 1 << route_path of the paths applied */
+};
+
+/* the endpoints that can have a bringup command */
+enum bringup_slot {
+    BRINGUP_OUT_HDMI,
+    BRINGUP_IN_HDMI,
+    BRINGUP_OUT_HEADPHONE,
+    BRINGUP_OUT_SPEAKER,
+    BRINGUP_OUT_DOCK,
+    BRINGUP_IN_MIC,
+    BRINGUP_IN_HEADSET,
+    BRINGUP_SLOT_COUNT,
+};
+
+static const struct {
+    const char *prop;
+    const char *name;
+} bringup_slots[BRINGUP_SLOT_COUNT] = {
+    [BRINGUP_OUT_HDMI] = { "hal.audio.out.hdmi.command", "hdmi" },
+    [BRINGUP_IN_HDMI] = { "hal.audio.in.hdmi.command", "hdmi" },
+    [BRINGUP_OUT_HEADPHONE] = { "hal.audio.out.headphone.command", "headphone" },
+    [BRINGUP_OUT_SPEAKER] = { "hal.audio.out.speaker.command", "speaker" },
+    [BRINGUP_OUT_DOCK] = { "hal.audio.out.dock.command", "dock" },
+    [BRINGUP_IN_MIC] = { "hal.audio.in.mic.command", "mic" },
+    [BRINGUP_IN_HEADSET] = { "hal.audio.in.headset.command", "headset mic" },
+};
+
+/*
+ * The bringup commands run for a PCM open of one direction: a mask of
+ * 1 << bringup_slot, and the card they were for.
+ */
+struct bringup_key {
+    unsigned int slots;
+    int card;
+    unsigned int generation; /* audio_cards_generation() */
+};
+
+/* work for the route thread: apply the latest routing, or run the bringups */
+struct route_cmd {
+    bool apply_route;
+    bool is_input;
+    struct bringup_key bringup;
+};
+
+/*
+ * A PCM that a standby stopped but kept open and prepared, so that the
+ * next start skips the card lookup, the bringup commands and pcm_open().
+ * It is only taken back for the same device, routing and configuration
+ * while the cards don't change. A prepared PCM may keep the codec powered,
+ * so it is closed after hal.audio.warm_standby_ms.
+ */
+struct warm_pcm {
+    struct pcm *pcm; /* NULL unless parked */
+    unsigned int device;
+    unsigned int routing;
+    unsigned int generation; /* audio_cards_generation() when it was opened */
+    struct pcm_config requested; /* what my_pcm_open() was asked for */
+    struct pcm_config config; /* and what it gave */
+    int64_t parked_ns;
+};
+
 struct audio_device {
     struct audio_hw_device hw_device;
 
@@ -107,11 +312,71 @@ struct audio_device {
     unsigned int in_device;
     bool standby;
     bool mic_mute;
-    struct audio_route *ar;
     bool screen_off;
+    /* ADEV_STATE_* copy of the fields above, read by the write and read
+     * paths without adev->lock */
+    atomic_uint state;
+    bool single_rate_group; /* hal.audio.single_rate_group */
+    int64_t lock_warn_ns; /* hal.audio.lock_warn_us, 0 to not time the locks */
+    int resampler_quality[RESAMPLER_TIER_COUNT]; /* hal.audio.resampler.* */
 
-    struct stream_out *active_out;
+    /*
+     * The outputs out of standby share a single PCM, opened by the first
+     * one and closed with the last one. While more than one plays, each
+     * queues its frames in 16 bit at the PCM rate and channel count, and
+     * whichever output completes the frames queued by all of the others
+     * mixes them into one PCM write.
+     */
+    struct stream_out *outputs; /* linked through mix_next */
+    unsigned int num_outputs;
+    struct pcm *out_pcm;
+    struct pcm_config out_pcm_config;
+    audio_convert_func_t out_mix_convert; /* 16 bit to the PCM format */
+    pthread_mutex_t out_write_lock; /* serializes the writes to out_pcm */
+    pthread_mutex_t mix_lock; /* protects the mix queues and the output list */
+    pthread_cond_t mix_cond; /* signaled when frames are taken from the mix queues */
+    int16_t *mix_buffer; /* under out_write_lock */
+    size_t mix_buffer_size;
+    void *mix_conv_buffer; /* under out_write_lock */
+    size_t mix_conv_buffer_size;
+
+    struct stream_out *mmap_out; /* has its own PCM */
     struct stream_in *active_in;
+
+    /* the shared output PCM and the input PCM, under adev->lock */
+    struct warm_pcm warm_out;
+    struct warm_pcm warm_in;
+    int64_t warm_standby_ns; /* 0 to close the PCMs on standby */
+
+    /*
+     * Mixer paths and bringup commands are applied by route_thread in the
+     * order they are queued, so that no stream waits on a mixer write or a
+     * bringup. Only the route thread touches the routes once the device is
+     * open, it follows the cards as they come and go.
+     */
+    struct card_route routes[AUDIO_CARDS_MAX];
+    unsigned int num_routes;
+    unsigned int routes_generation; /* audio_cards_generation() of routes */
+    int primary_card; /* card of the speaker, routes the cards without xml */
+    pthread_t route_thread;
+    pthread_mutex_t route_lock; /* protects the fields below, never held for long */
+    pthread_cond_t route_cond;
+    struct route_cmd route_queue[ROUTE_QUEUE_SIZE]; /* bringups only */
+    unsigned int route_head;
+    unsigned int route_count;
+    unsigned int route_out_device; /* latest routing published */
+    unsigned int route_in_device;
+    /* the routing waits for applying, after route_ahead queued bringups */
+    bool route_queued;
+    unsigned int route_ahead;
+    bool route_exit;
+    int64_t route_idle_ns; /* when to close the idle warm PCMs, 0 if none is parked */
+
+    /* compiled at open, NULL for the slots without a command */
+    struct bringup_script *bringup[BRINGUP_SLOT_COUNT];
+    /* what last ran for the outputs and for the inputs, to not run it again
+     * until the card or the route changes; only used by the route thread */
+    struct bringup_key bringup_done[2];
 };
 
 struct stream_out {
@@ -121,19 +386,104 @@ struct stream_out {
     struct pcm *pcm;
     struct pcm_config pcm_config;
     bool standby;
+    bool mmap; /* AUDIO_OUTPUT_FLAG_MMAP_NOIRQ stream */
+    bool deep_buffer; /* AUDIO_OUTPUT_FLAG_DEEP_BUFFER stream */
+    uint32_t sample_rate; /* negotiated with the card when the stream is opened */
+    audio_format_t format; /* 16 bit or out_format_is_hires() */
 
+    /* kept across standby while the rates and the quality don't change */
     struct resampler_itfe *resampler;
-    int16_t *buffer;
+    struct resampler_setup resampler_setup;
+    int16_t *buffer; /* resampler output, kept until the stream is closed */
+    size_t buffer_size;
     size_t buffer_frames;
 
+    /* holds the data converted to the PCM format, kept until the stream is closed */
+    void *conv_buffer;
+    size_t conv_buffer_size;
+    /* channel reduction ahead of the resampler, and the final conversion to
+     * the PCM layout; without resampler, the latter does both in one pass */
+    audio_convert_func_t pre_convert;
+    audio_convert_func_t post_convert;
+    /* post_convert with the steady gain folded in, set along with it */
+    audio_convert_gain_func_t gain_convert;
+
+    /*
+     * High resolution streams are widened to float in float_buffer, then
+     * converted once to the PCM layout by float_convert. When they are
+     * mixed, float_mix_convert takes them to the mix queue in 16 bit in the
+     * same pass; when resampled, float_narrow takes them to 16 bit in place.
+     */
+    float *float_buffer; /* kept until the stream is closed */
+    size_t float_buffer_size;
+    audio_convert_float_func_t float_convert;
+    audio_convert_float_func_t float_mix_convert;
+    audio_convert_float_func_t float_narrow;
+
+    /* frames waiting to be mixed with the other outputs, in 16 bit at the
+     * PCM rate and channel count; mix_convert gets them there when there
+     * is no resampler. The queue is a ring, mix_frames from mix_head. */
+    audio_convert_func_t mix_convert;
+    int16_t *mix_queue;
+    size_t mix_queue_size;
+    size_t mix_head; /* under adev->mix_lock */
+    size_t mix_frames; /* under adev->mix_lock */
+    bool mix_busy; /* in out_write_mixed(), under adev->mix_lock */
+    /* out_set_volume(), applied at the PCM rate and channel count */
+    struct audio_gain gain;
+    int64_t mix_last_ns; /* when the last write returned, under adev->mix_lock */
+    int64_t mix_chunk_ns; /* duration of the last write, under adev->mix_lock */
+    struct stream_out *mix_next;
+
     int write_threshold;
     int cur_write_threshold;
     int buffer_type;
 
+    /* adaptive short write threshold, kept across standby, see ADAPT_STABLE_MS */
+    bool adaptive;
+    int adapt_floor_ms;
+    int adapt_ceiling_ms; /* 0 for the whole kernel buffer */
+    int adapt_floor; /* in frames, for the current PCM */
+    int adapt_ceiling;
+    int adapt_threshold;
+    bool adapt_armed; /* the buffer filled up since the PCM started */
+    bool adapt_lowered; /* the last move was down */
+    int64_t adapt_ns; /* last move */
+    int64_t adapt_stable_ns;
+    unsigned int adapt_raises;
+    unsigned int adapt_lowers;
+    unsigned int near_misses;
+
+    int pacing;
+    int poll_threshold; /* kernel frames at which the PCM fd polls writable, 0 if not set */
+    int timer_fd;
+    unsigned int pacing_wakeups;
+    unsigned int underruns;
+    struct timespec start_time;
+
+    /* frames at the stream rate handed to the driver, minus the ones
+     * discarded when entering standby */
+    uint64_t frames_written;
+    /* frames_written when the stream last exited standby */
+    uint64_t standby_frames_written;
+
+    struct audio_stats stats;
+
     struct audio_device *dev;
 };
 
-#define MAX_PREPROCESSORS 3
+#define MAX_PREPROCESSORS 8
+
+/* a capture preprocessor, and what it costs per 10 ms chunk */
+struct in_effect {
+    effect_handle_t handle;
+    uint32_t chunks;
+    uint32_t overruns; /* chunks that took longer than they last */
+    uint64_t frames;
+    int64_t total_ns;
+    int64_t max_ns;
+};
+
 struct stream_in {
     struct audio_stream_in stream;
 
@@ -143,26 +493,92 @@ struct stream_in {
     bool standby;
 
     unsigned int requested_rate;
+    audio_channel_mask_t channel_mask;
+    unsigned int channels;
+    /* 16 bit or float, the resampler and the effects always run in 16 bit */
+    audio_format_t format;
+    audio_source_t source;
+    /* kept across standby while the rates and the quality don't change */
     struct resampler_itfe *resampler;
+    struct resampler_setup resampler_setup;
     struct resampler_buffer_provider buf_provider;
-    int16_t *buffer;
+    int16_t *buffer; /* kept until the stream is closed */
     size_t buffer_size;
+    /* raw period read when the PCM format or channel count differs from the
+     * stream's, kept until the stream is closed */
+    void *conv_buffer;
+    size_t conv_buffer_size;
+    audio_capture_func_t capture;
+    audio_capture_float_func_t capture_float; /* float streams only */
     size_t frames_in;
     int read_status;
 
+    /* in_set_gain() times the mic mute, applied to what in_read() returns */
+    struct audio_gain gain;
+    float volume;
+    bool muted;
+
+    /* frames read from the PCM since it was opened, and the stream rate
+     * frames read in earlier sessions */
+    int64_t frames_read;
+    int64_t frames_read_base;
+    /* capture time of the next frame to read, 0 until the first read */
+    int64_t next_frame_ns;
+    /* PCM frames lost since the last in_get_input_frames_lost() */
+    uint32_t frames_lost;
+    unsigned int overruns;
+
+    struct audio_stats stats;
+
     struct audio_device *dev;
 
-    effect_handle_t preprocessors[MAX_PREPROCESSORS];
+    struct in_effect preprocessors[MAX_PREPROCESSORS]; /* run in order */
     int num_preprocessors;
+    /*
+     * Preprocessing staging, allocated when the first effect is added and
+     * kept until the stream is closed, counted in frames of the stream
+     * channel count: proc_frames_in frames wait for the
+     * effects at proc_buf + proc_buf_start, and proc_out_frames processed
+     * frames that didn't fit the last read at proc_out_buf + proc_out_start.
+     * The effects in between write to the chain buffers in turn.
+     */
     int16_t *proc_buf;
-    size_t proc_buf_size;
+    size_t proc_buf_size; /* bytes */
+    size_t proc_buf_start;
     size_t proc_frames_in;
     int16_t *proc_out_buf;
+    size_t proc_out_buf_size; /* bytes */
+    size_t proc_out_start;
     size_t proc_out_frames;
+    int16_t *chain_buf[2];
+    size_t chain_buf_size[2]; /* bytes */
 };
 
+/*
+ * Mutex acquisition order, when several are held: adev->lock, then the
+ * stream_in and/or stream_out locks, then adev->out_write_lock, then
+ * adev->mix_lock. adev->route_lock comes last, after the card registry
+ * lock too, as cards_changed() is called under it. The only exception is
+ * out_write_mixed(), which tries out_write_lock with mix_lock held.
+ * out_write() and in_read() only take adev->lock to leave standby,
+ * dropping the stream lock first, and otherwise read the device state
+ * from adev->state.
+ *
+ * All of them are priority inheritance mutexes. What the audio threads
+ * may wait on in the write and read paths:
+ * - the stream lock: the control threads hold it to change pacing,
+ *   effects or routing, and across the PCM close of a standby.
+ * - adev->out_write_lock: held across a PCM write. A mixing output only
+ *   waits for it with more than its share queued.
+ * - adev->mix_lock and adev->route_lock: only held to update a few fields.
+ * - adev->lock: only to leave standby, it can be held across PCM opens.
+ * The stream locks, adev->mix_lock and adev->lock are taken there with
+ * audio_thread_lock(), which logs the waits longer than lock_warn_ns.
+ */
+
 static uint32_t out_get_sample_rate(const struct audio_stream *stream);
 static size_t out_get_buffer_size(const struct audio_stream *stream);
+static uint32_t out_get_channels(const struct audio_stream *stream);
 static audio_format_t out_get_format(const struct audio_stream *stream);
 static uint32_t in_get_sample_rate(const struct audio_stream *stream);
 static size_t in_get_buffer_size(const struct audio_stream *stream);
@@ -172,20 +588,12 @@ static int get_next_buffer(struct resampler_buffer_provider *buffer_provider,
 static void release_buffer(struct resampler_buffer_provider *buffer_provider,
                                   struct resampler_buffer* buffer);
 
-/*
- * NOTE: when multiple mutexes have to be acquired, always take the
- * audio_device mutex first, followed by the stream_in and/or
- * stream_out mutexes.
- */
-
 /* Helper functions */
 
 struct snd_pcm_info *select_card(unsigned int device, unsigned int flags, unsigned int routing)
 {
-    static struct snd_pcm_info *cached_info[7];
-    struct snd_pcm_info *info;
+    struct snd_pcm_info *info = NULL;
     int is_input = !!(flags & PCM_IN);
-    char e = is_input ? 'c' : 'p';
 
     unsigned int headphone_on = routing & (AUDIO_DEVICE_OUT_WIRED_HEADSET |
                                     AUDIO_DEVICE_OUT_WIRED_HEADPHONE); // out
@@ -194,146 +602,380 @@ struct snd_pcm_info *select_card(unsigned int device, unsigned int flags, unsign
     unsigned int main_mic_on = routing & AUDIO_DEVICE_IN_BUILTIN_MIC; // in
     unsigned int headset_mic_on = routing & AUDIO_DEVICE_IN_WIRED_HEADSET; // in
 
-    int d = 0;
+    enum audio_card_slot d = AUDIO_CARD_OUT_SPEAKER;
     // 12L, not 11, not 13, gives a weird state of no route on start when headphone is not plugged in
     if(is_input){
         if(!main_mic_on && !headset_mic_on){
             main_mic_on = 1;
         }
-        d = main_mic_on ? 3 : d;
-        d = headset_mic_on ? 4 : d;
+        d = main_mic_on ? AUDIO_CARD_IN_MIC : d;
+        d = headset_mic_on ? AUDIO_CARD_IN_HEADSET : d;
     }else{
         if(!speaker_on && !headphone_on && !docked){
             speaker_on = 1;
         }
-        d = speaker_on ? 0 : d;
-        d = headphone_on ? 1 : d;
-        d = docked ? 2 : d;
-    }
-
-
-    int want_hdmi = property_get_bool("hal.audio.primary.hdmi", device == PCM_DEVICE_HDMI);
-
-    if (!cached_info[d] || (!cached_info[is_input + 5] && want_hdmi)) {
-        struct dirent **namelist;
-        char path[PATH_MAX] = "/dev/snd/";
-        char prop[PROPERTY_VALUE_MAX];
-        int n;
-        if (want_hdmi && property_get("hal.audio.out.hdmi", prop, NULL)) {
-            ALOGI("using hdmi specific card %s from property", prop);
-            namelist = malloc(sizeof(struct dirent *));
-            namelist[0] = calloc(1, sizeof(struct dirent));
-            strncpy(namelist[0]->d_name, prop, sizeof(namelist[0]->d_name) - 1);
-            n = 1;
-        } else if (!is_input && headphone_on && property_get("hal.audio.out.headphone", prop, NULL)) {
-            ALOGI("using headphone specific card %s from property", prop);
-            namelist = malloc(sizeof(struct dirent *));
-            namelist[0] = calloc(1, sizeof(struct dirent));
-            strncpy(namelist[0]->d_name, prop, sizeof(namelist[0]->d_name) - 1);
-            n = 1;
-        } else if (!is_input && speaker_on && property_get("hal.audio.out.speaker", prop, NULL)) {
-            ALOGI("using speaker specific card %s from property", prop);
-            namelist = malloc(sizeof(struct dirent *));
-            namelist[0] = calloc(1, sizeof(struct dirent));
-            strncpy(namelist[0]->d_name, prop, sizeof(namelist[0]->d_name) - 1);
-            n = 1;
-        } else if (!is_input && docked && property_get("hal.audio.out.dock", prop, NULL)) {
-            ALOGI("using dock specific card %s from property", prop);
-            namelist = malloc(sizeof(struct dirent *));
-            namelist[0] = calloc(1, sizeof(struct dirent));
-            strncpy(namelist[0]->d_name, prop, sizeof(namelist[0]->d_name) - 1);
-            n = 1;
-        } else if (is_input && main_mic_on && property_get("hal.audio.in.mic", prop, NULL)) {
-            ALOGI("using mic specific card %s from property", prop);
-            namelist = malloc(sizeof(struct dirent *));
-            namelist[0] = calloc(1, sizeof(struct dirent));
-            strncpy(namelist[0]->d_name, prop, sizeof(namelist[0]->d_name) - 1);
-            n = 1;
-        } else if (is_input && headset_mic_on && property_get("hal.audio.in.headset", prop, NULL)) {
-            ALOGI("using headset mic specific card %s from property", prop);
-            namelist = malloc(sizeof(struct dirent *));
-            namelist[0] = calloc(1, sizeof(struct dirent));
-            strncpy(namelist[0]->d_name, prop, sizeof(namelist[0]->d_name) - 1);
-            n = 1;
-        } else if (property_get(is_input ? "hal.audio.in" : "hal.audio.out", prop, NULL)) {
-            ALOGI("using %s from property", prop);
-            namelist = malloc(sizeof(struct dirent *));
-            namelist[0] = calloc(1, sizeof(struct dirent));
-            strncpy(namelist[0]->d_name, prop, sizeof(namelist[0]->d_name) - 1);
-            n = 1;
-        } else {
-            n = scandir(path, &namelist, NULL, alphasort);
-        }
-        if (n >= 0) {
-            int i, fd;
-            for (i = 0; i < n; i++) {
-                struct dirent *de = namelist[i];
-                if (!strncmp(de->d_name, "pcmC", 4) && de->d_name[strlen(de->d_name) - 1] == e) {
-                    strcpy(path + 9, de->d_name);
-                    if ((fd = open(path, O_RDWR)) >= 0) {
-                        info = malloc(sizeof(*info));
-                        if (!ioctl(fd, SNDRV_PCM_IOCTL_INFO, info)) {
-                            if (info->stream == is_input && /* ignore IntelHDMI */
-                                    !strstr((const char *)info->id, "IntelHDMI")) {
-                                ALOGD("found audio %s at %s\ncard: %d/%d id: %s\nname: %s\nsubname: %s\nstream: %d",
-                                        is_input ? "in" : "out", path,
-                                        info->card, info->device, info->id,
-                                        info->name, info->subname, info->stream);
-                                int hdmi = (!!strcasestr((const char *)info->id, "HDMI")) * 2;
-                                if (cached_info[hdmi ? 5 + is_input : d]) {
-                                    ALOGD("ignore %s", de->d_name);
-                                    free(info);
-                                } else {
-                                    cached_info[hdmi ? 5 + is_input : d] = info;
-                                }
-                            }
-                        } else {
-                            ALOGV("can't get info of %s", path);
-                            free(info);
-                        }
-                        close(fd);
-                    }
-                }
-                free(de);
-            }
-            free(namelist);
-        }
+        d = speaker_on ? AUDIO_CARD_OUT_SPEAKER : d;
+        d = headphone_on ? AUDIO_CARD_OUT_HEADPHONE : d;
+        d = docked ? AUDIO_CARD_OUT_DOCK : d;
     }
-    if (want_hdmi && cached_info[5 + is_input]) {
-        info = cached_info[5 + is_input];
-    } else {
-        info = cached_info[d] ? cached_info[d] : cached_info[d + 2];
-    }
-    ALOGI_IF(info, "chose pcmC%dD%d%c for %d on cache slot %d", info->card, info->device, is_input ? 'c' : 'p', device, d);
+
+    /* the registry has the cards and the properties cached, this does no I/O */
+    if (audio_cards_primary_hdmi(device == PCM_DEVICE_HDMI))
+        info = audio_cards_find(is_input ? AUDIO_CARD_IN_HDMI : AUDIO_CARD_OUT_HDMI);
+    if (!info)
+        info = audio_cards_find(d);
+    ALOGI_IF(info, "chose pcmC%dD%d%c for %d on cache slot %d (cards generation %u)",
+             info->card, info->device, is_input ? 'c' : 'p', device, d,
+             audio_cards_generation());
     return info;
 }
 
-int get_format_from_prop(const char *prop){
-    int format = property_get_int32(prop, PCM_FORMAT_S16_LE);
+/* the PCM format set for a device, def when the property isn't set */
+int get_format_from_prop(const char *prop, int def){
+    int format = property_get_int32(prop, def);
     if(format != PCM_FORMAT_S16_LE && format != PCM_FORMAT_S32_LE && format != PCM_FORMAT_S8){
         ALOGW("format %d from %s is ignored", format, prop);
-        format = PCM_FORMAT_S16_LE;
+        format = def;
     }
     return format;
 }
 
-pthread_mutex_t prop_command_lock;
-int run_prop_command(const char *command){
-    pthread_mutex_lock(&prop_command_lock);
-    int ret = system(command);
-    pthread_mutex_unlock(&prop_command_lock);
-    return ret;
+static int out_pacing_from_string(const char *value)
+{
+    if (value && !strcmp(value, "poll"))
+        return OUT_PACING_POLL;
+    if (value && !strcmp(value, "timer"))
+        return OUT_PACING_TIMER;
+    return OUT_PACING_SLEEP;
+}
+
+static const char *out_pacing_to_string(int pacing)
+{
+    switch (pacing) {
+    case OUT_PACING_POLL:
+        return "poll";
+    case OUT_PACING_TIMER:
+        return "timer";
+    default:
+        return "sleep";
+    }
+}
+
+/* the stream formats taken besides 16 bit, see out_write() */
+static bool out_format_is_hires(audio_format_t format)
+{
+    return format == AUDIO_FORMAT_PCM_FLOAT || format == AUDIO_FORMAT_PCM_24_BIT_PACKED ||
+            format == AUDIO_FORMAT_PCM_8_24_BIT;
+}
+
+/* audio format matching the PCM sample format, for the audio_convert kernels */
+static audio_format_t audio_format_from_pcm_format(enum pcm_format format)
+{
+    switch (format) {
+    case PCM_FORMAT_S32_LE:
+        return AUDIO_FORMAT_PCM_32_BIT;
+    case PCM_FORMAT_S8:
+        return AUDIO_FORMAT_PCM_8_BIT;
+    default:
+        return AUDIO_FORMAT_PCM_16_BIT;
+    }
+}
+
+/* makes sure *buffer can hold size bytes, it is only ever grown */
+static int ensure_buffer_size(void **buffer, size_t *buffer_size, size_t size)
+{
+    void *new_buffer;
+
+    if (*buffer_size >= size)
+        return 0;
+
+    new_buffer = realloc(*buffer, size);
+    if (new_buffer == NULL) {
+        ALOGE("unable to grow buffer to %zu bytes", size);
+        return -ENOMEM;
+    }
+    *buffer = new_buffer;
+    *buffer_size = size;
+    return 0;
+}
+
+/* mirrors a change of the fields behind flag into adev->state */
+static void adev_set_state(struct audio_device *adev, unsigned int flag, bool on)
+{
+    if (on)
+        atomic_fetch_or_explicit(&adev->state, flag, memory_order_release);
+    else
+        atomic_fetch_and_explicit(&adev->state, ~flag, memory_order_release);
+}
+
+/* hw_params constraints of the PCM select_card() picks, -ENODEV without card */
+static int get_pcm_caps(unsigned int device, unsigned int flags, unsigned int routing,
+                        struct audio_pcm_caps *caps)
+{
+    struct snd_pcm_info *info = select_card(device, flags, routing);
+
+    if (!info)
+        return -ENODEV;
+    return audio_cards_get_caps(info, caps);
+}
+
+static bool caps_has_rate(const struct audio_pcm_caps *caps, unsigned int rate)
+{
+    unsigned int i;
+
+    for (i = 0; i < caps->num_rates; i++)
+        if (caps->rates[i] == rate)
+            return true;
+    return false;
+}
+
+/* the closest supported rate, rounding up so that no band is lost */
+static unsigned int caps_pick_rate(const struct audio_pcm_caps *caps, unsigned int rate)
+{
+    unsigned int i;
+
+    for (i = 0; i < caps->num_rates; i++)
+        if (caps->rates[i] >= rate)
+            return caps->rates[i];
+    return caps->num_rates ? caps->rates[caps->num_rates - 1] : rate;
+}
+
+static uint64_t caps_format_bit(enum pcm_format format)
+{
+    switch (format) {
+    case PCM_FORMAT_S32_LE:
+        return 1ULL << SNDRV_PCM_FORMAT_S32_LE;
+    case PCM_FORMAT_S8:
+        return 1ULL << SNDRV_PCM_FORMAT_S8;
+    default:
+        return 1ULL << SNDRV_PCM_FORMAT_S16_LE;
+    }
+}
+
+/*
+ * Moves config to the closest rate, channel count and format the PCM
+ * accepts. The channels are not raised past max_channels, the PCM open
+ * fails then.
+ */
+static void fit_pcm_config(const struct audio_pcm_caps *caps, struct pcm_config *config,
+                           unsigned int max_channels)
+{
+    static const enum pcm_format formats[] = {
+        PCM_FORMAT_S16_LE, PCM_FORMAT_S32_LE, PCM_FORMAT_S8,
+    };
+    unsigned int rate = caps_pick_rate(caps, config->rate);
+    unsigned int i;
+
+    if (rate != config->rate) {
+        ALOGI("card has no %u Hz, using %u Hz", config->rate, rate);
+        config->rate = rate;
+    }
+    if (config->channels < caps->channels_min) {
+        if (caps->channels_min <= max_channels)
+            config->channels = caps->channels_min;
+        else
+            ALOGW("card takes at least %u channels, more than %u", caps->channels_min,
+                  max_channels);
+    } else if (config->channels > caps->channels_max && caps->channels_max > 0) {
+        config->channels = caps->channels_max;
+    }
+    if (!(caps->formats & caps_format_bit(config->format))) {
+        for (i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+            if (caps->formats & caps_format_bit(formats[i])) {
+                ALOGI("card has no format %d, using %d", config->format, formats[i]);
+                config->format = formats[i];
+                break;
+            }
+        }
+    }
+}
+
+/* adds the sup_* keys of query to reply, the rates are the ones the card runs natively */
+static void add_sup_parameters(struct str_parms *query, struct str_parms *reply,
+                               unsigned int device, unsigned int flags, unsigned int routing,
+                               unsigned int stream_rate, const char *channels,
+                               const char *formats)
+{
+    if (str_parms_has_key(query, AUDIO_PARAMETER_STREAM_SUP_SAMPLING_RATES)) {
+        struct audio_pcm_caps caps;
+        char rates[AUDIO_PCM_CAPS_MAX_RATES * 8];
+        size_t len = 0;
+        unsigned int i;
+
+        if (get_pcm_caps(device, flags, routing, &caps) == 0 && caps.num_rates > 0) {
+            for (i = 0; i < caps.num_rates; i++)
+                len += snprintf(rates + len, sizeof(rates) - len, "%s%u",
+                                i ? "|" : "", caps.rates[i]);
+        } else {
+            snprintf(rates, sizeof(rates), "%u", stream_rate);
+        }
+        str_parms_add_str(reply, AUDIO_PARAMETER_STREAM_SUP_SAMPLING_RATES, rates);
+    }
+    if (str_parms_has_key(query, AUDIO_PARAMETER_STREAM_SUP_CHANNELS))
+        str_parms_add_str(reply, AUDIO_PARAMETER_STREAM_SUP_CHANNELS, channels);
+    /* audio_convert takes care of the card format */
+    if (str_parms_has_key(query, AUDIO_PARAMETER_STREAM_SUP_FORMATS))
+        str_parms_add_str(reply, AUDIO_PARAMETER_STREAM_SUP_FORMATS, formats);
+}
+
+/* channel count of the input PCM, 0 when the card can't tell */
+static unsigned int in_max_channels(unsigned int routing)
+{
+    struct audio_pcm_caps caps;
+
+    if (get_pcm_caps(PCM_DEVICE, PCM_IN, routing, &caps) != 0)
+        return 0;
+    return caps.channels_max;
+}
+
+/* the capture masks, mono and stereo always work as the HAL converts to them */
+static const char *in_channel_masks(unsigned int routing)
+{
+    unsigned int max = in_max_channels(routing);
+
+    if (max >= 4)
+        return "AUDIO_CHANNEL_IN_MONO|AUDIO_CHANNEL_IN_STEREO|"
+               "AUDIO_CHANNEL_INDEX_MASK_3|AUDIO_CHANNEL_INDEX_MASK_4";
+    if (max == 3)
+        return "AUDIO_CHANNEL_IN_MONO|AUDIO_CHANNEL_IN_STEREO|AUDIO_CHANNEL_INDEX_MASK_3";
+    return "AUDIO_CHANNEL_IN_MONO|AUDIO_CHANNEL_IN_STEREO";
+}
+
+/*
+ * Mono and stereo can be opened on any mic. More channels need as many on
+ * the card, at a rate it runs natively as the resampler only takes two.
+ * Sets config to what can be opened instead when it returns -EINVAL.
+ */
+static int check_in_channel_mask(struct audio_device *adev, struct audio_config *config)
+{
+    unsigned int channels = audio_channel_count_from_in_mask(config->channel_mask);
+    struct audio_pcm_caps caps;
+
+    if (config->channel_mask == AUDIO_CHANNEL_IN_MONO ||
+            config->channel_mask == AUDIO_CHANNEL_IN_STEREO)
+        return 0;
+
+    if (audio_channel_mask_get_representation(config->channel_mask) ==
+                AUDIO_CHANNEL_REPRESENTATION_INDEX &&
+            channels > 2 && channels <= IN_MAX_CHANNELS &&
+            get_pcm_caps(PCM_DEVICE, PCM_IN, adev->in_device, &caps) == 0 &&
+            channels <= caps.channels_max) {
+        if (caps_has_rate(&caps, config->sample_rate))
+            return 0;
+        ALOGW("%u channel capture needs a native rate, not %u Hz",
+              channels, config->sample_rate);
+        config->sample_rate = caps_pick_rate(&caps, config->sample_rate);
+        return -EINVAL;
+    }
+
+    config->channel_mask = channels >= 2 ? AUDIO_CHANNEL_IN_STEREO : AUDIO_CHANNEL_IN_MONO;
+    return -EINVAL;
+}
+
+/*
+ * Float capture keeps the bits of the mic only without a resampler, which
+ * works in 16 bit: a float stream is opened at a rate the card runs, and
+ * not on SCO, which has nothing past 16 bit to keep. Sets config to what
+ * can be opened instead when it returns -EINVAL.
+ */
+static int check_in_format(struct audio_device *adev, struct audio_config *config)
+{
+    struct audio_pcm_caps caps;
+
+    if (config->format != AUDIO_FORMAT_PCM_FLOAT)
+        return 0;
+
+    if (adev->in_device & AUDIO_DEVICE_IN_ALL_SCO) {
+        config->format = AUDIO_FORMAT_PCM_16_BIT;
+        return -EINVAL;
+    }
+    if (get_pcm_caps(PCM_DEVICE, PCM_IN, adev->in_device, &caps) == 0 &&
+            !caps_has_rate(&caps, config->sample_rate)) {
+        ALOGW("float capture needs a native rate, not %u Hz", config->sample_rate);
+        config->sample_rate = caps_pick_rate(&caps, config->sample_rate);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static int64_t monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Hands cmd to the route thread, unless the same work is already waiting.
+ * The routing is only a flag, so it is never dropped; a bringup dropped
+ * from a full queue is run again by the next PCM open.
+ */
+static void route_queue_l(struct audio_device *adev, const struct route_cmd *cmd)
+{
+    unsigned int i;
+
+    if (cmd->apply_route) {
+        if (!adev->route_queued) {
+            adev->route_queued = true;
+            adev->route_ahead = adev->route_count;
+            pthread_cond_signal(&adev->route_cond);
+        }
+        return;
+    }
+
+    for (i = 0; i < adev->route_count; i++) {
+        const struct route_cmd *c =
+                &adev->route_queue[(adev->route_head + i) % ROUTE_QUEUE_SIZE];
+        if (c->is_input == cmd->is_input &&
+                !memcmp(&c->bringup, &cmd->bringup, sizeof(cmd->bringup)))
+            return;
+    }
+    if (adev->route_count == ROUTE_QUEUE_SIZE) {
+        ALOGW("route queue full, dropping the bringup of card %d", cmd->bringup.card);
+        return;
+    }
+
+    adev->route_queue[(adev->route_head + adev->route_count) % ROUTE_QUEUE_SIZE] = *cmd;
+    adev->route_count++;
+    pthread_cond_signal(&adev->route_cond);
+}
+
+/*
+ * Has the route thread run the bringup commands of slots for a PCM on
+ * card, without waiting for them.
+ */
+static void run_bringups(struct audio_device *adev, int card, unsigned int slots,
+                         bool is_input)
+{
+    struct route_cmd cmd = { .apply_route = false, .is_input = is_input };
+    unsigned int i;
+
+    for (i = 0; i < BRINGUP_SLOT_COUNT; i++)
+        if (!adev->bringup[i])
+            slots &= ~(1u << i);
+    if (!slots)
+        return;
+
+    cmd.bringup.slots = slots;
+    cmd.bringup.card = card;
+    cmd.bringup.generation = audio_cards_generation();
+    pthread_mutex_lock(&adev->route_lock);
+    route_queue_l(adev, &cmd);
+    pthread_mutex_unlock(&adev->route_lock);
 }
 
-void last_ditch_card_and_format_adjustments(unsigned int routing, struct pcm_config *config, int is_input){
-    int want_hdmi = property_get_bool("hal.audio.primary.hdmi", !!(routing & AUDIO_DEVICE_OUT_AUX_DIGITAL));
+void last_ditch_card_and_format_adjustments(struct audio_device *adev, int card,
+                                            unsigned int routing,
+                                            struct pcm_config *config, int is_input){
+    int want_hdmi = audio_cards_primary_hdmi(!!(routing & AUDIO_DEVICE_OUT_AUX_DIGITAL));
     unsigned int headphone_on = routing & (AUDIO_DEVICE_OUT_WIRED_HEADSET |
                                     AUDIO_DEVICE_OUT_WIRED_HEADPHONE); // out
     unsigned int speaker_on = routing & AUDIO_DEVICE_OUT_SPEAKER; // out
     unsigned int docked = routing & AUDIO_DEVICE_OUT_ANLG_DOCK_HEADSET; // out
     unsigned int main_mic_on = routing & AUDIO_DEVICE_IN_BUILTIN_MIC; // in
     unsigned int headset_mic_on = routing & AUDIO_DEVICE_IN_WIRED_HEADSET; // in
-    char prop[PROPERTY_VALUE_MAX];
+    unsigned int slots = 0;
 
     // 12L, not 11, not 13, gives a weird state of no route on start when headphone is not plugged in
     if(is_input){
@@ -347,52 +989,36 @@ void last_ditch_card_and_format_adjustments(unsigned int routing, struct pcm_con
     }
 
     if(want_hdmi){
-        const char *command_key = is_input ? "hal.audio.in.hdmi.command" : "hal.audio.out.hdmi.command";
         const char *format_key = is_input ? "hal.audio.in.hdmi.format" : "hal.audio.out.hdmi.format";
-        if (property_get(command_key, prop, NULL)) {
-            ALOGI("running bringup command {%s} for hdmi", prop);
-            run_prop_command(prop);
-        }
-        config->format = get_format_from_prop(format_key);
+        slots |= 1u << (is_input ? BRINGUP_IN_HDMI : BRINGUP_OUT_HDMI);
+        config->format = get_format_from_prop(format_key, config->format);
     }
     if (!is_input && headphone_on) {
-        if (property_get("hal.audio.out.headphone.command", prop, NULL)) {
-            ALOGI("running bringup command {%s} for headphone", prop);
-            run_prop_command(prop);
-        }
-        config->format = get_format_from_prop("hal.audio.out.headphone.format");
+        slots |= 1u << BRINGUP_OUT_HEADPHONE;
+        config->format = get_format_from_prop("hal.audio.out.headphone.format", config->format);
     }
     if (!is_input && speaker_on) {
-        if (property_get("hal.audio.out.speaker.command", prop, NULL)) {
-            ALOGI("running bringup command {%s} for speaker", prop);
-            run_prop_command(prop);
-        }
-        config->format = get_format_from_prop("hal.audio.out.speaker.format");
+        slots |= 1u << BRINGUP_OUT_SPEAKER;
+        config->format = get_format_from_prop("hal.audio.out.speaker.format", config->format);
     }
     if (!is_input && docked) {
-        if (property_get("hal.audio.out.dock.command", prop, NULL)) {
-            ALOGI("running bringup command {%s} for dock", prop);
-            run_prop_command(prop);
-        }
-        config->format = get_format_from_prop("hal.audio.out.dock.format");
+        slots |= 1u << BRINGUP_OUT_DOCK;
+        config->format = get_format_from_prop("hal.audio.out.dock.format", config->format);
     }
     if (is_input && main_mic_on) {
-        if (property_get("hal.audio.in.mic.command", prop, NULL)) {
-            ALOGI("running bringup command {%s} for mic", prop);
-            run_prop_command(prop);
-        }
-        config->format = get_format_from_prop("hal.audio.in.mic.format");
+        slots |= 1u << BRINGUP_IN_MIC;
+        config->format = get_format_from_prop("hal.audio.in.mic.format", config->format);
     }
     if (is_input && headset_mic_on) {
-        if (property_get("hal.audio.in.headset.command", prop, NULL)) {
-            ALOGI("running bringup command {%s} for headset mic", prop);
-            run_prop_command(prop);
-        }
-        config->format = get_format_from_prop("hal.audio.in.headset.format");
+        slots |= 1u << BRINGUP_IN_HEADSET;
+        config->format = get_format_from_prop("hal.audio.in.headset.format", config->format);
     }
+
+    run_bringups(adev, card, slots, is_input);
 }
 
-struct pcm *my_pcm_open(unsigned int device, unsigned int flags, struct pcm_config *config, unsigned int routing)
+struct pcm *my_pcm_open(struct audio_device *adev, unsigned int device, unsigned int flags,
+                        struct pcm_config *config, unsigned int routing)
 {
     struct snd_pcm_info *info = select_card(device, flags, routing);
     if (!info) {
@@ -400,10 +1026,16 @@ struct pcm *my_pcm_open(unsigned int device, unsigned int flags, struct pcm_conf
         return NULL;
     }
 
-    last_ditch_card_and_format_adjustments(routing, config, flags & PCM_IN);
+    last_ditch_card_and_format_adjustments(adev, info->card, routing, config, flags & PCM_IN);
+
+    /* the PCM is already in use the first time if the caps fail, guess then */
+    struct audio_pcm_caps caps;
+    bool has_caps = audio_cards_get_caps(info, &caps) == 0;
+    if (has_caps)
+        fit_pcm_config(&caps, config, (flags & PCM_IN) ? UINT_MAX : OUT_MAX_CHANNELS);
 
     struct pcm *pcm = pcm_open(info->card, info->device, flags, config);
-    if (pcm && !pcm_is_ready(pcm)) {
+    if (pcm && !pcm_is_ready(pcm) && !has_caps) {
         ALOGE("my_pcm_open(%d) failed: %s", flags, pcm_get_error(pcm));
         pcm_close(pcm);
         ALOGI("my_pcm_open: re-try 44100 on card %d/%d", info->card, info->device);
@@ -413,98 +1045,660 @@ struct pcm *my_pcm_open(unsigned int device, unsigned int flags, struct pcm_conf
     return pcm;
 }
 
-static void select_devices(struct audio_device *adev)
+/* has the route thread look at the warm PCMs at deadline_ns */
+static void route_schedule_idle(struct audio_device *adev, int64_t deadline_ns)
 {
-    int headphone_on;
-    int speaker_on;
-    int docked;
-    int main_mic_on;
-    int headset_mic_on;
-
-    headphone_on = adev->out_device & (AUDIO_DEVICE_OUT_WIRED_HEADSET |
-                                    AUDIO_DEVICE_OUT_WIRED_HEADPHONE);
-    speaker_on = adev->out_device & AUDIO_DEVICE_OUT_SPEAKER;
-    docked = adev->out_device & AUDIO_DEVICE_OUT_ANLG_DOCK_HEADSET;
-    main_mic_on = adev->in_device & AUDIO_DEVICE_IN_BUILTIN_MIC;
-    headset_mic_on = adev->in_device & AUDIO_DEVICE_IN_WIRED_HEADSET;
+    pthread_mutex_lock(&adev->route_lock);
+    if (adev->route_idle_ns == 0 || deadline_ns < adev->route_idle_ns) {
+        adev->route_idle_ns = deadline_ns;
+        pthread_cond_signal(&adev->route_cond);
+    }
+    pthread_mutex_unlock(&adev->route_lock);
+}
 
-    reset_mixer_state(adev->ar);
+static bool same_pcm_config(const struct pcm_config *a, const struct pcm_config *b)
+{
+    return a->channels == b->channels && a->rate == b->rate &&
+            a->period_size == b->period_size && a->period_count == b->period_count &&
+            a->format == b->format && a->start_threshold == b->start_threshold &&
+            a->stop_threshold == b->stop_threshold && a->avail_min == b->avail_min;
+}
 
-    if (speaker_on)
-        audio_route_apply_path(adev->ar, "speaker");
-    if (headphone_on)
-        audio_route_apply_path(adev->ar, "headphone");
-    if (docked)
-        audio_route_apply_path(adev->ar, "dock");
-    if (main_mic_on)
-        audio_route_apply_path(adev->ar, "main-mic");
-    if (headset_mic_on)
-        audio_route_apply_path(adev->ar, "headset-mic");
+static void warm_pcm_close(struct warm_pcm *warm)
+{
+    if (warm->pcm) {
+        pcm_close(warm->pcm);
+        warm->pcm = NULL;
+    }
+}
 
-    update_mixer_state(adev->ar);
+/*
+ * my_pcm_open(), unless warm holds a PCM opened for the same, which is
+ * taken back then. Must be called with adev->lock held.
+ */
+static struct pcm *warm_pcm_open(struct audio_device *adev, struct warm_pcm *warm,
+                                 unsigned int device, unsigned int flags,
+                                 struct pcm_config *config, unsigned int routing)
+{
+    struct pcm *pcm;
 
-    ALOGV("hp=%c speaker=%c dock=%c main-mic=%c headset-mic=%c", headphone_on ? 'y' : 'n',
-          speaker_on ? 'y' : 'n', docked ? 'y' : 'n', main_mic_on ? 'y' : 'n', headset_mic_on ? 'y' : 'n' );
+    if (warm->pcm && warm->device == device && warm->routing == routing &&
+            warm->generation == audio_cards_generation() &&
+            same_pcm_config(&warm->requested, config)) {
+        ALOGV("resuming the warm PCM of device %u", device);
+        pcm = warm->pcm;
+        warm->pcm = NULL;
+        *config = warm->config;
+        return pcm;
+    }
+    warm_pcm_close(warm);
+
+    warm->device = device;
+    warm->routing = routing;
+    warm->generation = audio_cards_generation();
+    warm->requested = *config;
+    pcm = my_pcm_open(adev, device, flags, config, routing);
+    warm->config = *config;
+    return pcm;
 }
 
-/* must be called with hw device and output stream mutexes locked */
-static void do_out_standby(struct stream_out *out)
+/* stops pcm and keeps it in warm, or closes it. Must be called with adev->lock held. */
+static void warm_pcm_park(struct audio_device *adev, struct warm_pcm *warm, struct pcm *pcm)
 {
-    struct audio_device *adev = out->dev;
-
-    if (!out->standby) {
-        pcm_close(out->pcm);
-        out->pcm = NULL;
-        adev->active_out = NULL;
-        if (out->resampler) {
-            release_resampler(out->resampler);
-            out->resampler = NULL;
-        }
-        if (out->buffer) {
-            free(out->buffer);
-            out->buffer = NULL;
-        }
-        out->standby = true;
+    if (adev->warm_standby_ns == 0) {
+        pcm_close(pcm);
+        return;
     }
+
+    pcm_stop(pcm);
+    pcm_prepare(pcm);
+    warm->pcm = pcm;
+    warm->parked_ns = monotonic_ns();
+    route_schedule_idle(adev, warm->parked_ns + adev->warm_standby_ns);
 }
 
-/* must be called with hw device and input stream mutexes locked */
-static void do_in_standby(struct stream_in *in)
+/* closes the warm PCMs parked for too long. Must be called with adev->lock held. */
+static void warm_pcm_expire(struct audio_device *adev)
 {
-    struct audio_device *adev = in->dev;
+    struct warm_pcm *warms[] = { &adev->warm_out, &adev->warm_in };
+    int64_t now = monotonic_ns();
+    unsigned int i;
 
-    if (!in->standby) {
-        pcm_close(in->pcm);
-        in->pcm = NULL;
-        adev->active_in = NULL;
-        if (in->resampler) {
-            release_resampler(in->resampler);
-            in->resampler = NULL;
-        }
-        if (in->buffer) {
-            free(in->buffer);
-            in->buffer = NULL;
-        }
-        if (in->proc_buf) {
-            free(in->proc_buf);
-            in->proc_buf = NULL;
-            in->proc_buf_size = 0;
-        }
-        if (in->proc_out_buf) {
-            free(in->proc_out_buf);
-            in->proc_out_buf = NULL;
-            in->proc_out_frames = 0;
+    for (i = 0; i < sizeof(warms) / sizeof(warms[0]); i++) {
+        if (!warms[i]->pcm)
+            continue;
+        if (now - warms[i]->parked_ns >= adev->warm_standby_ns) {
+            ALOGV("closing the idle PCM of device %u", warms[i]->device);
+            warm_pcm_close(warms[i]);
+        } else {
+            route_schedule_idle(adev, warms[i]->parked_ns + adev->warm_standby_ns);
         }
-        in->standby = true;
     }
 }
 
-/* must be called with hw device and output stream mutexes locked */
-static int start_output_stream(struct stream_out *out)
+static struct audio_route *card_route_init(const struct audio_card *card, bool primary)
+{
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), MIXER_XML_DIR "/mixer_paths_%s.xml", card->id);
+    if (card->id[0] && access(path, R_OK) == 0)
+        return audio_route_init(card->card, path);
+    snprintf(path, sizeof(path), MIXER_XML_DIR "/mixer_paths_%d.xml", card->card);
+    if (access(path, R_OK) == 0)
+        return audio_route_init(card->card, path);
+    if (!strcmp(card->driver, "USB-Audio") &&
+            access(MIXER_XML_DIR "/mixer_paths_usb.xml", R_OK) == 0)
+        return audio_route_init(card->card, MIXER_XML_DIR "/mixer_paths_usb.xml");
+    if (primary)
+        return audio_route_init(card->card, MIXER_XML_PATH);
+
+    ALOGV("no mixer paths for card %d (%s)", card->card, card->id);
+    return NULL;
+}
+
+/*
+ * Follows the cards after a rescan: a card that went away loses its route,
+ * a new one gets its mixer paths loaded. Only called from the route thread,
+ * or before it starts.
+ */
+static void refresh_routes(struct audio_device *adev)
+{
+    struct audio_card cards[AUDIO_CARDS_MAX];
+    struct card_route routes[AUDIO_CARDS_MAX];
+    unsigned int generation = audio_cards_generation();
+    unsigned int num_cards;
+    unsigned int i;
+    unsigned int j;
+
+    if (adev->routes_generation == generation && generation != 0)
+        return;
+    adev->routes_generation = generation;
+
+    struct snd_pcm_info *info = select_card(0, PCM_OUT, 0);
+    adev->primary_card = info ? info->card : -1;
+
+    num_cards = audio_cards_list(cards, AUDIO_CARDS_MAX);
+    for (i = 0; i < num_cards; i++) {
+        routes[i].card = cards[i];
+        routes[i].ar = NULL;
+        routes[i].paths = 0;
+        for (j = 0; j < adev->num_routes; j++) {
+            if (!memcmp(&adev->routes[j].card, &cards[i], sizeof(cards[i]))) {
+                routes[i] = adev->routes[j];
+                adev->routes[j].ar = NULL;
+                break;
+            }
+        }
+        if (j == adev->num_routes)
+            routes[i].ar = card_route_init(&cards[i], cards[i].card == adev->primary_card);
+    }
+    for (j = 0; j < adev->num_routes; j++) {
+        if (adev->routes[j].ar) {
+            ALOGI("card %d (%s) is gone", adev->routes[j].card.card, adev->routes[j].card.id);
+            audio_route_free(adev->routes[j].ar);
+        }
+    }
+
+    memcpy(adev->routes, routes, num_cards * sizeof(routes[0]));
+    adev->num_routes = num_cards;
+}
+
+static struct card_route *find_route(struct audio_device *adev, int card)
+{
+    unsigned int i;
+
+    for (i = 0; i < adev->num_routes; i++)
+        if (adev->routes[i].card.card == card)
+            return adev->routes[i].ar ? &adev->routes[i] : NULL;
+    return NULL;
+}
+
+/* the route of the card of an endpoint, or the primary one */
+static struct card_route *slot_route(struct audio_device *adev, enum audio_card_slot slot)
+{
+    struct snd_pcm_info *info = audio_cards_find(slot);
+    struct card_route *route = info ? find_route(adev, info->card) : NULL;
+
+    return route ? route : find_route(adev, adev->primary_card);
+}
+
+/*
+ * Sets the mixer paths for a routing, on the cards whose paths change.
+ * Returns true if any mixer was written. Only called from the route thread.
+ */
+static bool apply_route(struct audio_device *adev, unsigned int out_device,
+                        unsigned int in_device)
+{
+    unsigned int wanted = 0;
+    unsigned int paths[AUDIO_CARDS_MAX];
+    bool changed = false;
+    unsigned int i;
+    unsigned int p;
+
+    if (out_device & AUDIO_DEVICE_OUT_SPEAKER)
+        wanted |= 1u << ROUTE_SPEAKER;
+    if (out_device & (AUDIO_DEVICE_OUT_WIRED_HEADSET | AUDIO_DEVICE_OUT_WIRED_HEADPHONE))
+        wanted |= 1u << ROUTE_HEADPHONE;
+    if (out_device & AUDIO_DEVICE_OUT_ANLG_DOCK_HEADSET)
+        wanted |= 1u << ROUTE_DOCK;
+    if (in_device & AUDIO_DEVICE_IN_BUILTIN_MIC)
+        wanted |= 1u << ROUTE_MAIN_MIC;
+    if (in_device & AUDIO_DEVICE_IN_WIRED_HEADSET)
+        wanted |= 1u << ROUTE_HEADSET_MIC;
+
+    refresh_routes(adev);
+    memset(paths, 0, sizeof(paths));
+    for (p = 0; p < ROUTE_PATH_COUNT; p++) {
+        struct card_route *route;
+
+        if (!(wanted & (1u << p)))
+            continue;
+        route = slot_route(adev, route_paths[p].slot);
+        if (route)
+            paths[route - adev->routes] |= 1u << p;
+    }
+
+    for (i = 0; i < adev->num_routes; i++) {
+        struct card_route *route = &adev->routes[i];
+
+        if (!route->ar || route->paths == paths[i])
+            continue;
+
+        reset_mixer_state(route->ar);
+        for (p = 0; p < ROUTE_PATH_COUNT; p++)
+            if (paths[i] & (1u << p))
+                audio_route_apply_path(route->ar, route_paths[p].name);
+        update_mixer_state(route->ar);
+        route->paths = paths[i];
+        changed = true;
+
+        ALOGV("card %d: hp=%c speaker=%c dock=%c main-mic=%c headset-mic=%c", route->card.card,
+              paths[i] & (1u << ROUTE_HEADPHONE) ? 'y' : 'n',
+              paths[i] & (1u << ROUTE_SPEAKER) ? 'y' : 'n',
+              paths[i] & (1u << ROUTE_DOCK) ? 'y' : 'n',
+              paths[i] & (1u << ROUTE_MAIN_MIC) ? 'y' : 'n',
+              paths[i] & (1u << ROUTE_HEADSET_MIC) ? 'y' : 'n');
+    }
+
+    return changed;
+}
+
+/* runs the bringups of cmd unless they were the last ones run for its direction */
+static void route_bringup(struct audio_device *adev, const struct route_cmd *cmd)
+{
+    struct bringup_key *done = &adev->bringup_done[cmd->is_input ? 1 : 0];
+    unsigned int i;
+    struct card_route *route;
+    struct audio_route *bare = NULL;
+    int ret = 0;
+
+    if (!memcmp(done, &cmd->bringup, sizeof(*done))) {
+        ALOGV("bringup of card %d already done", cmd->bringup.card);
+        return;
+    }
+
+    /*
+     * The ctls are set on the card the PCM is on. A card without mixer
+     * paths, as HDMI and USB cards usually are, gets a route with no paths
+     * for the time of the bringup.
+     */
+    refresh_routes(adev);
+    route = find_route(adev, cmd->bringup.card);
+    if (!route) {
+        bare = audio_route_init(cmd->bringup.card, NULL);
+        if (!bare)
+            ALOGE("no mixer for the bringup of card %d, its ctls fail", cmd->bringup.card);
+    }
+
+    for (i = 0; i < BRINGUP_SLOT_COUNT && ret == 0; i++) {
+        if (!(cmd->bringup.slots & (1u << i)))
+            continue;
+        ALOGI("running bringup command {%s} for %s",
+              bringup_script_command(adev->bringup[i]), bringup_slots[i].name);
+        ret = bringup_script_run(adev->bringup[i], route ? route->ar : bare);
+    }
+    if (bare)
+        audio_route_free(bare);
+
+    /* a failed bringup is tried again on the next PCM open */
+    if (ret == 0)
+        *done = cmd->bringup;
+    else
+        memset(done, 0, sizeof(*done));
+}
+
+static void *route_thread(void *context)
+{
+    struct audio_device *adev = context;
+    struct route_cmd cmd;
+    unsigned int out_device;
+    unsigned int in_device;
+
+    pthread_mutex_lock(&adev->route_lock);
+    for (;;) {
+        while (adev->route_count == 0 && !adev->route_queued && !adev->route_exit) {
+            struct timespec deadline;
+
+            if (adev->route_idle_ns == 0) {
+                pthread_cond_wait(&adev->route_cond, &adev->route_lock);
+                continue;
+            }
+            if (monotonic_ns() >= adev->route_idle_ns)
+                break;
+            deadline.tv_sec = adev->route_idle_ns / 1000000000;
+            deadline.tv_nsec = adev->route_idle_ns % 1000000000;
+            pthread_cond_timedwait(&adev->route_cond, &adev->route_lock, &deadline);
+        }
+        if (adev->route_exit)
+            break;
+
+        /* adev->lock comes first */
+        if (adev->route_count == 0 && !adev->route_queued) {
+            adev->route_idle_ns = 0;
+            pthread_mutex_unlock(&adev->route_lock);
+            pthread_mutex_lock(&adev->lock);
+            warm_pcm_expire(adev);
+            pthread_mutex_unlock(&adev->lock);
+            pthread_mutex_lock(&adev->route_lock);
+            continue;
+        }
+
+        if (adev->route_queued && adev->route_ahead == 0) {
+            cmd.apply_route = true;
+            adev->route_queued = false;
+        } else {
+            cmd = adev->route_queue[adev->route_head];
+            adev->route_head = (adev->route_head + 1) % ROUTE_QUEUE_SIZE;
+            adev->route_count--;
+            if (adev->route_queued)
+                adev->route_ahead--;
+        }
+        /* the routing can change again while this one is applied */
+        out_device = adev->route_out_device;
+        in_device = adev->route_in_device;
+        pthread_mutex_unlock(&adev->route_lock);
+
+        if (cmd.apply_route) {
+            /* the paths may have set the ctls of a bringup */
+            if (apply_route(adev, out_device, in_device))
+                memset(adev->bringup_done, 0, sizeof(adev->bringup_done));
+        } else {
+            route_bringup(adev, &cmd);
+        }
+
+        pthread_mutex_lock(&adev->route_lock);
+    }
+    pthread_mutex_unlock(&adev->route_lock);
+
+    return NULL;
+}
+
+/*
+ * Publishes the routing for the route thread to apply, the mixer is set
+ * some time after this returns. Called with adev->lock held.
+ */
+static void select_devices(struct audio_device *adev)
+{
+    struct route_cmd cmd = { .apply_route = true };
+
+    pthread_mutex_lock(&adev->route_lock);
+    adev->route_out_device = adev->out_device;
+    adev->route_in_device = adev->in_device;
+    route_queue_l(adev, &cmd);
+    pthread_mutex_unlock(&adev->route_lock);
+}
+
+/*
+ * Registry listener: a card came or went, have the route thread route the
+ * cards again with the routing in effect, so a new card gets its paths
+ * without waiting for the next routing change.
+ */
+static void cards_changed(void *context)
+{
+    struct audio_device *adev = context;
+    struct route_cmd cmd = { .apply_route = true };
+
+    pthread_mutex_lock(&adev->route_lock);
+    route_queue_l(adev, &cmd);
+    pthread_mutex_unlock(&adev->route_lock);
+}
+
+/* a FIFO audio thread waiting on the mutex boosts the thread holding it */
+static int init_pi_mutex(pthread_mutex_t *lock)
+{
+    pthread_mutexattr_t attr;
+    int ret;
+
+    pthread_mutexattr_init(&attr);
+    ret = pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT);
+    if (ret == 0)
+        ret = pthread_mutex_init(lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if (ret != 0) {
+        ALOGW("no priority inheritance mutex: %s", strerror(ret));
+        ret = pthread_mutex_init(lock, NULL);
+    }
+    return ret;
+}
+
+/* locks from an audio thread, see the note on the mutexes above */
+static void audio_thread_lock(struct audio_device *adev, pthread_mutex_t *lock,
+                              const char *name)
+{
+    int64_t start;
+    int64_t waited;
+
+    if (adev->lock_warn_ns == 0) {
+        pthread_mutex_lock(lock);
+        return;
+    }
+    if (pthread_mutex_trylock(lock) == 0)
+        return;
+
+    start = monotonic_ns();
+    pthread_mutex_lock(lock);
+    waited = monotonic_ns() - start;
+    if (waited > adev->lock_warn_ns)
+        ALOGW("audio thread %d waited %lld us for %s", gettid(),
+              (long long)(waited / 1000), name);
+}
+
+/*
+ * Some SoCs (e.g. Grouper) lack sample rate converters: all their open
+ * PCMs can only use a single group of rates at once:
+ * Group 1: 11.025, 22.05, 44.1
+ * Group 2: 8, 16, 32, 48
+ * Group 1 is used for digital audio playback since 44.1 is
+ * the most common rate, but group 2 is required for SCO.
+ * Independent playback and capture PCMs don't care, so this is only
+ * enforced when hal.audio.single_rate_group is set.
+ */
+static bool rates_conflict(struct audio_device *adev, unsigned int rate,
+                           unsigned int other_rate)
+{
+    if (!adev->single_rate_group)
+        return false;
+    return ((rate % 8000 == 0) && (other_rate % 8000) != 0) ||
+            ((rate % 11025 == 0) && (other_rate % 11025) != 0);
+}
+
+/* the PCM configuration an output stream asks for when it opens the PCM */
+static const struct pcm_config *out_profile_config(const struct stream_out *out)
+{
+    if (out->mmap)
+        return &pcm_config_mmap_out;
+    if (out->deep_buffer)
+        return &pcm_config_deep_buffer;
+    return &pcm_config_out;
+}
+
+/*
+ * Returns the number of frames, at the stream rate, queued in the kernel
+ * buffer, the mix queue and the resampler, and the time at which they were
+ * sampled. Must be called with the output stream mutex locked.
+ */
+static int out_get_pending_frames(struct stream_out *out, uint64_t *pending,
+                                  struct timespec *timestamp)
+{
+    unsigned int avail;
+    int64_t frames;
+    uint32_t rate = out_get_sample_rate(&out->stream.common);
+
+    if (out->pcm == NULL || pcm_get_htimestamp(out->pcm, &avail, timestamp) < 0)
+        return -ENODATA;
+
+    /* the kernel buffer size is fixed, cur_write_threshold only limits the fill */
+    frames = (int64_t)pcm_get_buffer_size(out->pcm) - avail;
+    if (frames < 0)
+        frames = 0;
+    pthread_mutex_lock(&out->dev->mix_lock);
+    frames += out->mix_frames;
+    pthread_mutex_unlock(&out->dev->mix_lock);
+    frames = frames * rate / out->pcm_config.rate;
+    if (out->resampler)
+        frames += (int64_t)out->resampler->delay_ns(out->resampler) * rate / 1000000000;
+
+    *pending = frames;
+    return 0;
+}
+
+/*
+ * Points *resampler to a resampler from in_rate to out_rate, or to NULL if
+ * the rates match. The resampler of the previous session is only reset
+ * when it was created for the same conversion.
+ */
+static int update_resampler(struct resampler_itfe **resampler, struct resampler_setup *setup,
+                            uint32_t in_rate, uint32_t out_rate, unsigned int channels,
+                            int quality, struct resampler_buffer_provider *provider)
+{
+    int ret;
+
+    if (*resampler) {
+        if (in_rate != out_rate && setup->in_rate == in_rate && setup->out_rate == out_rate &&
+                setup->channels == channels && setup->quality == quality) {
+            (*resampler)->reset(*resampler);
+            return 0;
+        }
+        release_resampler(*resampler);
+        *resampler = NULL;
+    }
+    if (in_rate == out_rate)
+        return 0;
+
+    ret = create_resampler(in_rate, out_rate, channels, quality, provider, resampler);
+    if (ret != 0) {
+        ALOGE("unable to create a resampler from %u to %u Hz: %d", in_rate, out_rate, ret);
+        *resampler = NULL;
+        return ret;
+    }
+    ALOGV("resampler from %u to %u Hz, quality %d", in_rate, out_rate, quality);
+    setup->in_rate = in_rate;
+    setup->out_rate = out_rate;
+    setup->channels = channels;
+    setup->quality = quality;
+    return 0;
+}
+
+/* must be called with hw device and output stream mutexes locked */
+static void do_out_standby(struct stream_out *out)
+{
+    struct audio_device *adev = out->dev;
+
+    if (!out->standby) {
+        struct timespec now;
+        uint64_t pending;
+
+        /*
+         * The frames still queued for mixing are dropped and never get
+         * presented. So is the kernel buffer when this is the last output
+         * and the PCM closes; otherwise the other outputs keep it playing,
+         * and part of it is not this stream's.
+         */
+        if (!out->mmap) {
+            bool last;
+
+            pthread_mutex_lock(&adev->mix_lock);
+            last = adev->num_outputs == 1;
+            pending = (uint64_t)out->mix_frames * out_get_sample_rate(&out->stream.common) /
+                    out->pcm_config.rate;
+            pthread_mutex_unlock(&adev->mix_lock);
+            if (last)
+                out_get_pending_frames(out, &pending, &now);
+            out->frames_written = pending < out->frames_written ?
+                    out->frames_written - pending : 0;
+        }
+
+        audio_stats_count(&out->stats.standbys);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        ALOGD("out standby: pacing %s, %u wakeups and %u underruns in %lld ms",
+              out_pacing_to_string(out->pacing), out->pacing_wakeups, out->underruns,
+              (long long)(now.tv_sec - out->start_time.tv_sec) * 1000 +
+              (now.tv_nsec - out->start_time.tv_nsec) / 1000000);
+        ALOGD_IF(out->adaptive, "out standby: adaptive write threshold %d frames, "
+                 "%u raises, %u lowers and %u near misses so far",
+                 out->adapt_threshold, out->adapt_raises, out->adapt_lowers, out->near_misses);
+
+        if (out->mmap) {
+            pcm_close(out->pcm);
+            adev->mmap_out = NULL;
+        } else {
+            struct stream_out **o;
+
+            /* leave the shared PCM, whatever is still queued for mixing is dropped */
+            pthread_mutex_lock(&adev->mix_lock);
+            for (o = &adev->outputs; *o != out; o = &(*o)->mix_next)
+                ;
+            *o = out->mix_next;
+            out->mix_next = NULL;
+            out->mix_frames = 0;
+            out->mix_head = 0;
+            adev->num_outputs--;
+            pthread_cond_broadcast(&adev->mix_cond);
+            pthread_mutex_unlock(&adev->mix_lock);
+
+            if (adev->num_outputs == 0) {
+                warm_pcm_park(adev, &adev->warm_out, adev->out_pcm);
+                adev->out_pcm = NULL;
+            }
+        }
+        out->pcm = NULL;
+        out->poll_threshold = 0;
+        out->standby = true;
+    }
+}
+
+/*
+ * Logs and clears the processing time of the effects. The budget is how
+ * long the chunks they were given last on average.
+ */
+static void in_log_effects(struct stream_in *in)
+{
+    uint32_t rate = in_get_sample_rate(&in->stream.common);
+    int i;
+
+    for (i = 0; i < in->num_preprocessors; i++) {
+        struct in_effect *fx = &in->preprocessors[i];
+
+        if (fx->chunks == 0)
+            continue;
+        ALOGD("effect %d: %u chunks, %lld us on average, %lld us at most, budget %lld us, "
+              "%u over",
+              i, fx->chunks, (long long)(fx->total_ns / fx->chunks / 1000),
+              (long long)(fx->max_ns / 1000),
+              (long long)(fx->frames * 1000000 / rate / fx->chunks), fx->overruns);
+        fx->chunks = 0;
+        fx->overruns = 0;
+        fx->frames = 0;
+        fx->total_ns = 0;
+        fx->max_ns = 0;
+    }
+}
+
+/* must be called with hw device and input stream mutexes locked */
+static void do_in_standby(struct stream_in *in)
+{
+    struct audio_device *adev = in->dev;
+
+    if (!in->standby) {
+        ALOGD_IF(in->overruns, "in standby: %u overruns", in->overruns);
+        audio_stats_count(&in->stats.standbys);
+        in->frames_read_base += in->frames_read * in->requested_rate / in->pcm_config.rate;
+        in->frames_read = 0;
+        in->next_frame_ns = 0;
+        in->overruns = 0;
+
+        warm_pcm_park(adev, &adev->warm_in, in->pcm);
+        in->pcm = NULL;
+        adev->active_in = NULL;
+        adev_set_state(adev, ADEV_STATE_CAPTURING, false);
+        in_log_effects(in);
+        /* the buffers are kept for the next session, only drop their content */
+        in->proc_buf_start = 0;
+        in->proc_frames_in = 0;
+        in->proc_out_start = 0;
+        in->proc_out_frames = 0;
+        in->standby = true;
+    }
+}
+
+/* must be called with hw device mutex locked */
+static void do_out_standby_all(struct audio_device *adev)
+{
+    struct stream_out *out;
+
+    /* the list only changes with the hw device mutex locked */
+    while ((out = adev->outputs) != NULL) {
+        pthread_mutex_lock(&out->lock);
+        do_out_standby(out);
+        pthread_mutex_unlock(&out->lock);
+    }
+}
+
+/* must be called with hw device and output stream mutexes locked */
+static int open_output_pcm(struct stream_out *out)
 {
     struct audio_device *adev = out->dev;
     unsigned int device;
-    int ret;
 
     /*
      * Due to the lack of sample rate converters in the SoC,
@@ -517,57 +1711,218 @@ static int start_output_stream(struct stream_out *out)
         out->pcm_config = pcm_config_sco;
     } else {
         device = (adev->out_device & AUDIO_DEVICE_OUT_AUX_DIGITAL) ? PCM_DEVICE_HDMI : PCM_DEVICE;
-        out->pcm_config = pcm_config_out;
-        out->buffer_type = OUT_BUFFER_TYPE_UNKNOWN;
+        out->pcm_config = *out_profile_config(out);
+        out->pcm_config.rate = out->sample_rate;
+        /* a format property still wins, and fit_pcm_config() falls back to 16 bit */
+        if (out->format != AUDIO_FORMAT_PCM_16_BIT)
+            out->pcm_config.format = PCM_FORMAT_S32_LE;
     }
 
-    /*
-     * All open PCMs can only use a single group of rates at once:
-     * Group 1: 11.025, 22.05, 44.1
-     * Group 2: 8, 16, 32, 48
-     * Group 1 is used for digital audio playback since 44.1 is
-     * the most common rate, but group 2 is required for SCO.
-     */
     if (adev->active_in) {
         struct stream_in *in = adev->active_in;
         pthread_mutex_lock(&in->lock);
-        if (((out->pcm_config.rate % 8000 == 0) &&
-                 (in->pcm_config.rate % 8000) != 0) ||
-                 ((out->pcm_config.rate % 11025 == 0) &&
-                 (in->pcm_config.rate % 11025) != 0))
+        if (rates_conflict(adev, out->pcm_config.rate, in->pcm_config.rate))
             do_in_standby(in);
         pthread_mutex_unlock(&in->lock);
     }
+    if (adev->warm_in.pcm && rates_conflict(adev, out->pcm_config.rate, adev->warm_in.config.rate))
+        warm_pcm_close(&adev->warm_in);
 
-    out->pcm = my_pcm_open(device, PCM_OUT | PCM_NORESTART, &(out->pcm_config), adev->out_device);
+    /*
+     * In poll pacing mode the PCM fd becomes writable once the kernel
+     * buffer drained down to the short write threshold. Deep buffers are
+     * refilled a period at a time from the blocking write.
+     */
+    if (out->pacing == OUT_PACING_POLL && device != PCM_DEVICE_SCO && !out->deep_buffer) {
+        out->pcm_config.avail_min = out->pcm_config.period_size *
+                (out->pcm_config.period_count - OUT_SHORT_PERIOD_COUNT);
+    }
+
+    out->pcm = warm_pcm_open(adev, &adev->warm_out, device,
+                             PCM_OUT | PCM_NORESTART | PCM_MONOTONIC,
+                             &out->pcm_config, adev->out_device);
     if (!out->pcm) {
         return -ENODEV;
     } else if (!pcm_is_ready(out->pcm)) {
         ALOGE("pcm_open(out) failed: %s", pcm_get_error(out->pcm));
         pcm_close(out->pcm);
+        out->pcm = NULL;
         return -ENOMEM;
     }
 
+    if (audio_convert_select(out->pcm_config.channels, out->pcm_config.channels,
+                             audio_format_from_pcm_format(out->pcm_config.format),
+                             &adev->out_mix_convert) != 0) {
+        warm_pcm_park(adev, &adev->warm_out, out->pcm);
+        out->pcm = NULL;
+        return -EINVAL;
+    }
+    adev->out_pcm = out->pcm;
+    adev->out_pcm_config = out->pcm_config;
+
+    return 0;
+}
+
+/* from the PCM of a starting output, must be called with its mutex locked */
+static void out_adapt_init(struct stream_out *out)
+{
+    int buffer_frames = pcm_get_buffer_size(out->pcm);
+    int rate = out->pcm_config.rate;
+
+    out->adapt_floor = out->adapt_floor_ms * rate / 1000;
+    if (out->adapt_floor < (int)out->pcm_config.period_size / 4)
+        out->adapt_floor = out->pcm_config.period_size / 4;
+    out->adapt_ceiling = out->adapt_ceiling_ms ? out->adapt_ceiling_ms * rate / 1000 :
+            buffer_frames;
+    if (out->adapt_ceiling > buffer_frames)
+        out->adapt_ceiling = buffer_frames;
+    if (out->adapt_floor > out->adapt_ceiling)
+        out->adapt_floor = out->adapt_ceiling;
+
+    if (out->adapt_threshold < out->adapt_floor)
+        out->adapt_threshold = out->adapt_floor;
+    if (out->adapt_threshold > out->adapt_ceiling)
+        out->adapt_threshold = out->adapt_ceiling;
+    out->adapt_armed = false;
+    out->adapt_ns = monotonic_ns();
+}
+
+/* must be called with hw device and output stream mutexes locked */
+static int start_output_stream(struct stream_out *out)
+{
+    struct audio_device *adev = out->dev;
+    int ret;
+
+    out->buffer_type = OUT_BUFFER_TYPE_UNKNOWN;
+
     /*
-     * If the stream rate differs from the PCM rate, we need to
-     * create a resampler.
+     * join the outputs already playing, or open the PCM; a deep buffer
+     * stream joining a PCM opened with short periods keeps them, and the
+     * other outputs mixed into a deep buffer PCM get its latency
      */
-    if (out_get_sample_rate(&out->stream.common) != out->pcm_config.rate) {
-        ret = create_resampler(out_get_sample_rate(&out->stream.common),
-                               out->pcm_config.rate,
-                               out->pcm_config.channels,
-                               RESAMPLER_QUALITY_DEFAULT,
-                               NULL,
-                               &out->resampler);
-        out->buffer_frames = (pcm_config_out.period_size * out->pcm_config.rate) /
+    if (adev->out_pcm) {
+        out->pcm = adev->out_pcm;
+        out->pcm_config = adev->out_pcm_config;
+    } else {
+        ret = open_output_pcm(out);
+        if (ret != 0)
+            return ret;
+    }
+    if (out->pcm_config.avail_min > 0) {
+        out->poll_threshold = pcm_get_buffer_size(out->pcm) - out->pcm_config.avail_min;
+    }
+
+    out->pacing_wakeups = 0;
+    out->underruns = 0;
+    if (out->adaptive)
+        out_adapt_init(out);
+    out->standby_frames_written = out->frames_written;
+    clock_gettime(CLOCK_MONOTONIC, &out->start_time);
+
+    /*
+     * If the stream rate differs from the PCM rate, we need a
+     * resampler.
+     */
+    ret = update_resampler(&out->resampler, &out->resampler_setup,
+                           out_get_sample_rate(&out->stream.common),
+                           out->pcm_config.rate,
+                           out->pcm_config.channels,
+                           adev->resampler_quality[(adev->out_device & AUDIO_DEVICE_OUT_ALL_SCO) ?
+                                   RESAMPLER_TIER_SCO : RESAMPLER_TIER_MEDIA],
+                           NULL);
+    if (ret != 0)
+        goto error;
+    if (out->resampler) {
+        out->buffer_frames = (out_profile_config(out)->period_size * out->pcm_config.rate) /
                 out_get_sample_rate(&out->stream.common) + 1;
 
-        out->buffer = malloc(pcm_frames_to_bytes(out->pcm, out->buffer_frames));
+        /* the resampler output is always 16 bit */
+        ret = ensure_buffer_size((void **)&out->buffer, &out->buffer_size,
+                                 out->buffer_frames * out->pcm_config.channels * sizeof(int16_t));
+        if (ret != 0)
+            goto error;
     }
 
-    adev->active_out = out;
+    /*
+     * Pick the conversion kernels for this PCM: without resampler, channel
+     * reduction and format conversion are done in a single pass.
+     */
+    audio_format_t pcm_format = audio_format_from_pcm_format(out->pcm_config.format);
+    unsigned int channels = popcount(out_get_channels(&out->stream.common));
+    size_t conv_size = 0;
+    out->mix_convert = NULL;
+    if (out->resampler) {
+        ret = audio_convert_select(channels, out->pcm_config.channels,
+                                   AUDIO_FORMAT_PCM_16_BIT, &out->pre_convert);
+        if (ret == 0)
+            ret = audio_convert_select(out->pcm_config.channels, out->pcm_config.channels,
+                                       pcm_format, &out->post_convert);
+        if (out->pre_convert)
+            conv_size = out_profile_config(out)->period_size * out->pcm_config.channels *
+                    sizeof(int16_t);
+        if (out->post_convert && pcm_frames_to_bytes(out->pcm, out->buffer_frames) > conv_size)
+            conv_size = pcm_frames_to_bytes(out->pcm, out->buffer_frames);
+    } else {
+        out->pre_convert = NULL;
+        ret = audio_convert_select(channels, out->pcm_config.channels,
+                                   pcm_format, &out->post_convert);
+        if (out->post_convert)
+            conv_size = pcm_frames_to_bytes(out->pcm, out->pcm_config.period_size);
+    }
+    /* while mixing, the frames are queued in 16 bit at the PCM channel count */
+    if (ret == 0 && !out->resampler)
+        ret = audio_convert_select(channels, out->pcm_config.channels,
+                                   AUDIO_FORMAT_PCM_16_BIT, &out->mix_convert);
+    out->gain_convert = NULL;
+    if (ret == 0 && out->post_convert)
+        ret = audio_convert_gain_select(out->resampler ? out->pcm_config.channels : channels,
+                                        out->pcm_config.channels, pcm_format,
+                                        &out->gain_convert);
+    if (ret == 0 && out->format != AUDIO_FORMAT_PCM_16_BIT)
+        ret = audio_convert_float_select(channels, out->pcm_config.channels,
+                                         pcm_format, &out->float_convert);
+    if (ret == 0 && out->format != AUDIO_FORMAT_PCM_16_BIT)
+        ret = audio_convert_float_select(channels, channels,
+                                         AUDIO_FORMAT_PCM_16_BIT, &out->float_narrow);
+    if (ret == 0 && out->format != AUDIO_FORMAT_PCM_16_BIT && !out->resampler)
+        ret = audio_convert_float_select(channels, out->pcm_config.channels,
+                                         AUDIO_FORMAT_PCM_16_BIT, &out->float_mix_convert);
+    /* a period fits; bigger writes grow it once */
+    if (ret == 0)
+        ret = ensure_buffer_size(&out->conv_buffer, &out->conv_buffer_size, conv_size);
+    if (ret != 0)
+        goto error;
+
+    pthread_mutex_lock(&adev->mix_lock);
+    out->mix_frames = 0;
+    out->mix_head = 0;
+    out->mix_last_ns = monotonic_ns();
+    out->mix_chunk_ns = 0;
+    out->mix_next = adev->outputs;
+    adev->outputs = out;
+    adev->num_outputs++;
+    pthread_mutex_unlock(&adev->mix_lock);
 
     return 0;
+
+error:
+    if (out->resampler) {
+        release_resampler(out->resampler);
+        out->resampler = NULL;
+    }
+    /* the PCM may come from the warm slot, keep it there for the next start */
+    if (!adev->outputs) {
+        warm_pcm_park(adev, &adev->warm_out, adev->out_pcm);
+        adev->out_pcm = NULL;
+    }
+    out->pcm = NULL;
+    return ret;
+}
+
+/* the frames in->buffer, the resampler and the effects work on */
+static size_t in_frame_size(const struct stream_in *in)
+{
+    return in->channels * sizeof(int16_t);
 }
 
 /* must be called with hw device and input stream mutexes locked */
@@ -588,27 +1943,31 @@ static int start_input_stream(struct stream_in *in)
     } else {
         device = PCM_DEVICE;
         in->pcm_config = pcm_config_in;
+        /* capture at the stream rate, with periods of the same duration;
+         * my_pcm_open() moves to another rate if the card doesn't have it */
+        in->pcm_config.rate = in->requested_rate;
+        in->pcm_config.period_size =
+                ((IN_PERIOD_SIZE * in->requested_rate / IN_SAMPLING_RATE + 15) / 16) * 16;
+        in->pcm_config.stop_threshold = in->pcm_config.period_size * IN_PERIOD_COUNT;
+        /* mics are usually stereo pairs, my_pcm_open() fits the count to the card */
+        if (in->channels > in->pcm_config.channels)
+            in->pcm_config.channels = in->channels;
     }
 
-    /*
-     * All open PCMs can only use a single group of rates at once:
-     * Group 1: 11.025, 22.05, 44.1
-     * Group 2: 8, 16, 32, 48
-     * Group 1 is used for digital audio playback since 44.1 is
-     * the most common rate, but group 2 is required for SCO.
-     */
-    if (adev->active_out) {
-        struct stream_out *out = adev->active_out;
+    if (adev->out_pcm && rates_conflict(adev, in->pcm_config.rate, adev->out_pcm_config.rate))
+        do_out_standby_all(adev);
+    if (adev->warm_out.pcm && rates_conflict(adev, in->pcm_config.rate, adev->warm_out.config.rate))
+        warm_pcm_close(&adev->warm_out);
+    if (adev->mmap_out) {
+        struct stream_out *out = adev->mmap_out;
         pthread_mutex_lock(&out->lock);
-        if (((in->pcm_config.rate % 8000 == 0) &&
-                 (out->pcm_config.rate % 8000) != 0) ||
-                 ((in->pcm_config.rate % 11025 == 0) &&
-                 (out->pcm_config.rate % 11025) != 0))
+        if (rates_conflict(adev, in->pcm_config.rate, out->pcm_config.rate))
             do_out_standby(out);
         pthread_mutex_unlock(&out->lock);
     }
 
-    in->pcm = my_pcm_open(device, PCM_IN, &(in->pcm_config), adev->in_device);
+    in->pcm = warm_pcm_open(adev, &adev->warm_in, device, PCM_IN | PCM_MONOTONIC,
+                            &in->pcm_config, adev->in_device);
     if (!in->pcm) {
         return -ENODEV;
     } else if (!pcm_is_ready(in->pcm)) {
@@ -618,88 +1977,193 @@ static int start_input_stream(struct stream_in *in)
     }
 
     /*
-     * If the stream rate differs from the PCM rate, we need to
-     * create a resampler.
+     * If the stream rate differs from the PCM rate, we need a
+     * resampler.
+     */
+    int tier = RESAMPLER_TIER_MEDIA;
+    if (adev->in_device & AUDIO_DEVICE_IN_ALL_SCO)
+        tier = RESAMPLER_TIER_SCO;
+    else if (in->source == AUDIO_SOURCE_VOICE_COMMUNICATION ||
+             in->source == AUDIO_SOURCE_VOICE_RECOGNITION)
+        tier = RESAMPLER_TIER_VOICE;
+    in->buf_provider.get_next_buffer = get_next_buffer;
+    in->buf_provider.release_buffer = release_buffer;
+    ret = update_resampler(&in->resampler, &in->resampler_setup,
+                           in->pcm_config.rate,
+                           in_get_sample_rate(&in->stream.common),
+                           in->channels,
+                           adev->resampler_quality[tier],
+                           &in->buf_provider);
+    if (ret != 0)
+        goto error;
+    /*
+     * The resampler and the effects work on 16 bit samples at the stream
+     * channel count in in->buffer. A PCM in any other layout is read into
+     * in->conv_buffer and converted from there, as are the periods a float
+     * stream takes from the PCM.
      */
-    if (in_get_sample_rate(&in->stream.common) != in->pcm_config.rate) {
-        in->buf_provider.get_next_buffer = get_next_buffer;
-        in->buf_provider.release_buffer = release_buffer;
-
-        ret = create_resampler(in->pcm_config.rate,
-                               in_get_sample_rate(&in->stream.common),
-                               1,
-                               RESAMPLER_QUALITY_DEFAULT,
-                               &in->buf_provider,
-                               &in->resampler);
-    }
-    in->buffer_size = pcm_frames_to_bytes(in->pcm,
-                                          in->pcm_config.period_size);
-    if(in->pcm_config.format == PCM_FORMAT_S8){
-        // make space for growing it to 16bit format
-        in->buffer_size = in->buffer_size * 2;
-    }
-    in->buffer = malloc(in->buffer_size);
+    ret = audio_capture_select(in->pcm_config.channels,
+                               audio_format_from_pcm_format(in->pcm_config.format),
+                               in->channels, &in->capture);
+    if (ret == 0 && in->format == AUDIO_FORMAT_PCM_FLOAT)
+        ret = audio_capture_float_select(in->pcm_config.channels,
+                                         audio_format_from_pcm_format(in->pcm_config.format),
+                                         in->channels, &in->capture_float);
+    if (ret != 0)
+        goto error;
+    if (ensure_buffer_size((void **)&in->buffer, &in->buffer_size,
+                           in->pcm_config.period_size * in_frame_size(in)) < 0 ||
+            ((in->capture != NULL || in->format == AUDIO_FORMAT_PCM_FLOAT) &&
+             ensure_buffer_size(&in->conv_buffer, &in->conv_buffer_size,
+                                pcm_frames_to_bytes(in->pcm, in->pcm_config.period_size)) < 0)) {
+        ret = -ENOMEM;
+        goto error;
+    }
     in->frames_in = 0;
 
     adev->active_in = in;
+    adev_set_state(adev, ADEV_STATE_CAPTURING, true);
 
     return 0;
+
+error:
+    warm_pcm_park(adev, &adev->warm_in, in->pcm);
+    in->pcm = NULL;
+    return ret;
 }
 
-static int get_next_buffer(struct resampler_buffer_provider *buffer_provider,
-                                   struct resampler_buffer* buffer)
+/*
+ * Tracks the capture time of the next frame to read. When it moves forward
+ * by more than what was just read, the driver overran and tinyalsa silently
+ * restarted the PCM: the difference was lost.
+ */
+static void in_update_frames_lost(struct stream_in *in, size_t frames)
 {
-    struct stream_in *in;
+    struct timespec ts;
+    unsigned int avail;
+    int64_t next_frame_ns;
+    int64_t expected_ns;
+    int64_t lost_ns;
 
-    if (buffer_provider == NULL || buffer == NULL)
-        return -EINVAL;
+    if (pcm_get_htimestamp(in->pcm, &avail, &ts) < 0)
+        return;
 
-    in = (struct stream_in *)((char *)buffer_provider -
-                                   offsetof(struct stream_in, buf_provider));
+    next_frame_ns = ts.tv_sec * 1000000000LL + ts.tv_nsec -
+            (int64_t)avail * 1000000000LL / in->pcm_config.rate;
+    if (in->next_frame_ns != 0) {
+        expected_ns = (int64_t)frames * 1000000000LL / in->pcm_config.rate;
+        lost_ns = next_frame_ns - in->next_frame_ns - expected_ns;
+        /* allow for half a period of jitter in the driver timestamps */
+        if (lost_ns > expected_ns / 2) {
+            uint32_t lost = lost_ns * in->pcm_config.rate / 1000000000LL;
+            ALOGW("in overrun: %u frames lost", lost);
+            in->frames_lost += lost;
+            in->overruns++;
+            audio_stats_add_xrun(&in->stats, next_frame_ns);
+        }
+    }
+    in->next_frame_ns = next_frame_ns;
+}
+
+/* reads a period from the PCM to raw, as the PCM gives it */
+static int in_pcm_read(struct stream_in *in, void *raw)
+{
+    int64_t start;
 
     if (in->pcm == NULL) {
-        buffer->raw = NULL;
-        buffer->frame_count = 0;
         in->read_status = -ENODEV;
         return -ENODEV;
     }
 
+    start = monotonic_ns();
+    in->read_status = pcm_read(in->pcm, raw,
+                               pcm_frames_to_bytes(in->pcm, in->pcm_config.period_size));
+    audio_stats_add_io(&in->stats, monotonic_ns() - start);
+    if (in->read_status != 0) {
+        ALOGE("in_pcm_read() pcm_read error %d", in->read_status);
+        return in->read_status;
+    }
+    in->frames_read += in->pcm_config.period_size;
+    in_update_frames_lost(in, in->pcm_config.period_size);
+    return 0;
+}
+
+/*
+ * A period that is only partly read waits in the PCM format: in
+ * in->conv_buffer if it needs converting, otherwise in in->buffer. The 16
+ * bit and the float reads convert the frames they take with their own
+ * kernel, so a float stream keeps the bits of the PCM however it is read,
+ * and switching between them loses nothing.
+ */
+static void *in_staging(struct stream_in *in)
+{
+    return in->capture ? in->conv_buffer : (void *)in->buffer;
+}
+
+/* the first frame in_staging() has left, in_stage_period() made sure there is one */
+static const void *in_staged_frames(struct stream_in *in)
+{
+    return (const char *)in_staging(in) +
+            pcm_frames_to_bytes(in->pcm, in->pcm_config.period_size - in->frames_in);
+}
+
+static int in_stage_period(struct stream_in *in)
+{
     if (in->frames_in == 0) {
-        unsigned int read_size = in->buffer_size;
-        if(in->pcm_config.format == PCM_FORMAT_S8){
-            read_size = read_size / 2;
-        }
-        in->read_status = pcm_read(in->pcm,
-                                   (void*)in->buffer,
-                                   read_size);
-        if (in->read_status != 0) {
-            ALOGE("get_next_buffer() pcm_read error %d", in->read_status);
-            buffer->raw = NULL;
-            buffer->frame_count = 0;
+        if (in_pcm_read(in, in_staging(in)) != 0)
             return in->read_status;
-        }
+        in->frames_in = in->pcm_config.period_size;
+    }
+    return 0;
+}
 
-        // if not 16bit, make it 16bit
-        if(in->pcm_config.format == PCM_FORMAT_S32_LE){
-            memcpy_by_audio_format((void*)in->buffer, AUDIO_FORMAT_PCM_16_BIT, (void*)in->buffer, AUDIO_FORMAT_PCM_32_BIT, in->pcm_config.period_size * in->pcm_config.channels);
-        }
-        if(in->pcm_config.format == PCM_FORMAT_S8){
-            memcpy_by_audio_format((void*)in->buffer, AUDIO_FORMAT_PCM_16_BIT, (void*)in->buffer, AUDIO_FORMAT_PCM_8_BIT, in->pcm_config.period_size * in->pcm_config.channels);
-        }
+/*
+ * Reads a period from the PCM to dst, at the stream channel count and in 16
+ * bit, or in float when to_float is set. A 16 bit PCM at the stream channel
+ * count is read in place, anything else goes through in->conv_buffer.
+ * Nothing may be staged.
+ */
+static int in_read_period(struct stream_in *in, void *dst, bool to_float)
+{
+    bool convert = to_float || in->capture != NULL;
+
+    if (in_pcm_read(in, convert ? in->conv_buffer : dst) != 0)
+        return in->read_status;
+
+    /* a mono stream on a stereo mic keeps the first channel */
+    if (to_float)
+        in->capture_float(dst, in->conv_buffer, in->pcm_config.period_size,
+                          in->pcm_config.channels, in->channels);
+    else if (in->capture)
+        in->capture(dst, in->conv_buffer, in->pcm_config.period_size,
+                    in->pcm_config.channels, in->channels);
+    return 0;
+}
 
-        in->frames_in = in->pcm_config.period_size;
-        if (in->pcm_config.channels == 2) {
-            unsigned int i;
+static int get_next_buffer(struct resampler_buffer_provider *buffer_provider,
+                                   struct resampler_buffer* buffer)
+{
+    struct stream_in *in;
 
-            /* Discard right channel */
-            for (i = 1; i < in->frames_in; i++)
-                in->buffer[i] = in->buffer[i * 2];
-        }
+    if (buffer_provider == NULL || buffer == NULL)
+        return -EINVAL;
+
+    in = (struct stream_in *)((char *)buffer_provider -
+                                   offsetof(struct stream_in, buf_provider));
+
+    if (in_stage_period(in) != 0) {
+        buffer->raw = NULL;
+        buffer->frame_count = 0;
+        return in->read_status;
     }
 
     buffer->frame_count = (buffer->frame_count > in->frames_in) ?
                                 in->frames_in : buffer->frame_count;
-    buffer->i16 = in->buffer + (in->pcm_config.period_size - in->frames_in);
+    buffer->i16 = in->buffer + (in->pcm_config.period_size - in->frames_in) * in->channels;
+    /* converted to the same place, the raw frame is bigger or is elsewhere */
+    if (in->capture)
+        in->capture(buffer->i16, in_staged_frames(in), buffer->frame_count,
+                    in->pcm_config.channels, in->channels);
 
     return in->read_status;
 
@@ -727,11 +2191,22 @@ static ssize_t read_frames(struct stream_in *in, void *buffer, ssize_t frames)
 
     while (frames_wr < frames) {
         size_t frames_rd = frames - frames_wr;
-        if (in->resampler != NULL) {
+        if (in->resampler == NULL && in->frames_in == 0 &&
+                frames_rd >= in->pcm_config.period_size) {
+            /* whole periods go straight to the caller */
+            in_read_period(in, (char *)buffer + frames_wr * in_frame_size(in), false);
+            frames_rd = in->pcm_config.period_size;
+        } else if (in->resampler != NULL) {
+            /* the provider reads the PCM from within, that time is not the resampler's */
+            int64_t io_ns = atomic_load_explicit(&in->stats.io_ns, memory_order_relaxed);
+            int64_t start = monotonic_ns();
+
             in->resampler->resample_from_provider(in->resampler,
                     (int16_t *)((char *)buffer +
-                    frames_wr * audio_stream_in_frame_size(&in->stream)),
+                    frames_wr * in_frame_size(in)),
                     &frames_rd);
+            audio_stats_add_ns(&in->stats.resample_ns, monotonic_ns() - start -
+                    (atomic_load_explicit(&in->stats.io_ns, memory_order_relaxed) - io_ns));
         } else {
             struct resampler_buffer buf = {
                     { .raw = NULL, },
@@ -740,9 +2215,9 @@ static ssize_t read_frames(struct stream_in *in, void *buffer, ssize_t frames)
             get_next_buffer(&in->buf_provider, &buf);
             if (buf.raw != NULL) {
                 memcpy((char *)buffer +
-                        frames_wr * audio_stream_in_frame_size(&in->stream),
+                        frames_wr * in_frame_size(in),
                         buf.raw,
-                        buf.frame_count * audio_stream_in_frame_size(&in->stream));
+                        buf.frame_count * in_frame_size(in));
                 frames_rd = buf.frame_count;
             }
             release_buffer(&in->buf_provider, &buf);
@@ -757,42 +2232,162 @@ static ssize_t read_frames(struct stream_in *in, void *buffer, ssize_t frames)
     return frames_wr;
 }
 
-static ssize_t process_frames(struct stream_in *in, void* buffer, ssize_t frames)
+/*
+ * read_frames() for a float stream that is neither resampled nor
+ * preprocessed: every frame is converted from the PCM format, keeping the
+ * bits a 24 or 32 bit mic has. Whole periods go straight to the caller,
+ * the others through the staging.
+ */
+static ssize_t read_frames_float(struct stream_in *in, float *buffer, ssize_t frames)
 {
     ssize_t frames_wr = 0;
-    audio_buffer_t in_buf;
-    audio_buffer_t out_buf;
+
+    while (frames_wr < frames) {
+        size_t frames_rd = frames - frames_wr;
+        if (in->frames_in == 0 && frames_rd >= in->pcm_config.period_size) {
+            in_read_period(in, buffer + frames_wr * in->channels, true);
+            frames_rd = in->pcm_config.period_size;
+        } else if (in_stage_period(in) == 0) {
+            if (frames_rd > in->frames_in)
+                frames_rd = in->frames_in;
+            in->capture_float(buffer + frames_wr * in->channels, in_staged_frames(in),
+                              frames_rd, in->pcm_config.channels, in->channels);
+            in->frames_in -= frames_rd;
+        }
+        if (in->read_status != 0)
+            return in->read_status;
+
+        frames_wr += frames_rd;
+    }
+    return frames_wr;
+}
+
+/*
+ * Sizes the preprocessing staging for reads of up to a buffer, plus a
+ * chunk left over from the previous one. Must be called with the input
+ * stream mutex locked.
+ */
+static int in_alloc_proc_buffers(struct stream_in *in)
+{
+    size_t proc_frames_count = in_get_sample_rate(&in->stream.common) / 100;
+    size_t max_frames = in_get_buffer_size(&in->stream.common) /
+            audio_stream_in_frame_size(&in->stream);
+    size_t frames = ((max_frames + proc_frames_count - 1) / proc_frames_count + 1) *
+            proc_frames_count;
+    size_t frame_size = in_frame_size(in);
+    int ret;
+
+    ret = ensure_buffer_size((void **)&in->proc_buf, &in->proc_buf_size, frames * frame_size);
+    if (ret == 0)
+        ret = ensure_buffer_size((void **)&in->proc_out_buf, &in->proc_out_buf_size,
+                                 proc_frames_count * frame_size);
+    for (int i = 0; ret == 0 && i < 2; i++)
+        ret = ensure_buffer_size((void **)&in->chain_buf[i], &in->chain_buf_size[i],
+                                 proc_frames_count * frame_size);
+    return ret;
+}
+
+/*
+ * Runs a chunk through the effects in order, each reading what the
+ * previous one produced. An effect that returns -ENODATA produced nothing:
+ * it is disabled, or it is part of a preprocessing library session where
+ * only the last enabled effect outputs; the next one gets the same input.
+ * Returns the number of frames written to dst and sets *consumed to what
+ * the first effect took from src, the others are expected to take all
+ * they are given. Must be called with the input stream mutex locked.
+ */
+static size_t in_run_effects(struct stream_in *in, const int16_t *src, size_t frames,
+                             int16_t *dst, size_t *consumed)
+{
+    const int16_t *cur = src;
+    size_t cur_frames = frames;
+    int next = 0;
     int i;
 
+    *consumed = frames;
+    for (i = 0; i < in->num_preprocessors; i++) {
+        struct in_effect *fx = &in->preprocessors[i];
+        int16_t *out = i == in->num_preprocessors - 1 ? dst : in->chain_buf[next];
+        audio_buffer_t in_buf = { .frameCount = cur_frames, .s16 = (int16_t *)cur };
+        audio_buffer_t out_buf = { .frameCount = frames, .s16 = out };
+        int64_t start = monotonic_ns();
+        int ret;
+
+        ret = (*fx->handle)->process(fx->handle, &in_buf, &out_buf);
+
+        int64_t elapsed = monotonic_ns() - start;
+        fx->chunks++;
+        fx->frames += cur_frames;
+        if (elapsed > (int64_t)cur_frames * 1000000000 / in_get_sample_rate(&in->stream.common))
+            fx->overruns++;
+        fx->total_ns += elapsed;
+        if (elapsed > fx->max_ns)
+            fx->max_ns = elapsed;
+
+        if (i == 0)
+            *consumed = in_buf.frameCount;
+        if (ret != 0) {
+            ALOGV_IF(ret != -ENODATA, "effect %d process() failed: %d, bypassed", i, ret);
+            continue;
+        }
+        cur = out;
+        cur_frames = out_buf.frameCount;
+        next ^= 1;
+    }
+
+    /* the last effect didn't produce, or there is none */
+    if (cur != dst)
+        memcpy(dst, cur, cur_frames * in->channels * sizeof(int16_t));
+    return cur_frames;
+}
+
+static ssize_t process_frames(struct stream_in *in, void* buffer, ssize_t frames)
+{
+    ssize_t frames_wr = 0;
+
     /* PreProcessing library can only operates on 10ms chunks.
      * FIXME: Sampling rate that are not multiple of 100 should probably be forbidden... */
     size_t proc_frames_count = in_get_sample_rate(&in->stream.common) / 100;
-    /* Number of required input frames, must be a multiple of proc_frames_count. */
-    size_t frames_rq = (((size_t)frames + (proc_frames_count - 1)) / proc_frames_count) * proc_frames_count;
+    size_t frame_size = in_frame_size(in);
+    unsigned int ch = in->channels;
+    /* whole chunks that fit the staging buffer, see in_alloc_proc_buffers() */
+    size_t max_frames_rq = (in->proc_buf_size / frame_size / proc_frames_count) *
+            proc_frames_count;
 
-    /* Use frames from previous run, if any.
-     * NOTE: This should never be more than wanted number of frames. */
+    /* Use frames from previous run, if any. */
     if (in->proc_out_frames) {
+        frames_wr = in->proc_out_frames < (size_t)frames ? in->proc_out_frames : (size_t)frames;
         memcpy(buffer,
-               in->proc_out_buf,
-               in->proc_out_frames * sizeof(int16_t));
-        frames_wr = in->proc_out_frames;
-        in->proc_out_frames = 0;
+               in->proc_out_buf + in->proc_out_start * ch,
+               frames_wr * frame_size);
+        in->proc_out_start += frames_wr;
+        in->proc_out_frames -= frames_wr;
     }
 
     while (frames_wr < frames) {
-        /* first reload enough frames at the end of process input buffer */
+        /* Number of required input frames, must be a multiple of proc_frames_count. */
+        size_t frames_rq = ((frames - frames_wr + (proc_frames_count - 1)) / proc_frames_count) *
+                proc_frames_count;
+        size_t consumed;
+        size_t produced;
+        int16_t *dst;
+
+        if (frames_rq > max_frames_rq)
+            frames_rq = max_frames_rq;
+
+        /* first reload enough frames after the ones still waiting to be processed */
         if (in->proc_frames_in < frames_rq) {
             ssize_t frames_rd;
 
-            if (in->proc_buf_size < frames_rq) {
-                in->proc_buf_size = frames_rq;
-                in->proc_buf = (int16_t *)realloc(in->proc_buf, in->proc_buf_size * sizeof(int16_t));
-                ALOGV("process_frames(): in->proc_buf %p size extended to %zu frames",
-                      in->proc_buf, in->proc_buf_size);
+            /* out of room at the end: move what is left, usually less than a chunk */
+            if (in->proc_buf_start + frames_rq > max_frames_rq) {
+                memmove(in->proc_buf,
+                        in->proc_buf + in->proc_buf_start * ch,
+                        in->proc_frames_in * frame_size);
+                in->proc_buf_start = 0;
             }
             frames_rd = read_frames(in,
-                                    in->proc_buf + in->proc_frames_in,
+                                    in->proc_buf + (in->proc_buf_start + in->proc_frames_in) * ch,
                                     frames_rq - in->proc_frames_in);
             if (frames_rd < 0) {
                 frames_wr = frames_rd;
@@ -802,65 +2397,503 @@ static ssize_t process_frames(struct stream_in *in, void* buffer, ssize_t frames
             in->proc_frames_in += frames_rd;
         }
 
-        if (!in->proc_out_buf) {
-            in->proc_out_buf = (int16_t*)malloc(proc_frames_count * sizeof(int16_t));
+        /* The effects take and give at most proc_frames_count frames. A
+         * whole chunk is produced straight into the caller's buffer when it
+         * fits. */
+        dst = ((size_t)(frames - frames_wr) >= proc_frames_count) ?
+                (int16_t *)buffer + frames_wr * ch : in->proc_out_buf;
+        produced = in_run_effects(in, in->proc_buf + in->proc_buf_start * ch, proc_frames_count,
+                                  dst, &consumed);
+
+        in->proc_frames_in -= consumed;
+        in->proc_buf_start = in->proc_frames_in ? in->proc_buf_start + consumed : 0;
+
+        /* if not enough frames were passed to process(), read more and retry. */
+        if (produced == 0)
+            continue;
+
+        if (dst != in->proc_out_buf) {
+            frames_wr += produced;
+        } else {
+            size_t copied = produced < (size_t)(frames - frames_wr) ?
+                    produced : (size_t)(frames - frames_wr);
+
+            memcpy((int16_t *)buffer + frames_wr * ch,
+                   in->proc_out_buf,
+                   copied * frame_size);
+            in->proc_out_start = copied;
+            in->proc_out_frames = produced - copied;
+            frames_wr += copied;
+        }
+    }
+
+    return frames_wr;
+}
+
+/* waits for sleep_time_us worth of frames to be consumed from the kernel
+ * buffer, which held kernel_frames at time_stamp */
+static void out_pacing_wait(struct stream_out *out, int kernel_frames,
+                            const struct timespec *time_stamp, int sleep_time_us)
+{
+    out->pacing_wakeups++;
+
+    if (out->pacing == OUT_PACING_POLL) {
+        /*
+         * pcm_wait() only returns once the buffer drained down to
+         * poll_threshold, so it can't be used to wait for a higher
+         * threshold; the loop in out_write() takes care of the rest
+         * when aiming below it.
+         */
+        if (out->poll_threshold > 0 && kernel_frames > out->poll_threshold &&
+                out->cur_write_threshold <= out->poll_threshold) {
+            if (pcm_wait(out->pcm, (sleep_time_us + 999) / 1000) >= 0)
+                return;
         }
+    } else if (out->pacing == OUT_PACING_TIMER && out->timer_fd >= 0) {
+        struct itimerspec deadline;
+        uint64_t expirations;
+        int64_t ns = time_stamp->tv_nsec + (int64_t)sleep_time_us * 1000;
+
+        memset(&deadline, 0, sizeof(deadline));
+        deadline.it_value.tv_sec = time_stamp->tv_sec + ns / 1000000000;
+        deadline.it_value.tv_nsec = ns % 1000000000;
+        if (timerfd_settime(out->timer_fd, TFD_TIMER_ABSTIME, &deadline, NULL) == 0 &&
+                read(out->timer_fd, &expirations, sizeof(expirations)) ==
+                        sizeof(expirations))
+            return;
+    }
 
-        /* in_buf.frameCount and out_buf.frameCount indicate respectively
-         * the maximum number of frames to be consumed and produced by process(),
-         * must be proc_frames_count */
-        in_buf.frameCount = proc_frames_count;
-        in_buf.s16 = in->proc_buf;
-        out_buf.frameCount = proc_frames_count;
-        out_buf.s16 = in->proc_out_buf;
-
-        /* FIXME: this works because of current pre processing library implementation that
-         * does the actual process only when the last enabled effect process is called.
-         * The generic solution is to have an output buffer for each effect and pass it as
-         * input to the next. */
-        for (i = 0; i < in->num_preprocessors; i++) {
-            (*in->preprocessors[i])->process(in->preprocessors[i], &in_buf, &out_buf);
+    usleep(sleep_time_us);
+}
+
+/* moves the adaptive threshold by delta frames, between the floor and the ceiling */
+static void out_adapt_move(struct stream_out *out, int delta, int64_t now)
+{
+    int threshold = out->adapt_threshold + delta;
+
+    if (threshold < out->adapt_floor)
+        threshold = out->adapt_floor;
+    if (threshold > out->adapt_ceiling)
+        threshold = out->adapt_ceiling;
+
+    if (delta > 0) {
+        /* the threshold last lowered to didn't hold, wait longer next time */
+        if (out->adapt_lowered) {
+            out->adapt_stable_ns *= 2;
+            if (out->adapt_stable_ns > ADAPT_STABLE_MAX_MS * 1000000LL)
+                out->adapt_stable_ns = ADAPT_STABLE_MAX_MS * 1000000LL;
         }
+        out->adapt_lowered = false;
+        if (threshold != out->adapt_threshold)
+            out->adapt_raises++;
+    } else if (threshold != out->adapt_threshold) {
+        out->adapt_lowered = true;
+        out->adapt_lowers++;
+    }
+    if (threshold != out->adapt_threshold)
+        ALOGV("adaptive write threshold %d -> %d frames", out->adapt_threshold, threshold);
+
+    out->adapt_ns = now;
+    out->adapt_threshold = threshold;
+    out->write_threshold = threshold;
+}
+
+/*
+ * Feeds the adaptive threshold with the kernel buffer level found before a
+ * write, or with an underrun. Only the short threshold adapts. Must be
+ * called with the output stream mutex locked.
+ */
+static void out_adapt(struct stream_out *out, int kernel_frames, bool underrun)
+{
+    int quarter = out->pcm_config.period_size / 4;
+    int64_t now;
+
+    if (!out->adaptive || out->buffer_type != OUT_BUFFER_TYPE_SHORT)
+        return;
 
-        /* process() has updated the number of frames consumed and produced in
-         * in_buf.frameCount and out_buf.frameCount respectively
-         * move remaining frames to the beginning of in->proc_buf_in */
-        in->proc_frames_in -= in_buf.frameCount;
-        if (in->proc_frames_in) {
-            memmove(in->proc_buf,
-                    in->proc_buf + in_buf.frameCount,
-                    in->proc_frames_in * sizeof(int16_t));
+    now = monotonic_ns();
+    if (underrun) {
+        out->adapt_armed = false;
+        out_adapt_move(out, out->pcm_config.period_size, now);
+        return;
+    }
+    /* the buffer starts empty, which isn't a near miss */
+    if (!out->adapt_armed) {
+        if (kernel_frames >= quarter) {
+            out->adapt_armed = true;
+            out->adapt_ns = now;
         }
+        return;
+    }
 
-        /* if not enough frames were passed to process(), read more and retry. */
-        if (out_buf.frameCount == 0)
+    if (kernel_frames < quarter) {
+        out->near_misses++;
+        out_adapt_move(out, quarter, now);
+    } else if (now - out->adapt_ns >= out->adapt_stable_ns) {
+        out_adapt_move(out, -quarter, now);
+    }
+}
+
+/*
+ * Waits for the kernel buffer to drain down to cur_write_threshold, then
+ * walks cur_write_threshold towards write_threshold. Must be called with
+ * the output stream mutex locked.
+ */
+static void out_throttle(struct stream_out *out)
+{
+    int kernel_frames;
+    int total_sleep_time_us = 0;
+    size_t period_size = out->pcm_config.period_size;
+    bool measured = false;
+
+    /* do not allow more than out->cur_write_threshold frames in kernel
+     * pcm driver buffer */
+    do {
+        struct timespec time_stamp;
+        if (pcm_get_htimestamp(out->pcm,
+                               (unsigned int *)&kernel_frames,
+                               &time_stamp) < 0) {
+            kernel_frames = 0; /* assume no space is available */
+            break;
+        }
+        kernel_frames = pcm_get_buffer_size(out->pcm) - kernel_frames;
+        measured = true;
+
+        if (kernel_frames > out->cur_write_threshold) {
+            int sleep_time_us =
+                (int)(((int64_t)(kernel_frames - out->cur_write_threshold)
+                                * 1000000) / out->pcm_config.rate);
+            if (sleep_time_us < MIN_WRITE_SLEEP_US)
+                break;
+            total_sleep_time_us += sleep_time_us;
+            if (total_sleep_time_us > MAX_WRITE_SLEEP_US) {
+                ALOGV("out_write() limiting sleep time %d to %d",
+                      total_sleep_time_us, MAX_WRITE_SLEEP_US);
+                sleep_time_us = MAX_WRITE_SLEEP_US -
+                                    (total_sleep_time_us - sleep_time_us);
+            }
+            int64_t start = monotonic_ns();
+            out_pacing_wait(out, kernel_frames, &time_stamp, sleep_time_us);
+            audio_stats_add_ns(&out->stats.sleep_ns, monotonic_ns() - start);
+        }
+
+    } while ((kernel_frames > out->cur_write_threshold) &&
+            (total_sleep_time_us <= MAX_WRITE_SLEEP_US));
+    audio_stats_add_fill(&out->stats, kernel_frames, pcm_get_buffer_size(out->pcm));
+    if (measured)
+        out_adapt(out, kernel_frames, false);
+
+    /* do not allow abrupt changes on buffer size. Increasing/decreasing
+     * the threshold by steps of 1/4th of the buffer size keeps the write
+     * time within a reasonable range during transitions.
+     * Also reset current threshold just above current filling status when
+     * kernel buffer is really depleted to allow for smooth catching up with
+     * target threshold.
+     */
+    if (out->cur_write_threshold > out->write_threshold) {
+        out->cur_write_threshold -= period_size / 4;
+        if (out->cur_write_threshold < out->write_threshold) {
+            out->cur_write_threshold = out->write_threshold;
+        }
+    } else if (out->cur_write_threshold < out->write_threshold) {
+        out->cur_write_threshold += period_size / 4;
+        if (out->cur_write_threshold > out->write_threshold) {
+            out->cur_write_threshold = out->write_threshold;
+        }
+    } else if ((kernel_frames < out->write_threshold) &&
+        ((out->write_threshold - kernel_frames) >
+            (int)(period_size * OUT_SHORT_PERIOD_COUNT))) {
+        out->cur_write_threshold = (kernel_frames / period_size + 1) * period_size;
+        out->cur_write_threshold += period_size / 4;
+    }
+}
+
+/* writes frames at the PCM rate to the PCM, through convert when it is set */
+static int out_write_pcm(struct stream_out *out, const int16_t *src, size_t frames,
+                         audio_convert_func_t convert, void **conv_buffer,
+                         size_t *conv_buffer_size)
+{
+    size_t bytes = pcm_frames_to_bytes(out->pcm, frames);
+    int64_t start;
+    int ret;
+
+    if (convert) {
+        ret = ensure_buffer_size(conv_buffer, conv_buffer_size, bytes);
+        if (ret != 0)
+            return ret;
+        convert(*conv_buffer, src, frames);
+        src = *conv_buffer;
+    }
+
+    start = monotonic_ns();
+    ret = pcm_write(out->pcm, src, bytes);
+    audio_stats_add_io(&out->stats, monotonic_ns() - start);
+    return ret;
+}
+
+/* out_write_pcm() through out->gain_convert, while the gain is steady */
+static int out_write_pcm_gain(struct stream_out *out, const int16_t *src, size_t frames)
+{
+    size_t bytes = pcm_frames_to_bytes(out->pcm, frames);
+    int64_t start;
+    int ret;
+
+    ret = ensure_buffer_size(&out->conv_buffer, &out->conv_buffer_size, bytes);
+    if (ret != 0)
+        return ret;
+    audio_convert_gain(out->gain_convert, &out->gain, out->conv_buffer, src, frames);
+
+    start = monotonic_ns();
+    ret = pcm_write(out->pcm, out->conv_buffer, bytes);
+    audio_stats_add_io(&out->stats, monotonic_ns() - start);
+    return ret;
+}
+
+/* out_write_pcm() for float frames at the PCM rate, through out->float_convert */
+static int out_write_pcm_float(struct stream_out *out, const float *src, size_t frames)
+{
+    size_t bytes = pcm_frames_to_bytes(out->pcm, frames);
+    int64_t start;
+    int ret;
+
+    ret = ensure_buffer_size(&out->conv_buffer, &out->conv_buffer_size, bytes);
+    if (ret != 0)
+        return ret;
+    out->float_convert(out->conv_buffer, src, frames);
+
+    start = monotonic_ns();
+    ret = pcm_write(out->pcm, out->conv_buffer, bytes);
+    audio_stats_add_io(&out->stats, monotonic_ns() - start);
+    return ret;
+}
+
+/*
+ * Returns how many frames all the outputs sharing the PCM have queued for
+ * mixing. An output with an empty queue, not in a write, that didn't come
+ * back within the duration of its last write plus a period stopped writing
+ * without entering standby, it is left out.
+ * Must be called with adev->mix_lock held.
+ */
+static size_t out_mix_ready_l(struct audio_device *adev)
+{
+    struct stream_out *out;
+    int64_t now = monotonic_ns();
+    int64_t period_ns = (int64_t)adev->out_pcm_config.period_size * 1000000000 /
+            adev->out_pcm_config.rate;
+    size_t ready = SIZE_MAX;
+
+    for (out = adev->outputs; out != NULL; out = out->mix_next) {
+        if (out->mix_frames == 0 && !out->mix_busy &&
+                now - out->mix_last_ns > out->mix_chunk_ns + period_ns)
             continue;
+        if (out->mix_frames < ready)
+            ready = out->mix_frames;
+    }
+
+    return ready == SIZE_MAX ? 0 : ready;
+}
+
+/*
+ * Takes up to frames from the head of every mix queue and sums them into
+ * adev->mix_buffer, a queue that has less is mixed as silence for the rest.
+ * Must be called with adev->out_write_lock and adev->mix_lock held.
+ */
+static int out_mix_l(struct audio_device *adev, size_t frames)
+{
+    struct stream_out *out;
+    unsigned int channels = adev->out_pcm_config.channels;
+    bool first = true;
+    int ret;
+
+    ret = ensure_buffer_size((void **)&adev->mix_buffer, &adev->mix_buffer_size,
+                             frames * channels * sizeof(int16_t));
+    if (ret != 0)
+        return ret;
+
+    for (out = adev->outputs; out != NULL; out = out->mix_next) {
+        size_t capacity = out->mix_queue_size / (channels * sizeof(int16_t));
+        size_t taken = out->mix_frames < frames ? out->mix_frames : frames;
+        size_t done;
+
+        if (taken == 0)
+            continue;
+        /* at most two runs, when the frames wrap around the end of the ring */
+        for (done = 0; done < taken; ) {
+            size_t run = capacity - out->mix_head;
+            int16_t *dst = adev->mix_buffer + done * channels;
+            const int16_t *src = out->mix_queue + out->mix_head * channels;
+
+            if (run > taken - done)
+                run = taken - done;
+            if (first)
+                memcpy(dst, src, run * channels * sizeof(int16_t));
+            else
+                audio_mix_i16(dst, src, run * channels);
+            out->mix_head = (out->mix_head + run) % capacity;
+            done += run;
+        }
+        if (first && taken < frames)
+            memset(adev->mix_buffer + taken * channels, 0,
+                   (frames - taken) * channels * sizeof(int16_t));
+        first = false;
+
+        out->mix_frames -= taken;
+        if (out->mix_frames == 0)
+            out->mix_head = 0;
+    }
+    pthread_cond_broadcast(&adev->mix_cond);
+
+    return 0;
+}
+
+/*
+ * Makes room for frames more in the mix queue of out, keeping the queued
+ * frames in order across the end of the grown ring. Must be called with
+ * adev->mix_lock held.
+ */
+static int out_mix_reserve_l(struct stream_out *out, size_t frames)
+{
+    size_t frame_bytes = out->pcm_config.channels * sizeof(int16_t);
+    size_t capacity = out->mix_queue_size / frame_bytes;
+    size_t head_run = capacity - out->mix_head;
+    int ret;
 
-        if ((frames_wr + (ssize_t)out_buf.frameCount) <= frames) {
-            memcpy((int16_t *)buffer + frames_wr,
-                   out_buf.s16,
-                   out_buf.frameCount * sizeof(int16_t));
-            frames_wr += out_buf.frameCount;
+    if (out->mix_frames + frames <= capacity)
+        return 0;
+    ret = ensure_buffer_size((void **)&out->mix_queue, &out->mix_queue_size,
+                             (out->mix_frames + frames) * frame_bytes);
+    if (ret != 0)
+        return ret;
+    if (out->mix_head + out->mix_frames > capacity) {
+        size_t head = out->mix_queue_size / frame_bytes - head_run;
+
+        memmove((char *)out->mix_queue + head * frame_bytes,
+                (char *)out->mix_queue + out->mix_head * frame_bytes, head_run * frame_bytes);
+        out->mix_head = head;
+    }
+    return 0;
+}
+
+/*
+ * Queues frames for mixing with the other outputs sharing the PCM. The
+ * frames are taken from fsrc in float when it is set, from src otherwise.
+ * Whichever output gets hold of the PCM writes the mix for as long as every
+ * output has frames queued, taking along the frames queued meanwhile.
+ *
+ * No output waits for the others' frames, only for the PCM. One with more
+ * than MIX_QUEUE_PERIODS periods or a single write queued, whichever is
+ * larger, stays until the excess is taken. If it writes the mix, it lets
+ * the PCM drain down to the write threshold first, then mixes the excess
+ * with whatever the late outputs have and silence for the rest.
+ * Must be called with the output stream mutex locked.
+ */
+static int out_write_mixed(struct stream_out *out, const int16_t *src, const float *fsrc,
+                           size_t frames, bool sco_on)
+{
+    struct audio_device *adev = out->dev;
+    unsigned int channels = out->pcm_config.channels;
+    unsigned int src_channels = out->resampler ? channels :
+            popcount(out_get_channels(&out->stream.common));
+    size_t max_queued = out->pcm_config.period_size * MIX_QUEUE_PERIODS;
+    int64_t period_ns = (int64_t)out->pcm_config.period_size * 1000000000 /
+            out->pcm_config.rate;
+    size_t left = frames;
+    int ret;
+
+    if (frames > max_queued)
+        max_queued = frames;
+
+    audio_thread_lock(adev, &adev->mix_lock, "mix_lock");
+    ret = out_mix_reserve_l(out, frames);
+    if (ret != 0) {
+        pthread_mutex_unlock(&adev->mix_lock);
+        return ret;
+    }
+    /* at most two runs, when the frames wrap around the end of the ring */
+    while (left > 0) {
+        size_t capacity = out->mix_queue_size / (channels * sizeof(int16_t));
+        size_t tail = (out->mix_head + out->mix_frames) % capacity;
+        size_t run = capacity - tail < left ? capacity - tail : left;
+        int16_t *dst = out->mix_queue + tail * channels;
+
+        if (fsrc) {
+            out->float_mix_convert(dst, fsrc, run);
+            fsrc += run * src_channels;
+        } else if (out->mix_convert) {
+            out->mix_convert(dst, src, run);
+            src += run * src_channels;
         } else {
-            memcpy((int16_t *)buffer + frames_wr,
-                   out_buf.s16,
-                   (frames - frames_wr) * sizeof(int16_t));
-            in->proc_out_frames = out_buf.frameCount - (frames - frames_wr);
-            memmove(in->proc_out_buf,
-                    in->proc_out_buf + (frames - frames_wr),
-                    in->proc_out_frames * sizeof(int16_t));
-            frames_wr = frames;
+            memcpy(dst, src, run * channels * sizeof(int16_t));
+            src += run * channels;
         }
+        out->mix_frames += run;
+        left -= run;
     }
+    out->mix_busy = true;
 
-    return frames_wr;
+    for (;;) {
+        bool throttled = false;
+
+        if (pthread_mutex_trylock(&adev->out_write_lock) != 0) {
+            struct timespec deadline;
+
+            if (out->mix_frames <= max_queued)
+                break;
+            /* the output writing the mix takes frames as the PCM drains */
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            deadline.tv_nsec += period_ns;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000;
+            deadline.tv_nsec %= 1000000000;
+            pthread_cond_timedwait(&adev->mix_cond, &adev->mix_lock, &deadline);
+            continue;
+        }
+
+        for (;;) {
+            size_t ready = out_mix_ready_l(adev);
+
+            if (out->mix_frames > max_queued && ready < out->mix_frames - max_queued) {
+                /* once the PCM wants more, the outputs still missing are late */
+                if (!throttled && !sco_on) {
+                    pthread_mutex_unlock(&adev->mix_lock);
+                    out_throttle(out);
+                    throttled = true;
+                    audio_thread_lock(adev, &adev->mix_lock, "mix_lock");
+                    continue;
+                }
+                ready = out->mix_frames - max_queued;
+            }
+            if (ready == 0)
+                break;
+            ret = out_mix_l(adev, ready);
+            pthread_mutex_unlock(&adev->mix_lock);
+            if (ret == 0) {
+                if (!throttled && !sco_on)
+                    out_throttle(out);
+                throttled = false;
+                ret = out_write_pcm(out, adev->mix_buffer, ready, adev->out_mix_convert,
+                                    &adev->mix_conv_buffer, &adev->mix_conv_buffer_size);
+            }
+            audio_thread_lock(adev, &adev->mix_lock, "mix_lock");
+            if (ret != 0)
+                break;
+        }
+        /* an output queueing from now on finds the PCM free */
+        pthread_mutex_unlock(&adev->out_write_lock);
+        break;
+    }
+    out->mix_busy = false;
+    pthread_mutex_unlock(&adev->mix_lock);
+
+    return ret;
 }
 
 /* API functions */
 
-static uint32_t out_get_sample_rate(const struct audio_stream *stream __unused)
+static uint32_t out_get_sample_rate(const struct audio_stream *stream)
 {
-    return pcm_config_out.rate;
+    struct stream_out *out = (struct stream_out *)stream;
+
+    return out->sample_rate;
 }
 
 static int out_set_sample_rate(struct audio_stream *stream __unused, uint32_t rate __unused)
@@ -870,7 +2903,9 @@ static int out_set_sample_rate(struct audio_stream *stream __unused, uint32_t ra
 
 static size_t out_get_buffer_size(const struct audio_stream *stream)
 {
-    return pcm_config_out.period_size *
+    struct stream_out *out = (struct stream_out *)stream;
+
+    return out_profile_config(out)->period_size *
                audio_stream_out_frame_size((struct audio_stream_out *)stream);
 }
 
@@ -879,9 +2914,11 @@ static uint32_t out_get_channels(const struct audio_stream *stream __unused)
     return AUDIO_CHANNEL_OUT_STEREO;
 }
 
-static audio_format_t out_get_format(const struct audio_stream *stream __unused)
+static audio_format_t out_get_format(const struct audio_stream *stream)
 {
-    return AUDIO_FORMAT_PCM_16_BIT;
+    struct stream_out *out = (struct stream_out *)stream;
+
+    return out->format;
 }
 
 static int out_set_format(struct audio_stream *stream __unused, audio_format_t format __unused)
@@ -902,8 +2939,32 @@ static int out_standby(struct audio_stream *stream)
     return 0;
 }
 
-static int out_dump(const struct audio_stream *stream __unused, int fd __unused)
+/*
+ * The dump hooks don't take the stream locks, which the audio threads
+ * hold most of the time: the plain fields may be from the middle of a
+ * change.
+ */
+static int out_dump(const struct audio_stream *stream, int fd)
 {
+    struct stream_out *out = (struct stream_out *)stream;
+
+    dprintf(fd, "    output %p%s: %u Hz, format %#x, %s\n", out,
+            out->mmap ? " (mmap)" : out->deep_buffer ? " (deep buffer)" : "",
+            out->sample_rate, out->format, out->standby ? "standby" : "active");
+    if (!out->standby)
+        dprintf(fd, "      PCM: %u Hz, %u channels, format %d, %u periods of %u frames\n",
+                out->pcm_config.rate, out->pcm_config.channels, out->pcm_config.format,
+                out->pcm_config.period_count, out->pcm_config.period_size);
+    dprintf(fd, "      pacing %s, write threshold %d frames, %llu frames written\n",
+            out_pacing_to_string(out->pacing), out->write_threshold,
+            (unsigned long long)out->frames_written);
+    if (out->adaptive)
+        dprintf(fd, "      adaptive write threshold %d frames (floor %d, ceiling %d), "
+                "%u raises, %u lowers, %u near misses, lowered after %lld ms stable\n",
+                out->adapt_threshold, out->adapt_floor, out->adapt_ceiling,
+                out->adapt_raises, out->adapt_lowers, out->near_misses,
+                (long long)(out->adapt_stable_ns / 1000000));
+    audio_stats_dump(&out->stats, fd, "write");
     return 0;
 }
 
@@ -930,14 +2991,16 @@ static int out_set_parameters(struct audio_stream *stream, const char *kvpairs)
              */
             if ((val & AUDIO_DEVICE_OUT_ALL_SCO) ^
                     (adev->out_device & AUDIO_DEVICE_OUT_ALL_SCO)) {
-                pthread_mutex_lock(&out->lock);
-                do_out_standby(out);
-                pthread_mutex_unlock(&out->lock);
+                do_out_standby_all(adev);
             }
 
             adev->out_device = val;
+            adev_set_state(adev, ADEV_STATE_SCO_OUT, val & AUDIO_DEVICE_OUT_ALL_SCO);
             select_devices(adev);
-            // go into standby in case the route is on another card
+            // go into standby in case the route is on another card,
+            // the outputs sharing the PCM follow
+            do_out_standby_all(adev);
+            warm_pcm_close(&adev->warm_out);
             pthread_mutex_lock(&out->lock);
             if(!out->standby){
                 do_out_standby(out);
@@ -945,39 +3008,108 @@ static int out_set_parameters(struct audio_stream *stream, const char *kvpairs)
             pthread_mutex_unlock(&out->lock);
         }
     }
+    len = str_parms_get_str(parms, "pacing", value, sizeof(value));
+    if (len >= 0) {
+        pthread_mutex_lock(&out->lock);
+        out->pacing = out_pacing_from_string(value);
+        ALOGI("out pacing set to %s", out_pacing_to_string(out->pacing));
+        pthread_mutex_unlock(&out->lock);
+    }
     pthread_mutex_unlock(&adev->lock);
 
     str_parms_destroy(parms);
     return 0;
 }
 
-static char *out_get_parameters(const struct audio_stream *stream __unused, const char *keys __unused)
+static char *out_get_parameters(const struct audio_stream *stream, const char *keys)
+{
+    struct stream_out *out = (struct stream_out *)stream;
+    struct audio_device *adev = out->dev;
+    struct str_parms *query = str_parms_create_str(keys);
+    struct str_parms *reply = str_parms_create();
+    char *str;
+
+    pthread_mutex_lock(&adev->lock);
+    add_sup_parameters(query, reply,
+                       (adev->out_device & AUDIO_DEVICE_OUT_AUX_DIGITAL) ?
+                               PCM_DEVICE_HDMI : PCM_DEVICE,
+                       PCM_OUT, adev->out_device, out->sample_rate, "AUDIO_CHANNEL_OUT_STEREO",
+                       out->mmap ? "AUDIO_FORMAT_PCM_16_BIT" :
+                               "AUDIO_FORMAT_PCM_16_BIT|AUDIO_FORMAT_PCM_FLOAT|"
+                               "AUDIO_FORMAT_PCM_24_BIT_PACKED|AUDIO_FORMAT_PCM_8_24_BIT");
+    pthread_mutex_unlock(&adev->lock);
+
+    if (str_parms_has_key(query, "pacing")) {
+        pthread_mutex_lock(&out->lock);
+        str_parms_add_str(reply, "pacing", out_pacing_to_string(out->pacing));
+        pthread_mutex_unlock(&out->lock);
+    }
+
+    str = str_parms_to_str(reply);
+    str_parms_destroy(query);
+    str_parms_destroy(reply);
+    return str;
+}
+
+/*
+ * Frames out_write() lets queue in the kernel buffer in a buffer mode, for a
+ * PCM opened with config. Must be called with the output stream mutex locked.
+ */
+static int out_write_threshold(const struct stream_out *out,
+                               const struct pcm_config *config, int buffer_type)
 {
-    return strdup("");
+    if (buffer_type == OUT_BUFFER_TYPE_LONG)
+        return config->period_size * config->period_count;
+    if (out->adaptive)
+        return out->adapt_threshold;
+    return OUT_PERIOD_SIZE * OUT_SHORT_PERIOD_COUNT;
 }
 
 static uint32_t out_get_latency(const struct audio_stream_out *stream)
 {
     struct stream_out *out = (struct stream_out *)stream;
-    struct audio_device *adev = out->dev;
-    size_t period_count;
-
-    pthread_mutex_lock(&adev->lock);
+    unsigned int state = atomic_load_explicit(&out->dev->state, memory_order_acquire);
+    struct pcm_config config;
+    unsigned int frames;
 
-    if (adev->screen_off && !adev->active_in && !(adev->out_device & AUDIO_DEVICE_OUT_ALL_SCO))
-        period_count = OUT_LONG_PERIOD_COUNT;
-    else
-        period_count = OUT_SHORT_PERIOD_COUNT;
+    pthread_mutex_lock(&out->lock);
+    if (!out->standby && out->buffer_type != OUT_BUFFER_TYPE_UNKNOWN) {
+        config = out->pcm_config;
+        frames = out->write_threshold;
+    } else {
+        /* nothing written since standby, guess what the next out_write() gets */
+        if (state & ADEV_STATE_SCO_OUT) {
+            config = pcm_config_sco;
+        } else {
+            config = *out_profile_config(out);
+            config.rate = out->sample_rate;
+        }
+        frames = out_write_threshold(out, &config,
+                (state & (ADEV_STATE_SCREEN_OFF | ADEV_STATE_CAPTURING)) ==
+                        ADEV_STATE_SCREEN_OFF ? OUT_BUFFER_TYPE_LONG : OUT_BUFFER_TYPE_SHORT);
+    }
+    pthread_mutex_unlock(&out->lock);
 
-    pthread_mutex_unlock(&adev->lock);
+    /* the PCM does not start before a deep buffer period is queued */
+    if (frames < config.start_threshold)
+        frames = config.start_threshold;
 
-    return (pcm_config_out.period_size * period_count * 1000) / pcm_config_out.rate;
+    return (frames * 1000) / config.rate;
 }
 
-static int out_set_volume(struct audio_stream_out *stream __unused, float left __unused,
-                          float right __unused)
+static int out_set_volume(struct audio_stream_out *stream, float left, float right)
 {
-    return -ENOSYS;
+    struct stream_out *out = (struct stream_out *)stream;
+
+    /* the frames of an MMAP_NOIRQ stream never go through the HAL */
+    if (out->mmap)
+        return -ENOSYS;
+
+    pthread_mutex_lock(&out->lock);
+    audio_gain_set(&out->gain, left, right,
+                   out->standby ? 0 : out->pcm_config.rate * GAIN_RAMP_MS / 1000);
+    pthread_mutex_unlock(&out->lock);
+    return 0;
 }
 
 static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
@@ -987,152 +3119,170 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
     struct stream_out *out = (struct stream_out *)stream;
     struct audio_device *adev = out->dev;
     size_t frame_size = audio_stream_out_frame_size(stream);
-    int16_t *in_buffer = (int16_t *)buffer;
+    unsigned int channels = popcount(out_get_channels(&stream->common));
+    const int16_t *src = (const int16_t *)buffer;
+    const float *fsrc = NULL;
     size_t in_frames = bytes / frame_size;
     size_t out_frames;
+    int64_t start_ns = monotonic_ns();
+    unsigned int state;
     int buffer_type;
-    int kernel_frames;
     bool sco_on;
+    bool mixing;
+    bool fuse_gain;
 
-    /*
-     * acquiring hw device mutex systematically is useful if a low
-     * priority thread is waiting on the output stream mutex - e.g.
-     * executing out_set_parameters() while holding the hw device
-     * mutex
-     */
-    pthread_mutex_lock(&adev->lock);
-    pthread_mutex_lock(&out->lock);
+    /* MMAP_NOIRQ clients write straight into the hardware ring */
+    if (out->mmap)
+        return -ENOSYS;
+
+    audio_thread_lock(adev, &out->lock, "out->lock");
     if (out->standby) {
-        ret = start_output_stream(out);
-        if (ret != 0) {
-            pthread_mutex_unlock(&adev->lock);
-            goto exit;
+        /* adev->lock comes first, and the stream may have been started
+         * by the time both are held */
+        pthread_mutex_unlock(&out->lock);
+        audio_thread_lock(adev, &adev->lock, "adev->lock");
+        pthread_mutex_lock(&out->lock);
+        if (out->standby) {
+            ret = start_output_stream(out);
+            if (ret != 0) {
+                pthread_mutex_unlock(&adev->lock);
+                goto exit;
+            }
+            out->standby = false;
+            audio_stats_count(&out->stats.resumes);
         }
-        out->standby = false;
+        pthread_mutex_unlock(&adev->lock);
     }
-    buffer_type = (adev->screen_off && !adev->active_in) ?
-            OUT_BUFFER_TYPE_LONG : OUT_BUFFER_TYPE_SHORT;
-    sco_on = (adev->out_device & AUDIO_DEVICE_OUT_ALL_SCO);
-    pthread_mutex_unlock(&adev->lock);
+    state = atomic_load_explicit(&adev->state, memory_order_acquire);
+    buffer_type = (state & (ADEV_STATE_SCREEN_OFF | ADEV_STATE_CAPTURING)) ==
+            ADEV_STATE_SCREEN_OFF ? OUT_BUFFER_TYPE_LONG : OUT_BUFFER_TYPE_SHORT;
+    sco_on = state & ADEV_STATE_SCO_OUT;
 
     /* detect changes in screen ON/OFF state and adapt buffer size
-     * if needed. Do not change buffer size when routed to SCO device. */
+     * if needed. Do not change buffer size when routed to SCO device.
+     * The long buffer is the whole kernel buffer, so with deep buffer
+     * periods the writes just block until the next period interrupt. */
     if (!sco_on && (buffer_type != out->buffer_type)) {
-        size_t period_count;
-
-        if (buffer_type == OUT_BUFFER_TYPE_LONG)
-            period_count = OUT_LONG_PERIOD_COUNT;
-        else
-            period_count = OUT_SHORT_PERIOD_COUNT;
-
-        out->write_threshold = out->pcm_config.period_size * period_count;
+        out->write_threshold = out_write_threshold(out, &out->pcm_config, buffer_type);
         /* reset current threshold if exiting standby */
         if (out->buffer_type == OUT_BUFFER_TYPE_UNKNOWN)
             out->cur_write_threshold = out->write_threshold;
         out->buffer_type = buffer_type;
     }
 
-    /* Reduce number of channels, if necessary */
-    if (popcount(out_get_channels(&stream->common)) >
-                 (int)out->pcm_config.channels) {
-        unsigned int i;
+    /*
+     * A single output writes the PCM directly. Otherwise its frames are
+     * queued, and mixed with the other outputs by whichever completes them.
+     */
+    audio_thread_lock(adev, &adev->mix_lock, "mix_lock");
+    mixing = adev->num_outputs > 1 || out->mix_frames > 0;
+    pthread_mutex_unlock(&adev->mix_lock);
 
-        /* Discard right channel */
-        for (i = 1; i < in_frames; i++)
-            in_buffer[i] = in_buffer[i * 2];
+    /*
+     * High resolution frames go to the PCM in float, with a single
+     * conversion at the end. The mix is done in 16 bit, so a mixed stream
+     * is narrowed as it is queued, in the same pass as its channels; mixing
+     * happens whenever the primary and the deep buffer outputs are both
+     * open, the precision is back once this stream is alone on the PCM.
+     * The resampler only takes 16 bit, so it is preceded by a narrowing.
+     */
+    if (out->format != AUDIO_FORMAT_PCM_16_BIT) {
+        fsrc = buffer;
+        ret = ensure_buffer_size((void **)&out->float_buffer, &out->float_buffer_size,
+                                 in_frames * channels * sizeof(float));
+        if (ret != 0)
+            goto exit;
+        if (out->format != AUDIO_FORMAT_PCM_FLOAT) {
+            audio_float_from_format(out->float_buffer, buffer, in_frames * channels,
+                                    out->format);
+            fsrc = out->float_buffer;
+        }
+        if (out->resampler) {
+            out->float_narrow(out->float_buffer, fsrc, in_frames);
+            src = (const int16_t *)out->float_buffer;
+            fsrc = NULL;
+        } else if (!audio_gain_is_unity(&out->gain)) {
+            audio_gain_apply_float(&out->gain, out->float_buffer, fsrc, in_frames, channels);
+            fsrc = out->float_buffer;
+        }
+    }
 
-        /* The frame size is now half */
-        frame_size /= 2;
+    /* Reduce number of channels ahead of the resampler, if necessary */
+    if (out->pre_convert) {
+        ret = ensure_buffer_size(&out->conv_buffer, &out->conv_buffer_size,
+                                 in_frames * out->pcm_config.channels * sizeof(int16_t));
+        if (ret != 0)
+            goto exit;
+        out->pre_convert(out->conv_buffer, src, in_frames);
+        src = out->conv_buffer;
     }
 
     /* Change sample rate, if necessary */
-    if (out_get_sample_rate(&stream->common) != out->pcm_config.rate) {
+    if (out->resampler) {
+        int64_t start = monotonic_ns();
+
         out_frames = out->buffer_frames;
         out->resampler->resample_from_input(out->resampler,
-                                            in_buffer, &in_frames,
+                                            (int16_t *)src, &in_frames,
                                             out->buffer, &out_frames);
-        in_buffer = out->buffer;
+        src = out->buffer;
+        audio_stats_add_ns(&out->stats.resample_ns, monotonic_ns() - start);
     } else {
         out_frames = in_frames;
     }
 
-    if (!sco_on) {
-        int total_sleep_time_us = 0;
-        size_t period_size = out->pcm_config.period_size;
-
-        /* do not allow more than out->cur_write_threshold frames in kernel
-         * pcm driver buffer */
-        do {
-            struct timespec time_stamp;
-            if (pcm_get_htimestamp(out->pcm,
-                                   (unsigned int *)&kernel_frames,
-                                   &time_stamp) < 0) {
-                kernel_frames = 0; /* assume no space is available */
-                break;
-            }
-            kernel_frames = pcm_get_buffer_size(out->pcm) - kernel_frames;
-
-            if (kernel_frames > out->cur_write_threshold) {
-                int sleep_time_us =
-                    (int)(((int64_t)(kernel_frames - out->cur_write_threshold)
-                                    * 1000000) / out->pcm_config.rate);
-                if (sleep_time_us < MIN_WRITE_SLEEP_US)
-                    break;
-                total_sleep_time_us += sleep_time_us;
-                if (total_sleep_time_us > MAX_WRITE_SLEEP_US) {
-                    ALOGV("out_write() limiting sleep time %d to %d",
-                          total_sleep_time_us, MAX_WRITE_SLEEP_US);
-                    sleep_time_us = MAX_WRITE_SLEEP_US -
-                                        (total_sleep_time_us - sleep_time_us);
-                }
-                usleep(sleep_time_us);
-            }
-
-        } while ((kernel_frames > out->cur_write_threshold) &&
-                (total_sleep_time_us <= MAX_WRITE_SLEEP_US));
-
-        /* do not allow abrupt changes on buffer size. Increasing/decreasing
-         * the threshold by steps of 1/4th of the buffer size keeps the write
-         * time within a reasonable range during transitions.
-         * Also reset current threshold just above current filling status when
-         * kernel buffer is really depleted to allow for smooth catching up with
-         * target threshold.
-         */
-        if (out->cur_write_threshold > out->write_threshold) {
-            out->cur_write_threshold -= period_size / 4;
-            if (out->cur_write_threshold < out->write_threshold) {
-                out->cur_write_threshold = out->write_threshold;
-            }
-        } else if (out->cur_write_threshold < out->write_threshold) {
-            out->cur_write_threshold += period_size / 4;
-            if (out->cur_write_threshold > out->write_threshold) {
-                out->cur_write_threshold = out->write_threshold;
-            }
-        } else if ((kernel_frames < out->write_threshold) &&
-            ((out->write_threshold - kernel_frames) >
-                (int)(period_size * OUT_SHORT_PERIOD_COUNT))) {
-            out->cur_write_threshold = (kernel_frames / period_size + 1) * period_size;
-            out->cur_write_threshold += period_size / 4;
+    /*
+     * A steady gain is applied by the final conversion when there is one.
+     * Otherwise in place on the resampler output, or on the way to
+     * out->buffer with the stream channels, which the final conversion then
+     * reduces; the mix queue takes frames with the gain applied.
+     */
+    fuse_gain = !fsrc && !mixing && out->gain_convert && out->gain.ramp_frames == 0 &&
+            !audio_gain_is_unity(&out->gain);
+    if (!fsrc && !fuse_gain && !audio_gain_is_unity(&out->gain)) {
+        unsigned int gain_channels = out->resampler ? out->pcm_config.channels : channels;
+
+        if (!out->resampler) {
+            ret = ensure_buffer_size((void **)&out->buffer, &out->buffer_size,
+                                     out_frames * channels * sizeof(int16_t));
+            if (ret != 0)
+                goto exit;
         }
+        audio_gain_apply(&out->gain, out->buffer, src, out_frames, gain_channels);
+        src = out->buffer;
     }
 
-    if (out->pcm_config.format == PCM_FORMAT_S32_LE) {
-        unsigned int new_buffer_size = out_frames * frame_size * 2;
-        uint8_t resize_buffer[new_buffer_size];
-        memcpy_by_audio_format((void*)resize_buffer, AUDIO_FORMAT_PCM_32_BIT, (void*)in_buffer, AUDIO_FORMAT_PCM_16_BIT, out_frames * frame_size / 2);
-        ret = pcm_write(out->pcm, resize_buffer, new_buffer_size);
-    } else if(out->pcm_config.format == PCM_FORMAT_S8) {
-        unsigned int new_buffer_size = out_frames * frame_size / 2;
-        uint8_t resize_buffer[new_buffer_size];
-        memcpy_by_audio_format((void*)resize_buffer, AUDIO_FORMAT_PCM_8_BIT, (void*)in_buffer, AUDIO_FORMAT_PCM_16_BIT, out_frames * frame_size / 2);
-        ret = pcm_write(out->pcm, resize_buffer, new_buffer_size);
+    if (mixing) {
+        ret = out_write_mixed(out, src, fsrc, out_frames, sco_on);
     } else {
-        ret = pcm_write(out->pcm, in_buffer, out_frames * frame_size);
+        pthread_mutex_lock(&adev->out_write_lock);
+        if (!sco_on)
+            out_throttle(out);
+        if (fsrc)
+            ret = out_write_pcm_float(out, fsrc, out_frames);
+        else if (fuse_gain)
+            ret = out_write_pcm_gain(out, src, out_frames);
+        else
+            ret = out_write_pcm(out, src, out_frames, out->post_convert,
+                                &out->conv_buffer, &out->conv_buffer_size);
+        pthread_mutex_unlock(&adev->out_write_lock);
     }
+
+    /* the other outputs wait for the next write for about as long as this one took */
+    audio_thread_lock(adev, &adev->mix_lock, "mix_lock");
+    out->mix_last_ns = monotonic_ns();
+    out->mix_chunk_ns = (int64_t)out_frames * 1000000000 / out->pcm_config.rate;
+    pthread_mutex_unlock(&adev->mix_lock);
+    if (ret == 0)
+        out->frames_written += bytes / audio_stream_out_frame_size(stream);
     if (ret == -EPIPE) {
         /* In case of underrun, don't sleep since we want to catch up asap */
+        out->underruns++;
+        audio_stats_add_xrun(&out->stats, monotonic_ns());
+        out_adapt(out, 0, true);
         pthread_mutex_unlock(&out->lock);
         ALOGW("out_write underrun: %d", ret);
+        audio_stats_add_call(&out->stats, monotonic_ns() - start_ns);
         return ret;
     }
 
@@ -1145,13 +3295,51 @@ exit:
                out_get_sample_rate(&stream->common));
     }
 
+    audio_stats_add_call(&out->stats, monotonic_ns() - start_ns);
     return bytes;
 }
 
-static int out_get_render_position(const struct audio_stream_out *stream __unused,
-                                   uint32_t *dsp_frames __unused)
+static int out_get_render_position(const struct audio_stream_out *stream,
+                                   uint32_t *dsp_frames)
 {
-    return -EINVAL;
+    struct stream_out *out = (struct stream_out *)stream;
+    struct timespec timestamp;
+    uint64_t pending;
+    int ret = -EINVAL;
+
+    if (dsp_frames == NULL || out->mmap)
+        return -EINVAL;
+
+    pthread_mutex_lock(&out->lock);
+    if (!out->standby && out_get_pending_frames(out, &pending, &timestamp) == 0) {
+        uint64_t rendered = out->frames_written - out->standby_frames_written;
+        *dsp_frames = (uint32_t)(pending < rendered ? rendered - pending : 0);
+        ret = 0;
+    }
+    pthread_mutex_unlock(&out->lock);
+
+    return ret;
+}
+
+static int out_get_presentation_position(const struct audio_stream_out *stream,
+                                         uint64_t *frames, struct timespec *timestamp)
+{
+    struct stream_out *out = (struct stream_out *)stream;
+    uint64_t pending;
+    int ret = -ENODATA;
+
+    if (frames == NULL || timestamp == NULL || out->mmap)
+        return -EINVAL;
+
+    pthread_mutex_lock(&out->lock);
+    if (out_get_pending_frames(out, &pending, timestamp) == 0 &&
+            pending <= out->frames_written) {
+        *frames = out->frames_written - pending;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&out->lock);
+
+    return ret;
 }
 
 static int out_add_audio_effect(const struct audio_stream *stream __unused, effect_handle_t effect __unused)
@@ -1170,6 +3358,163 @@ static int out_get_next_write_timestamp(const struct audio_stream_out *stream __
     return -EINVAL;
 }
 
+static void adjust_mmap_period_count(struct pcm_config *config, int32_t min_size_frames)
+{
+    int periods = (min_size_frames + config->period_size - 1) / config->period_size;
+
+    if (periods < MMAP_PERIOD_COUNT_MIN)
+        periods = MMAP_PERIOD_COUNT_MIN;
+    else if (periods > MMAP_PERIOD_COUNT_MAX)
+        periods = MMAP_PERIOD_COUNT_MAX;
+    config->period_count = periods;
+}
+
+static int out_create_mmap_buffer(const struct audio_stream_out *stream,
+                                  int32_t min_size_frames,
+                                  struct audio_mmap_buffer_info *info)
+{
+    struct stream_out *out = (struct stream_out *)stream;
+    struct audio_device *adev = out->dev;
+    unsigned int device;
+    unsigned int offset;
+    unsigned int frames;
+    int ret = 0;
+
+    if (info == NULL || min_size_frames <= 0 || !out->mmap)
+        return -EINVAL;
+
+    pthread_mutex_lock(&adev->lock);
+    pthread_mutex_lock(&out->lock);
+
+    if (!out->standby) {
+        ret = -ENOSYS;
+        goto exit;
+    }
+    if (adev->out_device & AUDIO_DEVICE_OUT_ALL_SCO) {
+        ALOGE("%s: no mmap support on SCO", __func__);
+        ret = -ENOSYS;
+        goto exit;
+    }
+
+    device = (adev->out_device & AUDIO_DEVICE_OUT_AUX_DIGITAL) ? PCM_DEVICE_HDMI : PCM_DEVICE;
+    out->pcm_config = pcm_config_mmap_out;
+    out->pcm_config.rate = out->sample_rate;
+    adjust_mmap_period_count(&out->pcm_config, min_size_frames);
+    /* the mmap PCM is likely the same node */
+    warm_pcm_close(&adev->warm_out);
+
+    out->pcm = my_pcm_open(adev, device, PCM_OUT | PCM_MMAP | PCM_NOIRQ | PCM_MONOTONIC,
+                           &out->pcm_config, adev->out_device);
+    if (!out->pcm) {
+        ret = -ENODEV;
+        goto exit;
+    }
+    if (!pcm_is_ready(out->pcm)) {
+        ALOGE("pcm_open(mmap out) failed: %s", pcm_get_error(out->pcm));
+        ret = -ENOMEM;
+        goto err_close;
+    }
+    /* the client writes the ring in the stream format, nothing can convert it */
+    if (out->pcm_config.format != PCM_FORMAT_S16_LE ||
+            out->pcm_config.rate != out_get_sample_rate(&out->stream.common)) {
+        ALOGE("%s: card runs format %d at %u Hz, mmap needs 16 bit at %u Hz", __func__,
+              out->pcm_config.format, out->pcm_config.rate,
+              out_get_sample_rate(&out->stream.common));
+        ret = -ENODEV;
+        goto err_close;
+    }
+
+    ret = pcm_mmap_begin(out->pcm, &info->shared_memory_address, &offset, &frames);
+    if (ret < 0) {
+        ALOGE("%s: pcm_mmap_begin failed: %s", __func__, pcm_get_error(out->pcm));
+        goto err_close;
+    }
+    info->buffer_size_frames = pcm_get_buffer_size(out->pcm);
+    info->burst_size_frames = out->pcm_config.period_size;
+    info->shared_memory_fd = pcm_get_poll_fd(out->pcm);
+    memset(info->shared_memory_address, 0,
+           pcm_frames_to_bytes(out->pcm, info->buffer_size_frames));
+
+    ret = pcm_mmap_commit(out->pcm, 0, out->pcm_config.period_size);
+    if (ret < 0) {
+        ALOGE("%s: pcm_mmap_commit failed: %s", __func__, pcm_get_error(out->pcm));
+        goto err_close;
+    }
+
+    ALOGI("%s: %d frames in bursts of %d", __func__,
+          info->buffer_size_frames, info->burst_size_frames);
+    clock_gettime(CLOCK_MONOTONIC, &out->start_time);
+    adev->mmap_out = out;
+    out->standby = false;
+    audio_stats_count(&out->stats.resumes);
+    ret = 0;
+    goto exit;
+
+err_close:
+    pcm_close(out->pcm);
+    out->pcm = NULL;
+exit:
+    pthread_mutex_unlock(&out->lock);
+    pthread_mutex_unlock(&adev->lock);
+    return ret;
+}
+
+static int out_get_mmap_position(const struct audio_stream_out *stream,
+                                 struct audio_mmap_position *position)
+{
+    struct stream_out *out = (struct stream_out *)stream;
+    struct timespec ts = { 0, 0 };
+    unsigned int hw_ptr;
+    int ret;
+
+    if (position == NULL || !out->mmap)
+        return -EINVAL;
+
+    pthread_mutex_lock(&out->lock);
+    if (out->pcm == NULL) {
+        ret = -ENOSYS;
+    } else {
+        ret = pcm_mmap_get_hw_ptr(out->pcm, &hw_ptr, &ts);
+        if (ret == 0) {
+            position->position_frames = hw_ptr;
+            position->time_nanoseconds = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+        }
+    }
+    pthread_mutex_unlock(&out->lock);
+
+    return ret;
+}
+
+static int out_start(const struct audio_stream_out *stream)
+{
+    struct stream_out *out = (struct stream_out *)stream;
+    int ret;
+
+    if (!out->mmap)
+        return -ENOSYS;
+
+    pthread_mutex_lock(&out->lock);
+    ret = out->pcm ? pcm_start(out->pcm) : -ENOSYS;
+    pthread_mutex_unlock(&out->lock);
+
+    return ret;
+}
+
+static int out_stop(const struct audio_stream_out *stream)
+{
+    struct stream_out *out = (struct stream_out *)stream;
+    int ret;
+
+    if (!out->mmap)
+        return -ENOSYS;
+
+    pthread_mutex_lock(&out->lock);
+    ret = out->pcm ? pcm_stop(out->pcm) : -ENOSYS;
+    pthread_mutex_unlock(&out->lock);
+
+    return ret;
+}
+
 /** audio_stream_in implementation **/
 static uint32_t in_get_sample_rate(const struct audio_stream *stream)
 {
@@ -1200,14 +3545,18 @@ static size_t in_get_buffer_size(const struct audio_stream *stream)
     return size * audio_stream_in_frame_size(&in->stream);
 }
 
-static uint32_t in_get_channels(const struct audio_stream *stream __unused)
+static uint32_t in_get_channels(const struct audio_stream *stream)
 {
-    return AUDIO_CHANNEL_IN_MONO;
+    struct stream_in *in = (struct stream_in *)stream;
+
+    return in->channel_mask;
 }
 
-static audio_format_t in_get_format(const struct audio_stream *stream __unused)
+static audio_format_t in_get_format(const struct audio_stream *stream)
 {
-    return AUDIO_FORMAT_PCM_16_BIT;
+    struct stream_in *in = (struct stream_in *)stream;
+
+    return in->format;
 }
 
 static int in_set_format(struct audio_stream *stream __unused, audio_format_t format __unused)
@@ -1228,8 +3577,18 @@ static int in_standby(struct audio_stream *stream)
     return 0;
 }
 
-static int in_dump(const struct audio_stream *stream __unused, int fd __unused)
+static int in_dump(const struct audio_stream *stream, int fd)
 {
+    struct stream_in *in = (struct stream_in *)stream;
+
+    dprintf(fd, "    input %p: %u Hz, %u channels, format %#x, source %d, %d effects, %s\n",
+            in, in->requested_rate, in->channels, in->format, in->source, in->num_preprocessors,
+            in->standby ? "standby" : "active");
+    if (!in->standby)
+        dprintf(fd, "      PCM: %u Hz, %u channels, format %d, %u periods of %u frames\n",
+                in->pcm_config.rate, in->pcm_config.channels, in->pcm_config.format,
+                in->pcm_config.period_count, in->pcm_config.period_size);
+    audio_stats_dump(&in->stats, fd, "read");
     return 0;
 }
 
@@ -1269,6 +3628,7 @@ static int in_set_parameters(struct audio_stream *stream, const char *kvpairs)
                 do_in_standby(in);
             }
             pthread_mutex_unlock(&in->lock);
+            warm_pcm_close(&adev->warm_in);
         }
     }
     pthread_mutex_unlock(&adev->lock);
@@ -1277,14 +3637,45 @@ static int in_set_parameters(struct audio_stream *stream, const char *kvpairs)
     return 0;
 }
 
-static char * in_get_parameters(const struct audio_stream *stream __unused,
-                                const char *keys __unused)
+static char * in_get_parameters(const struct audio_stream *stream,
+                                const char *keys)
 {
-    return strdup("");
+    struct stream_in *in = (struct stream_in *)stream;
+    struct audio_device *adev = in->dev;
+    struct str_parms *query = str_parms_create_str(keys);
+    struct str_parms *reply = str_parms_create();
+    char *str;
+
+    pthread_mutex_lock(&adev->lock);
+    add_sup_parameters(query, reply, PCM_DEVICE, PCM_IN, adev->in_device,
+                       in->requested_rate, in_channel_masks(adev->in_device),
+                       "AUDIO_FORMAT_PCM_16_BIT|AUDIO_FORMAT_PCM_FLOAT");
+    pthread_mutex_unlock(&adev->lock);
+
+    str = str_parms_to_str(reply);
+    str_parms_destroy(query);
+    str_parms_destroy(reply);
+    return str;
+}
+
+/* moves the input gain towards what the volume and the mic mute ask for */
+static void in_update_gain(struct stream_in *in)
+{
+    float gain = in->muted ? 0.0f : in->volume;
+
+    audio_gain_set(&in->gain, gain, gain,
+                   in->standby ? 0 : in->requested_rate * GAIN_RAMP_MS / 1000);
 }
 
-static int in_set_gain(struct audio_stream_in *stream __unused, float gain __unused)
+/* the gain only attenuates, anything above 1 is taken as 1 */
+static int in_set_gain(struct audio_stream_in *stream, float gain)
 {
+    struct stream_in *in = (struct stream_in *)stream;
+
+    pthread_mutex_lock(&in->lock);
+    in->volume = gain;
+    in_update_gain(in);
+    pthread_mutex_unlock(&in->lock);
     return 0;
 }
 
@@ -1295,27 +3686,52 @@ static ssize_t in_read(struct audio_stream_in *stream, void* buffer,
     struct stream_in *in = (struct stream_in *)stream;
     struct audio_device *adev = in->dev;
     size_t frames_rq = bytes / audio_stream_in_frame_size(stream);
+    bool to_float = in->format == AUDIO_FORMAT_PCM_FLOAT;
+    int64_t start_ns = monotonic_ns();
+    bool muted;
 
-    /*
-     * acquiring hw device mutex systematically is useful if a low
-     * priority thread is waiting on the input stream mutex - e.g.
-     * executing in_set_parameters() while holding the hw device
-     * mutex
-     */
-    pthread_mutex_lock(&adev->lock);
-    pthread_mutex_lock(&in->lock);
+    audio_thread_lock(adev, &in->lock, "in->lock");
     if (in->standby) {
-        ret = start_input_stream(in);
-        if (ret == 0)
-            in->standby = 0;
+        /* adev->lock comes first, see out_write() */
+        pthread_mutex_unlock(&in->lock);
+        audio_thread_lock(adev, &adev->lock, "adev->lock");
+        pthread_mutex_lock(&in->lock);
+        if (in->standby) {
+            ret = start_input_stream(in);
+            if (ret == 0) {
+                in->standby = 0;
+                audio_stats_count(&in->stats.resumes);
+            }
+        }
+        pthread_mutex_unlock(&adev->lock);
     }
-    pthread_mutex_unlock(&adev->lock);
 
     if (ret < 0)
         goto exit;
 
-    if (in->num_preprocessors != 0) {
+    muted = atomic_load_explicit(&adev->state, memory_order_acquire) & ADEV_STATE_MIC_MUTE;
+    if (muted != in->muted) {
+        in->muted = muted;
+        in_update_gain(in);
+    }
+
+    /*
+     * Once the mute ramp is done, the PCM is still read to keep the timing
+     * but the effects are skipped. Otherwise keep going through the staging
+     * after the last effect is removed until it is drained.
+     */
+    if (audio_gain_is_mute(&in->gain)) {
+        ret = read_frames(in, buffer, frames_rq);
+        memset(buffer, 0, bytes);
+        to_float = false;
+    } else if (in->num_preprocessors != 0 || in->proc_frames_in != 0 ||
+            in->proc_out_frames != 0) {
         ret = process_frames(in, buffer, frames_rq);
+    } else if (to_float && in->resampler == NULL) {
+        ret = read_frames_float(in, buffer, frames_rq);
+        if (ret >= 0 && !audio_gain_is_unity(&in->gain))
+            audio_gain_apply_float(&in->gain, buffer, buffer, frames_rq, in->channels);
+        to_float = false;
     } else {
         ret = read_frames(in, buffer, frames_rq);
     }
@@ -1324,11 +3740,19 @@ static ssize_t in_read(struct audio_stream_in *stream, void* buffer,
         ret = 0;
 
     /*
-     * Instead of writing zeroes here, we could trust the hardware
-     * to always provide zeroes when muted.
+     * A float stream got 16 bit frames in the first half of the buffer: it
+     * has effects, which only take 16 bit, or a resampler a routing change
+     * brought in after open. A float stream is only opened at a rate the
+     * card runs, see check_in_format().
      */
-    if (ret == 0 && adev->mic_mute)
-        memset(buffer, 0, bytes);
+    if (ret == 0 && to_float) {
+        if (!audio_gain_is_unity(&in->gain))
+            audio_gain_apply(&in->gain, buffer, buffer, frames_rq, in->channels);
+        audio_float_from_i16(buffer, buffer, frames_rq * in->channels);
+    } else if (ret == 0 && in->format != AUDIO_FORMAT_PCM_FLOAT &&
+            !audio_gain_is_unity(&in->gain)) {
+        audio_gain_apply(&in->gain, buffer, buffer, frames_rq, in->channels);
+    }
 
 exit:
     if (ret < 0)
@@ -1336,12 +3760,45 @@ exit:
                in_get_sample_rate(&stream->common));
 
     pthread_mutex_unlock(&in->lock);
+    audio_stats_add_call(&in->stats, monotonic_ns() - start_ns);
     return bytes;
 }
 
-static uint32_t in_get_input_frames_lost(struct audio_stream_in *stream __unused)
+static uint32_t in_get_input_frames_lost(struct audio_stream_in *stream)
 {
-    return 0;
+    struct stream_in *in = (struct stream_in *)stream;
+    uint32_t lost;
+
+    pthread_mutex_lock(&in->lock);
+    lost = (uint64_t)in->frames_lost * in->requested_rate / in->pcm_config.rate;
+    in->frames_lost = 0;
+    pthread_mutex_unlock(&in->lock);
+
+    return lost;
+}
+
+static int in_get_capture_position(const struct audio_stream_in *stream,
+                                   int64_t *frames, int64_t *time)
+{
+    struct stream_in *in = (struct stream_in *)stream;
+    struct timespec ts;
+    unsigned int avail;
+    int ret = -ENOSYS;
+
+    if (frames == NULL || time == NULL)
+        return -EINVAL;
+
+    pthread_mutex_lock(&in->lock);
+    if (in->pcm && pcm_get_htimestamp(in->pcm, &avail, &ts) == 0) {
+        /* frames received so far, including the ones still in the kernel buffer */
+        *frames = in->frames_read_base +
+                (in->frames_read + avail) * in->requested_rate / in->pcm_config.rate;
+        *time = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&in->lock);
+
+    return ret;
 }
 
 static int in_add_audio_effect(const struct audio_stream *stream,
@@ -1357,7 +3814,15 @@ static int in_add_audio_effect(const struct audio_stream *stream,
         goto exit;
     }
 
-    in->preprocessors[in->num_preprocessors++] = effect;
+    /* allocate the staging here so that in_read() never has to */
+    status = in_alloc_proc_buffers(in);
+    if (status != 0)
+        goto exit;
+
+    /* effects can come and go while capturing, the chain picks them up
+     * from the next chunk */
+    memset(&in->preprocessors[in->num_preprocessors], 0, sizeof(in->preprocessors[0]));
+    in->preprocessors[in->num_preprocessors++].handle = effect;
 
 exit:
 
@@ -1385,8 +3850,7 @@ static int in_remove_audio_effect(const struct audio_stream *stream,
             in->preprocessors[i - 1] = in->preprocessors[i];
             continue;
         }
-        if (in->preprocessors[i] == effect) {
-            in->preprocessors[i] = NULL;
+        if (in->preprocessors[i].handle == effect) {
             status = 0;
         }
     }
@@ -1406,7 +3870,7 @@ exit:
 static int adev_open_output_stream(struct audio_hw_device *dev,
                                    audio_io_handle_t handle __unused,
                                    audio_devices_t devices __unused,
-                                   audio_output_flags_t flags __unused,
+                                   audio_output_flags_t flags,
                                    struct audio_config *config,
                                    struct audio_stream_out **stream_out,
                                    const char *address __unused)
@@ -1439,17 +3903,71 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
     out->stream.write = out_write;
     out->stream.get_render_position = out_get_render_position;
     out->stream.get_next_write_timestamp = out_get_next_write_timestamp;
+    out->stream.get_presentation_position = out_get_presentation_position;
+
+    if (flags & AUDIO_OUTPUT_FLAG_MMAP_NOIRQ) {
+        out->mmap = true;
+        out->stream.start = out_start;
+        out->stream.stop = out_stop;
+        out->stream.create_mmap_buffer = out_create_mmap_buffer;
+        out->stream.get_mmap_position = out_get_mmap_position;
+    } else if (flags & AUDIO_OUTPUT_FLAG_DEEP_BUFFER) {
+        out->deep_buffer = true;
+    }
 
     out->dev = adev;
 
+    /*
+     * Run at the rate asked for when the card has it, so that the PCM is
+     * opened at the stream rate and nothing gets resampled. Otherwise keep
+     * 48 kHz, or whatever the card has closest to it.
+     */
+    struct audio_pcm_caps caps;
+    unsigned int pcm_device = (adev->out_device & AUDIO_DEVICE_OUT_AUX_DIGITAL) ?
+            PCM_DEVICE_HDMI : PCM_DEVICE;
+    out->sample_rate = OUT_SAMPLING_RATE;
+    if (get_pcm_caps(pcm_device, PCM_OUT, adev->out_device, &caps) == 0 && caps.num_rates > 0) {
+        if (config->sample_rate != 0 && caps_has_rate(&caps, config->sample_rate))
+            out->sample_rate = config->sample_rate;
+        else
+            out->sample_rate = caps_pick_rate(&caps, OUT_SAMPLING_RATE);
+    }
+
+    /* the frames of an MMAP_NOIRQ stream never go through the conversions */
+    out->format = !out->mmap && out_format_is_hires(config->format) ?
+            config->format : AUDIO_FORMAT_PCM_16_BIT;
     config->format = out_get_format(&out->stream.common);
     config->channel_mask = out_get_channels(&out->stream.common);
     config->sample_rate = out_get_sample_rate(&out->stream.common);
 
     out->standby = true;
+    audio_gain_set(&out->gain, 1.0f, 1.0f, 0);
+
+    char pacing[PROPERTY_VALUE_MAX];
+    property_get("hal.audio.out.pacing", pacing, "sleep");
+    out->pacing = out_pacing_from_string(pacing);
+
+    /* deep buffers are about fewer wakeups, they keep their thresholds */
+    char threshold[PROPERTY_VALUE_MAX];
+    property_get("hal.audio.out.threshold", threshold, "fixed");
+    out->adaptive = !out->deep_buffer && strcmp(threshold, "adaptive") == 0;
+    out->adapt_floor_ms = property_get_int32("hal.audio.out.threshold.floor_ms", ADAPT_FLOOR_MS);
+    out->adapt_ceiling_ms = property_get_int32("hal.audio.out.threshold.ceiling_ms", 0);
+    if (out->adapt_floor_ms < 0)
+        out->adapt_floor_ms = 0;
+    if (out->adapt_ceiling_ms < 0)
+        out->adapt_ceiling_ms = 0;
+    out->adapt_threshold = OUT_PERIOD_SIZE * OUT_SHORT_PERIOD_COUNT;
+    out->adapt_stable_ns = ADAPT_STABLE_MS * 1000000LL;
+    out->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (out->timer_fd < 0) {
+        ALOGW("timerfd_create failed: %s, timer pacing not available", strerror(errno));
+    }
 
-    int res = pthread_mutex_init(&(out->lock), NULL);
+    int res = init_pi_mutex(&out->lock);
     if(res != 0){
+        if (out->timer_fd >= 0)
+            close(out->timer_fd);
         free(out);
         return -ENOMEM;
     }
@@ -1468,6 +3986,14 @@ static void adev_close_output_stream(struct audio_hw_device *dev __unused,
     struct stream_out *out = (struct stream_out *)stream;
     out_standby(&stream->common);
 
+    if (out->timer_fd >= 0)
+        close(out->timer_fd);
+    if (out->resampler)
+        release_resampler(out->resampler);
+    free(out->buffer);
+    free(out->conv_buffer);
+    free(out->float_buffer);
+    free(out->mix_queue);
     pthread_mutex_destroy(&(out->lock));
 
     free(stream);
@@ -1485,10 +4011,10 @@ static int adev_set_parameters(struct audio_hw_device *dev, const char *kvpairs)
 
     ret = str_parms_get_str(parms, "screen_state", value, sizeof(value));
     if (ret >= 0) {
-        if (strcmp(value, AUDIO_PARAMETER_VALUE_ON) == 0)
-            adev->screen_off = false;
-        else
-            adev->screen_off = true;
+        pthread_mutex_lock(&adev->lock);
+        adev->screen_off = strcmp(value, AUDIO_PARAMETER_VALUE_ON) != 0;
+        adev_set_state(adev, ADEV_STATE_SCREEN_OFF, adev->screen_off);
+        pthread_mutex_unlock(&adev->lock);
     }
 
     str_parms_destroy(parms);
@@ -1525,7 +4051,10 @@ static int adev_set_mic_mute(struct audio_hw_device *dev, bool state)
 {
     struct audio_device *adev = (struct audio_device *)dev;
 
+    pthread_mutex_lock(&adev->lock);
     adev->mic_mute = state;
+    adev_set_state(adev, ADEV_STATE_MIC_MUTE, state);
+    pthread_mutex_unlock(&adev->lock);
 
     return 0;
 }
@@ -1552,7 +4081,7 @@ static size_t adev_get_input_buffer_size(const struct audio_hw_device *dev __unu
     size = (pcm_config_in.period_size * config->sample_rate) / pcm_config_in.rate;
     size = ((size + 15) / 16) * 16;
 
-    return (size * popcount(config->channel_mask) *
+    return (size * audio_channel_count_from_in_mask(config->channel_mask) *
                 audio_bytes_per_sample(config->format));
 }
 
@@ -1563,7 +4092,7 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
                                   struct audio_stream_in **stream_in,
                                   audio_input_flags_t flags __unused,
                                   const char *address __unused,
-                                  audio_source_t source __unused)
+                                  audio_source_t source)
 
 {
     struct audio_device *adev = (struct audio_device *)dev;
@@ -1572,11 +4101,13 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
 
     *stream_in = NULL;
 
-    /* Respond with a request for mono if a different format is given. */
-    if (config->channel_mask != AUDIO_CHANNEL_IN_MONO) {
-        config->channel_mask = AUDIO_CHANNEL_IN_MONO;
-        return -EINVAL;
-    }
+    /* Respond with a request for a mask the card can take if it can't. */
+    ret = check_in_channel_mask(adev, config);
+    if (ret != 0)
+        return ret;
+    ret = check_in_format(adev, config);
+    if (ret != 0)
+        return ret;
 
     in = (struct stream_in *)calloc(1, sizeof(struct stream_in));
     if (!in)
@@ -1597,13 +4128,23 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
     in->stream.set_gain = in_set_gain;
     in->stream.read = in_read;
     in->stream.get_input_frames_lost = in_get_input_frames_lost;
+    in->stream.get_capture_position = in_get_capture_position;
 
     in->dev = adev;
     in->standby = true;
     in->requested_rate = config->sample_rate;
+    in->channel_mask = config->channel_mask;
+    in->channels = audio_channel_count_from_in_mask(config->channel_mask);
+    /* any format but float is answered with 16 bit */
+    in->format = config->format == AUDIO_FORMAT_PCM_FLOAT ?
+            AUDIO_FORMAT_PCM_FLOAT : AUDIO_FORMAT_PCM_16_BIT;
+    in->source = source;
     in->pcm_config = pcm_config_in; /* default PCM config */
+    in->volume = 1.0f;
+    in->muted = atomic_load(&adev->state) & ADEV_STATE_MIC_MUTE;
+    audio_gain_set(&in->gain, in->muted ? 0.0f : 1.0f, in->muted ? 0.0f : 1.0f, 0);
 
-    int res = pthread_mutex_init(&(in->lock), NULL);
+    int res = init_pi_mutex(&in->lock);
     if(res != 0){
         free(in);
         return -ENOMEM;
@@ -1619,13 +4160,37 @@ static void adev_close_input_stream(struct audio_hw_device *dev __unused,
     struct stream_in *in = (struct stream_in *)stream;
     in_standby(&stream->common);
 
+    if (in->resampler)
+        release_resampler(in->resampler);
+    free(in->buffer);
+    free(in->conv_buffer);
+    free(in->proc_buf);
+    free(in->proc_out_buf);
+    free(in->chain_buf[0]);
+    free(in->chain_buf[1]);
     pthread_mutex_destroy(&(in->lock));
 
     free(stream);
 }
 
-static int adev_dump(const audio_hw_device_t *device __unused, int fd __unused)
+static int adev_dump(const audio_hw_device_t *device, int fd)
 {
+    struct audio_device *adev = (struct audio_device *)device;
+    unsigned int state = atomic_load_explicit(&adev->state, memory_order_acquire);
+
+    dprintf(fd, "  primary audio device: out %#x, in %#x%s%s\n",
+            adev->out_device, adev->in_device,
+            (state & ADEV_STATE_SCREEN_OFF) ? ", screen off" : "",
+            (state & ADEV_STATE_MIC_MUTE) ? ", mic muted" : "");
+    dprintf(fd, "    %u outputs on the shared PCM%s\n", adev->num_outputs,
+            adev->mmap_out ? ", one mmap output" : "");
+    if (adev->out_pcm)
+        dprintf(fd, "    shared PCM: %u Hz, %u channels, format %d, %u periods of %u frames\n",
+                adev->out_pcm_config.rate, adev->out_pcm_config.channels,
+                adev->out_pcm_config.format, adev->out_pcm_config.period_count,
+                adev->out_pcm_config.period_size);
+    dprintf(fd, "    route queue: %u bringups pending%s\n", adev->route_count,
+            adev->route_queued ? ", routing pending" : "");
     return 0;
 }
 
@@ -1633,10 +4198,32 @@ static int adev_close(hw_device_t *device)
 {
     struct audio_device *adev = (struct audio_device *)device;
 
-    audio_route_free(adev->ar);
+    audio_cards_remove_listener(cards_changed, adev);
+
+    /* what is still queued is dropped */
+    pthread_mutex_lock(&adev->route_lock);
+    adev->route_exit = true;
+    pthread_cond_signal(&adev->route_cond);
+    pthread_mutex_unlock(&adev->route_lock);
+    pthread_join(adev->route_thread, NULL);
+    warm_pcm_close(&adev->warm_out);
+    warm_pcm_close(&adev->warm_in);
+
+    for (int i = 0; i < BRINGUP_SLOT_COUNT; i++)
+        bringup_script_free(adev->bringup[i]);
+    for (unsigned int i = 0; i < adev->num_routes; i++)
+        if (adev->routes[i].ar)
+            audio_route_free(adev->routes[i].ar);
+    audio_cards_release();
 
     pthread_mutex_destroy(&(adev->lock));
-    pthread_mutex_destroy(&prop_command_lock);
+    pthread_mutex_destroy(&adev->out_write_lock);
+    pthread_mutex_destroy(&adev->mix_lock);
+    pthread_cond_destroy(&adev->mix_cond);
+    pthread_mutex_destroy(&adev->route_lock);
+    pthread_cond_destroy(&adev->route_cond);
+    free(adev->mix_buffer);
+    free(adev->mix_conv_buffer);
 
     free(device);
     return 0;
@@ -1675,25 +4262,95 @@ static int adev_open(const hw_module_t* module, const char* name,
     adev->hw_device.close_input_stream = adev_close_input_stream;
     adev->hw_device.dump = adev_dump;
 
-    adev->ar = audio_route_init();
+    /* scan the sound cards once, audio_route_init() already needs them */
+    audio_cards_init();
+    refresh_routes(adev);
 
     adev->out_device = AUDIO_DEVICE_OUT_SPEAKER;
     adev->in_device = AUDIO_DEVICE_IN_BUILTIN_MIC & ~AUDIO_DEVICE_BIT_IN;
 
-    int res = pthread_mutex_init(&(adev->lock), NULL);
-    if(res != 0){
-        free(adev);
-        return -ENOMEM;
+    int res = init_pi_mutex(&adev->lock);
+    if (res != 0)
+        goto err_routes;
+    res = init_pi_mutex(&adev->out_write_lock);
+    if (res != 0)
+        goto err_lock;
+    res = init_pi_mutex(&adev->mix_lock);
+    if (res != 0)
+        goto err_write_lock;
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&adev->mix_cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+
+    adev->single_rate_group = property_get_bool("hal.audio.single_rate_group", false);
+    for (int i = 0; i < RESAMPLER_TIER_COUNT; i++) {
+        int quality = property_get_int32(resampler_tiers[i].prop, resampler_tiers[i].quality);
+        if (quality < RESAMPLER_QUALITY_MIN || quality > RESAMPLER_QUALITY_MAX) {
+            ALOGW("%s: quality %d is out of range", resampler_tiers[i].prop, quality);
+            quality = resampler_tiers[i].quality;
+        }
+        adev->resampler_quality[i] = quality;
     }
-    res = pthread_mutex_init(&prop_command_lock, NULL);
-    if(res != 0){
-        free(adev);
-        return -ENOMEM;
+
+    adev->lock_warn_ns = (int64_t)property_get_int32("hal.audio.lock_warn_us", 2000) * 1000;
+
+    adev->warm_standby_ns =
+            (int64_t)property_get_int32("hal.audio.warm_standby_ms", 3000) * 1000000;
+    if (adev->warm_standby_ns < 0)
+        adev->warm_standby_ns = 0;
+
+    /* the bringup commands are compiled once, changing them needs a restart */
+    for (int i = 0; i < BRINGUP_SLOT_COUNT; i++) {
+        char command[PROPERTY_VALUE_MAX];
+
+        if (property_get(bringup_slots[i].prop, command, NULL) <= 0)
+            continue;
+        adev->bringup[i] = bringup_script_parse(command);
+        if (adev->bringup[i] && bringup_script_is_shell(adev->bringup[i]))
+            ALOGW("%s runs through a shell: {%s}", bringup_slots[i].prop, command);
+    }
+
+    res = init_pi_mutex(&adev->route_lock);
+    if (res != 0)
+        goto err_bringup;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&adev->route_cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+    res = pthread_create(&adev->route_thread, NULL, route_thread, adev);
+    if (res != 0) {
+        ALOGE("unable to start the route thread: %s", strerror(res));
+        goto err_route_lock;
     }
+    if (audio_cards_add_listener(cards_changed, adev) < 0)
+        ALOGW("no sound card listener left, new cards are routed on the next routing change");
 
     *device = &adev->hw_device.common;
 
     return 0;
+
+    /* undone in the reverse order of the above */
+err_route_lock:
+    pthread_cond_destroy(&adev->route_cond);
+    pthread_mutex_destroy(&adev->route_lock);
+err_bringup:
+    for (int i = 0; i < BRINGUP_SLOT_COUNT; i++)
+        bringup_script_free(adev->bringup[i]);
+    pthread_cond_destroy(&adev->mix_cond);
+    pthread_mutex_destroy(&adev->mix_lock);
+err_write_lock:
+    pthread_mutex_destroy(&adev->out_write_lock);
+err_lock:
+    pthread_mutex_destroy(&adev->lock);
+err_routes:
+    for (unsigned int i = 0; i < adev->num_routes; i++)
+        if (adev->routes[i].ar)
+            audio_route_free(adev->routes[i].ar);
+    audio_cards_release();
+    free(adev);
+    return -ENOMEM;
 }
 
 static struct hw_module_methods_t hal_module_methods = {
@@ -18,11 +18,19 @@
 #define LOG_TAG "audio_hw_primary"
 /*#define LOG_NDEBUG 0*/
 
+#include <ctype.h>
 #include <errno.h>
 #include <expat.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <cutils/log.h>
 
@@ -30,25 +38,36 @@
 #include <tinyalsa/asoundlib.h>
 
 #define BUF_SIZE 1024
-#define MIXER_XML_PATH "/system/etc/mixer_paths.xml"
+/* the paths of the mixer xml, resolved against the ctls of a card */
+#ifndef MIXER_CACHE_PATH
+#define MIXER_CACHE_PATH "/data/misc/audio/mixer_paths.card%u.cache"
+#endif
 #define INITIAL_MIXER_PATH_SIZE 8
-
-struct snd_pcm_info *select_card(unsigned int device __unused, unsigned int flags);
+/* ctls with more values than this are not routed, it bounds the scratch below */
+#define MAX_CTL_VALUES 4096
+#define PATH_HASH_SIZE 64 /* must be a power of 2 */
 
 struct mixer_state {
     struct mixer_ctl *ctl;
-    int old_value;
-    int new_value;
-    int reset_value;
+    enum mixer_ctl_type type;
+    unsigned int num_values; /* 0 for the types we don't route */
+    /* one entry per value of the ctl, all carved out of audio_route.value_pool */
+    int *old_value;
+    int *new_value;
+    int *reset_value;
+    bool dirty;  /* new_value changed since the last update_mixer_state() */
+    bool active; /* set by a path since the last reset_mixer_state() */
+    bool loaded; /* the values were read, see load_ctl() */
 };
 
 struct mixer_setting {
-    struct mixer_ctl *ctl;
-    int value;
+    unsigned int ctl_index; /* index in mixer_state, resolved at parse time */
+    int *value; /* mixer_state.num_values entries */
 };
 
 struct mixer_path {
     char *name;
+    unsigned int hash_next; /* 1 + index of the next path in the same bucket, 0 ends */
     unsigned int size;
     unsigned int length;
     struct mixer_setting *setting;
@@ -58,10 +77,31 @@ struct audio_route {
     struct mixer *mixer;
     unsigned int num_mixer_ctls;
     struct mixer_state *mixer_state;
+    /* open addressing table of 1 + mixer_state index, keyed by ctl name */
+    unsigned int *ctl_hash;
+    unsigned int ctl_hash_size;
+    /* mixer_state indices of the dirty and the active ctls */
+    unsigned int *dirty_ctls;
+    unsigned int num_dirty_ctls;
+    unsigned int *active_ctls;
+    unsigned int num_active_ctls;
+    int *value_pool;
+    /* scratch for mixer_ctl_get_array()/mixer_ctl_set_array() */
+    void *ctl_buf;
+    /* scratch for parse_ctl_values(), as many values as the largest ctl */
+    int *parse_buf;
 
     unsigned int mixer_path_size;
     unsigned int num_mixer_paths;
     struct mixer_path *mixer_path;
+    /* 1 + index of the first path in each bucket, 0 if empty */
+    unsigned int path_hash[PATH_HASH_SIZE];
+
+    /* when the paths come from the cache, their names and values point
+     * into cache_map and their settings into cache_settings */
+    void *cache_map;
+    size_t cache_size;
+    struct mixer_setting *cache_settings;
 };
 
 struct config_parse_state {
@@ -70,6 +110,18 @@ struct config_parse_state {
     int level;
 };
 
+/* FNV-1a */
+static unsigned int name_hash(const char *name)
+{
+    unsigned int hash = 2166136261u;
+
+    while (*name) {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
 /* path functions */
 
 static struct mixer_path *path_get_by_name(struct audio_route *ar,
@@ -81,9 +133,10 @@ static struct mixer_path *path_get_by_name(struct audio_route *ar,
         return NULL;
     }
 
-    for (i = 0; i < ar->num_mixer_paths; i++)
-        if (strcmp(ar->mixer_path[i].name, name) == 0)
-            return &ar->mixer_path[i];
+    for (i = ar->path_hash[name_hash(name) & (PATH_HASH_SIZE - 1)]; i;
+            i = ar->mixer_path[i - 1].hash_next)
+        if (strcmp(ar->mixer_path[i - 1].name, name) == 0)
+            return &ar->mixer_path[i - 1];
 
     return NULL;
 }
@@ -119,11 +172,14 @@ static struct mixer_path *path_create(struct audio_route *ar, const char *name)
         }
     }
 
-    /* initialise the new mixer path */
+    /* initialise the new mixer path, and link it in its hash bucket */
+    unsigned int bucket = name_hash(name) & (PATH_HASH_SIZE - 1);
     ar->mixer_path[ar->num_mixer_paths].name = strdup(name);
+    ar->mixer_path[ar->num_mixer_paths].hash_next = ar->path_hash[bucket];
     ar->mixer_path[ar->num_mixer_paths].size = 0;
     ar->mixer_path[ar->num_mixer_paths].length = 0;
     ar->mixer_path[ar->num_mixer_paths].setting = NULL;
+    ar->path_hash[bucket] = ar->num_mixer_paths + 1;
 
     /* return the mixer path just added, then increment number of them */
     return &ar->mixer_path[ar->num_mixer_paths++];
@@ -135,20 +191,20 @@ static bool path_setting_exists(struct mixer_path *path,
     unsigned int i;
 
     for (i = 0; i < path->length; i++)
-        if (path->setting[i].ctl == setting->ctl)
+        if (path->setting[i].ctl_index == setting->ctl_index)
             return true;
 
     return false;
 }
 
-static int path_add_setting(struct mixer_path *path,
+static int path_add_setting(struct audio_route *ar, struct mixer_path *path,
                             struct mixer_setting *setting)
 {
     struct mixer_setting *new_path_setting;
 
     if (path_setting_exists(path, setting)) {
         ALOGE("Duplicate path setting '%s'",
-              mixer_ctl_get_name(setting->ctl));
+              mixer_ctl_get_name(ar->mixer_state[setting->ctl_index].ctl));
         return -1;
     }
 
@@ -170,50 +226,90 @@ static int path_add_setting(struct mixer_path *path,
     }
 
     /* initialise the new path setting */
-    path->setting[path->length].ctl = setting->ctl;
-    path->setting[path->length].value = setting->value;
+    size_t values_size = ar->mixer_state[setting->ctl_index].num_values * sizeof(int);
+    int *value = malloc(values_size);
+    if (value == NULL) {
+        ALOGE("Unable to allocate path setting values");
+        return -1;
+    }
+    memcpy(value, setting->value, values_size);
+    path->setting[path->length].ctl_index = setting->ctl_index;
+    path->setting[path->length].value = value;
     path->length++;
 
     return 0;
 }
 
-static int path_add_path(struct mixer_path *path, struct mixer_path *sub_path)
+static int path_add_path(struct audio_route *ar, struct mixer_path *path,
+                         struct mixer_path *sub_path)
 {
     unsigned int i;
 
     for (i = 0; i < sub_path->length; i++)
-        if (path_add_setting(path, &sub_path->setting[i]) < 0)
+        if (path_add_setting(ar, path, &sub_path->setting[i]) < 0)
             return -1;
 
     return 0;
 }
 
+/* remembers that a ctl needs to be looked at by update_mixer_state() */
+static void mark_ctl_dirty(struct audio_route *ar, unsigned int ctl_index)
+{
+    if (!ar->mixer_state[ctl_index].dirty) {
+        ar->mixer_state[ctl_index].dirty = true;
+        ar->dirty_ctls[ar->num_dirty_ctls++] = ctl_index;
+    }
+}
+
+/* remembers that a ctl may need to be reset by reset_mixer_state() */
+static void mark_ctl_active(struct audio_route *ar, unsigned int ctl_index)
+{
+    if (!ar->mixer_state[ctl_index].active) {
+        ar->mixer_state[ctl_index].active = true;
+        ar->active_ctls[ar->num_active_ctls++] = ctl_index;
+    }
+}
+
 static int path_apply(struct audio_route *ar, struct mixer_path *path)
 {
     unsigned int i;
-    unsigned int j;
 
     if (!ar) {
         ALOGE("%s: invalid audio_route", __FUNCTION__);
         return -1;
     }
 
+    /* the ctl indices were resolved when parsing, this is O(settings) */
     for (i = 0; i < path->length; i++) {
-        struct mixer_ctl *ctl = path->setting[i].ctl;
-
-        /* locate the mixer ctl in the list */
-        for (j = 0; j < ar->num_mixer_ctls; j++) {
-            if (ar->mixer_state[j].ctl == ctl)
-                break;
-        }
+        unsigned int ctl_index = path->setting[i].ctl_index;
+        struct mixer_state *ms = &ar->mixer_state[ctl_index];
 
-        /* apply the new value */
-        ar->mixer_state[j].new_value = path->setting[i].value;
+        memcpy(ms->new_value, path->setting[i].value, ms->num_values * sizeof(int));
+        mark_ctl_dirty(ar, ctl_index);
+        mark_ctl_active(ar, ctl_index);
     }
 
     return 0;
 }
 
+/* locates a mixer ctl by name, returns its mixer_state index or -1 */
+static int find_ctl_index(struct audio_route *ar, const char *name)
+{
+    unsigned int mask = ar->ctl_hash_size - 1;
+    unsigned int i;
+
+    if (!ar->ctl_hash_size)
+        return -1;
+
+    for (i = name_hash(name) & mask; ar->ctl_hash[i]; i = (i + 1) & mask) {
+        unsigned int index = ar->ctl_hash[i] - 1;
+        if (strcmp(mixer_ctl_get_name(ar->mixer_state[index].ctl), name) == 0)
+            return index;
+    }
+
+    return -1;
+}
+
 /* mixer helper function */
 static int mixer_enum_string_to_value(struct mixer_ctl *ctl, const char *string)
 {
@@ -228,6 +324,96 @@ static int mixer_enum_string_to_value(struct mixer_ctl *ctl, const char *string)
     return i;
 }
 
+/*
+ * Parses the value attribute of a ctl into one entry per value of the ctl.
+ * Enums take a single enum string. Other ctls take a list of numbers
+ * separated by spaces or commas, e.g. "87 80" for an asymmetric stereo gain
+ * or "0x01,0x7f,..." for a byte blob; the last number given is repeated
+ * over the remaining values, so "87" still sets every channel. The numbers
+ * past the last value are ignored, one xml may serve mono and stereo cards;
+ * with exact they are an error, like anything else that is not a number.
+ */
+static int parse_ctl_values(struct mixer_state *ms, const char *str, int *values,
+                            bool exact)
+{
+    unsigned int i;
+    unsigned int n = 0;
+
+    if (ms->type == MIXER_CTL_TYPE_ENUM) {
+        values[0] = mixer_enum_string_to_value(ms->ctl, str);
+        n = 1;
+    } else {
+        while (n < ms->num_values) {
+            char *end;
+            long value;
+
+            while (isspace((unsigned char)*str) || *str == ',')
+                str++;
+            if (*str == '\0')
+                break;
+            value = strtol(str, &end, 0);
+            if (end == str)
+                break;
+            values[n++] = value;
+            str = end;
+        }
+        while (isspace((unsigned char)*str) || *str == ',')
+            str++;
+        if (exact && *str != '\0')
+            return -1;
+    }
+
+    if (n == 0)
+        return -1;
+    for (i = n; i < ms->num_values; i++)
+        values[i] = values[n - 1];
+
+    return 0;
+}
+
+/* reads all the values of a ctl, with a single ioctl when the type allows it */
+static void mixer_ctl_read(struct audio_route *ar, struct mixer_state *ms,
+                           int *values)
+{
+    unsigned int j;
+
+    switch (ms->type) {
+    case MIXER_CTL_TYPE_BOOL:
+    case MIXER_CTL_TYPE_INT:
+        if (mixer_ctl_get_array(ms->ctl, ar->ctl_buf, ms->num_values) == 0) {
+            for (j = 0; j < ms->num_values; j++)
+                values[j] = ((long *)ar->ctl_buf)[j];
+            return;
+        }
+        break;
+    case MIXER_CTL_TYPE_BYTE:
+        if (mixer_ctl_get_array(ms->ctl, ar->ctl_buf, ms->num_values) == 0) {
+            for (j = 0; j < ms->num_values; j++)
+                values[j] = ((unsigned char *)ar->ctl_buf)[j];
+            return;
+        }
+        break;
+    default:
+        break;
+    }
+
+    for (j = 0; j < ms->num_values; j++)
+        values[j] = mixer_ctl_get_value(ms->ctl, j);
+}
+
+/* reads a ctl from the mixer the first time it is used */
+static void load_ctl(struct audio_route *ar, unsigned int ctl_index)
+{
+    struct mixer_state *ms = &ar->mixer_state[ctl_index];
+
+    if (ms->loaded)
+        return;
+    mixer_ctl_read(ar, ms, ms->old_value);
+    memcpy(ms->new_value, ms->old_value, ms->num_values * sizeof(int));
+    memcpy(ms->reset_value, ms->old_value, ms->num_values * sizeof(int));
+    ms->loaded = true;
+}
+
 static void start_tag(void *data, const XML_Char *tag_name,
                       const XML_Char **attr)
 {
@@ -236,9 +422,10 @@ static void start_tag(void *data, const XML_Char *tag_name,
     struct config_parse_state *state = data;
     struct audio_route *ar = state->ar;
     unsigned int i;
-    struct mixer_ctl *ctl;
-    int value;
+    struct mixer_state *ms;
+    int ctl_index;
     struct mixer_setting mixer_setting;
+    int *values;
 
     /* Get name, type and value attributes (these may be empty) */
     for (i = 0; attr[i]; i += 2) {
@@ -259,46 +446,47 @@ static void start_tag(void *data, const XML_Char *tag_name,
             } else {
                 /* nested path */
                 struct mixer_path *sub_path = path_get_by_name(ar, attr_name);
-                path_add_path(state->path, sub_path);
+                if (!sub_path)
+                    ALOGE("unable to find sub path '%s'", attr_name);
+                else if (state->path)
+                    path_add_path(ar, state->path, sub_path);
             }
         }
     }
 
     else if (strcmp(tag_name, "ctl") == 0) {
         /* Obtain the mixer ctl and value */
-        ctl = mixer_get_ctl_by_name(ar->mixer, attr_name);
-        switch (mixer_ctl_get_type(ctl)) {
-        case MIXER_CTL_TYPE_BOOL:
-        case MIXER_CTL_TYPE_INT:
-            value = atoi((char *)attr_value);
-            break;
-        case MIXER_CTL_TYPE_ENUM:
-            value = mixer_enum_string_to_value(ctl, (char *)attr_value);
-            break;
-        default:
-            value = 0;
-            break;
+        ctl_index = attr_name ? find_ctl_index(ar, attr_name) : -1;
+        if (ctl_index < 0) {
+            ALOGE("Control '%s' doesn't exist - skipping", attr_name ? attr_name : "");
+            goto done;
+        }
+        ms = &ar->mixer_state[ctl_index];
+        if (ms->num_values == 0) {
+            ALOGE("Control '%s' has an unsupported type - skipping", attr_name);
+            goto done;
+        }
+        load_ctl(ar, ctl_index);
+
+        values = ar->parse_buf;
+        if (!attr_value || parse_ctl_values(ms, attr_value, values, false) < 0) {
+            ALOGE("Invalid value for control '%s' - skipping", attr_name);
+            goto done;
         }
 
         if (state->level == 1) {
             /* top level ctl (initial setting) */
-
-            /* locate the mixer ctl in the list */
-            for (i = 0; i < ar->num_mixer_ctls; i++) {
-                if (ar->mixer_state[i].ctl == ctl)
-                    break;
-            }
-
-            /* apply the new value */
-            ar->mixer_state[i].new_value = value;
-        } else {
+            memcpy(ms->new_value, values, ms->num_values * sizeof(int));
+            mark_ctl_dirty(ar, ctl_index);
+        } else if (state->path) {
             /* nested ctl (within a path) */
-            mixer_setting.ctl = ctl;
-            mixer_setting.value = value;
-            path_add_setting(state->path, &mixer_setting);
+            mixer_setting.ctl_index = ctl_index;
+            mixer_setting.value = values;
+            path_add_setting(ar, state->path, &mixer_setting);
         }
     }
 
+done:
     state->level++;
 }
 
@@ -312,6 +500,9 @@ static void end_tag(void *data, const XML_Char *tag_name __attribute__ ((__unuse
 static int alloc_mixer_state(struct audio_route *ar)
 {
     unsigned int i;
+    unsigned int num_values = 0;
+    unsigned int max_values = 0;
+    int *value;
 
     if (!ar) {
         ALOGE("%s: invalid audio_route", __FUNCTION__);
@@ -323,16 +514,116 @@ static int alloc_mixer_state(struct audio_route *ar)
     if (!ar->mixer_state)
         return -1;
 
+    /* keep the name table at most half full */
+    for (ar->ctl_hash_size = 16; ar->ctl_hash_size < ar->num_mixer_ctls * 2;)
+        ar->ctl_hash_size *= 2;
+    ar->ctl_hash = calloc(ar->ctl_hash_size, sizeof(unsigned int));
+    ar->dirty_ctls = malloc(ar->num_mixer_ctls * sizeof(unsigned int));
+    ar->active_ctls = malloc(ar->num_mixer_ctls * sizeof(unsigned int));
+    if (!ar->ctl_hash || !ar->dirty_ctls || !ar->active_ctls) {
+        free(ar->ctl_hash);
+        free(ar->dirty_ctls);
+        free(ar->active_ctls);
+        free(ar->mixer_state);
+        ar->mixer_state = NULL;
+        return -1;
+    }
+    ar->num_dirty_ctls = 0;
+    ar->num_active_ctls = 0;
+
+    for (i = 0; i < ar->num_mixer_ctls; i++) {
+        struct mixer_state *ms = &ar->mixer_state[i];
+
+        ms->ctl = mixer_get_ctl(ar->mixer, i);
+        ms->type = mixer_ctl_get_type(ms->ctl);
+        switch (ms->type) {
+        case MIXER_CTL_TYPE_BOOL:
+        case MIXER_CTL_TYPE_INT:
+        case MIXER_CTL_TYPE_ENUM:
+        case MIXER_CTL_TYPE_BYTE:
+            ms->num_values = mixer_ctl_get_num_values(ms->ctl);
+            if (ms->num_values > MAX_CTL_VALUES) {
+                ALOGW("ctl '%s' has %u values, more than %u: not routed",
+                      mixer_ctl_get_name(ms->ctl), ms->num_values, MAX_CTL_VALUES);
+                ms->num_values = 0;
+            }
+            break;
+        default:
+            ms->num_values = 0;
+            break;
+        }
+        num_values += ms->num_values;
+        if (max_values < ms->num_values)
+            max_values = ms->num_values;
+        ms->dirty = false;
+        ms->active = false;
+        ms->loaded = false;
+
+        /* like mixer_get_ctl_by_name(), the first ctl with a given name wins */
+        const char *name = mixer_ctl_get_name(ar->mixer_state[i].ctl);
+        if (find_ctl_index(ar, name) < 0) {
+            unsigned int mask = ar->ctl_hash_size - 1;
+            unsigned int slot = name_hash(name) & mask;
+            while (ar->ctl_hash[slot])
+                slot = (slot + 1) & mask;
+            ar->ctl_hash[slot] = i + 1;
+        }
+    }
+
+    ar->value_pool = malloc(num_values * 3 * sizeof(int));
+    ar->ctl_buf = malloc(max_values * sizeof(long));
+    ar->parse_buf = malloc(max_values * sizeof(int));
+    if ((num_values && !ar->value_pool) ||
+            (max_values && (!ar->ctl_buf || !ar->parse_buf))) {
+        free(ar->value_pool);
+        free(ar->ctl_buf);
+        free(ar->parse_buf);
+        free(ar->ctl_hash);
+        free(ar->dirty_ctls);
+        free(ar->active_ctls);
+        free(ar->mixer_state);
+        ar->mixer_state = NULL;
+        return -1;
+    }
+
+    value = ar->value_pool;
     for (i = 0; i < ar->num_mixer_ctls; i++) {
-        ar->mixer_state[i].ctl = mixer_get_ctl(ar->mixer, i);
-        /* only get value 0, assume multiple ctl values are the same */
-        ar->mixer_state[i].old_value = mixer_ctl_get_value(ar->mixer_state[i].ctl, 0);
-        ar->mixer_state[i].new_value = ar->mixer_state[i].old_value;
+        struct mixer_state *ms = &ar->mixer_state[i];
+
+        ms->old_value = value;
+        ms->new_value = value + ms->num_values;
+        ms->reset_value = value + ms->num_values * 2;
+        value += ms->num_values * 3;
     }
 
     return 0;
 }
 
+static void free_mixer_paths(struct audio_route *ar)
+{
+    unsigned int i;
+    unsigned int j;
+
+    if (ar->cache_map) {
+        free(ar->cache_settings);
+        ar->cache_settings = NULL;
+        munmap(ar->cache_map, ar->cache_size);
+        ar->cache_map = NULL;
+        ar->num_mixer_paths = 0;
+    }
+    for (i = 0; i < ar->num_mixer_paths; i++) {
+        for (j = 0; j < ar->mixer_path[i].length; j++)
+            free(ar->mixer_path[i].setting[j].value);
+        free(ar->mixer_path[i].name);
+        free(ar->mixer_path[i].setting);
+    }
+    free(ar->mixer_path);
+    ar->mixer_path = NULL;
+    ar->num_mixer_paths = 0;
+    ar->mixer_path_size = 0;
+    memset(ar->path_hash, 0, sizeof(ar->path_hash));
+}
+
 static void free_mixer_state(struct audio_route *ar)
 {
     if (!ar) {
@@ -341,28 +632,74 @@ static void free_mixer_state(struct audio_route *ar)
     }
     free(ar->mixer_state);
     ar->mixer_state = NULL;
+    free(ar->ctl_hash);
+    ar->ctl_hash = NULL;
+    ar->ctl_hash_size = 0;
+    free(ar->dirty_ctls);
+    ar->dirty_ctls = NULL;
+    free(ar->active_ctls);
+    ar->active_ctls = NULL;
+    free(ar->value_pool);
+    ar->value_pool = NULL;
+    free(ar->ctl_buf);
+    ar->ctl_buf = NULL;
+    free(ar->parse_buf);
+    ar->parse_buf = NULL;
+}
+
+/*
+ * writes the values of a ctl that differ from what the mixer holds, with a
+ * single ioctl when the type allows it
+ */
+static void mixer_ctl_write(struct audio_route *ar, struct mixer_state *ms)
+{
+    unsigned int j;
+
+    switch (ms->type) {
+    case MIXER_CTL_TYPE_BOOL:
+    case MIXER_CTL_TYPE_INT:
+        /* mixer_ctl_set_value() reads back the element before each write */
+        for (j = 0; j < ms->num_values; j++)
+            ((long *)ar->ctl_buf)[j] = ms->new_value[j];
+        if (mixer_ctl_set_array(ms->ctl, ar->ctl_buf, ms->num_values) == 0)
+            return;
+        break;
+    case MIXER_CTL_TYPE_BYTE:
+        for (j = 0; j < ms->num_values; j++)
+            ((unsigned char *)ar->ctl_buf)[j] = ms->new_value[j];
+        if (mixer_ctl_set_array(ms->ctl, ar->ctl_buf, ms->num_values) == 0)
+            return;
+        break;
+    default:
+        break;
+    }
+
+    for (j = 0; j < ms->num_values; j++)
+        if (ms->old_value[j] != ms->new_value[j])
+            mixer_ctl_set_value(ms->ctl, j, ms->new_value[j]);
 }
 
 void update_mixer_state(struct audio_route *ar)
 {
     unsigned int i;
-    unsigned int j;
 
     if (!ar) {
         ALOGE("%s: invalid audio_route", __FUNCTION__);
         return;
     }
 
-    for (i = 0; i < ar->num_mixer_ctls; i++) {
-        /* if the value has changed, update the mixer */
-        if (ar->mixer_state[i].old_value != ar->mixer_state[i].new_value) {
-            /* set all ctl values the same */
-            for (j = 0; j < mixer_ctl_get_num_values(ar->mixer_state[i].ctl); j++)
-                mixer_ctl_set_value(ar->mixer_state[i].ctl, j,
-                                    ar->mixer_state[i].new_value);
-            ar->mixer_state[i].old_value = ar->mixer_state[i].new_value;
+    /* only the ctls touched since the last update can have changed */
+    for (i = 0; i < ar->num_dirty_ctls; i++) {
+        struct mixer_state *ms = &ar->mixer_state[ar->dirty_ctls[i]];
+
+        /* if any value has changed, update the mixer */
+        if (memcmp(ms->old_value, ms->new_value, ms->num_values * sizeof(int))) {
+            mixer_ctl_write(ar, ms);
+            memcpy(ms->old_value, ms->new_value, ms->num_values * sizeof(int));
         }
+        ms->dirty = false;
     }
+    ar->num_dirty_ctls = 0;
 }
 
 /* saves the current state of the mixer, for resetting all controls */
@@ -375,10 +712,9 @@ static void save_mixer_state(struct audio_route *ar)
         return;
     }
 
-    for (i = 0; i < ar->num_mixer_ctls; i++) {
-        /* only get value 0, assume multiple ctl values are the same */
-        ar->mixer_state[i].reset_value = mixer_ctl_get_value(ar->mixer_state[i].ctl, 0);
-    }
+    for (i = 0; i < ar->num_mixer_ctls; i++)
+        if (ar->mixer_state[i].loaded)
+            mixer_ctl_read(ar, &ar->mixer_state[i], ar->mixer_state[i].reset_value);
 }
 
 /* this resets all mixer settings to the saved values */
@@ -391,9 +727,18 @@ void reset_mixer_state(struct audio_route *ar)
         return;
     }
 
-    /* load all of the saved values */
-    for (i = 0; i < ar->num_mixer_ctls; i++)
-        ar->mixer_state[i].new_value = ar->mixer_state[i].reset_value;
+    /* load the saved values, only the ctls set by a path can differ */
+    for (i = 0; i < ar->num_active_ctls; i++) {
+        unsigned int ctl_index = ar->active_ctls[i];
+        struct mixer_state *ms = &ar->mixer_state[ctl_index];
+
+        if (memcmp(ms->new_value, ms->reset_value, ms->num_values * sizeof(int))) {
+            memcpy(ms->new_value, ms->reset_value, ms->num_values * sizeof(int));
+            mark_ctl_dirty(ar, ctl_index);
+        }
+        ms->active = false;
+    }
+    ar->num_active_ctls = 0;
 }
 
 void audio_route_apply_path(struct audio_route *ar, const char *name)
@@ -414,44 +759,398 @@ void audio_route_apply_path(struct audio_route *ar, const char *name)
     path_apply(ar, path);
 }
 
-struct audio_route *audio_route_init(void)
+int audio_route_set_ctl(struct audio_route *ar, const char *name, const char *values)
 {
-    struct config_parse_state state;
-    XML_Parser parser;
-    FILE *file;
-    int bytes_read;
+    struct mixer_state *ms;
+    int ctl_index;
+    int *parsed;
+
+    if (!ar) {
+        ALOGE("%s: invalid audio_route", __FUNCTION__);
+        return -EINVAL;
+    }
+
+    ctl_index = find_ctl_index(ar, name);
+    if (ctl_index < 0) {
+        ALOGE("unable to find ctl '%s'", name);
+        return -ENOENT;
+    }
+    ms = &ar->mixer_state[ctl_index];
+    if (ms->num_values == 0) {
+        ALOGE("ctl '%s' has an unsupported type", name);
+        return -EINVAL;
+    }
+    load_ctl(ar, ctl_index);
+
+    /* the scratch holds the largest ctl, so values never run past it */
+    parsed = ar->parse_buf;
+    if (parse_ctl_values(ms, values, parsed, true) < 0 ||
+            (ms->type == MIXER_CTL_TYPE_ENUM &&
+             (unsigned int)parsed[0] >= mixer_ctl_get_num_enums(ms->ctl))) {
+        ALOGE("invalid value '%s' for ctl '%s'", values, name);
+        return -EINVAL;
+    }
+    memcpy(ms->new_value, parsed, ms->num_values * sizeof(int));
+    mark_ctl_dirty(ar, ctl_index);
+
+    return 0;
+}
+
+/*
+ * Compiled path cache
+ *
+ * Parsing the xml resolves every ctl and enum by name, which is slow on
+ * cards with many ctls. Once parsed, the paths are saved in a flat file
+ * with the ctls they use by index, along with the mtime and size of the
+ * xml and the name of the card. audio_route_init() maps the file and only
+ * checks that the ctls still have the same names, types and sizes. Any
+ * mismatch falls back to the xml, which then rewrites the cache.
+ *
+ * Layout: header, ctls, settings (the initial ones first), paths, values
+ * and names. The settings and the paths refer to the values and to the
+ * names by offset.
+ */
+
+#define CACHE_MAGIC 0x43505241 /* "ARPC" */
+#define CACHE_VERSION 2
+#define CACHE_CARD_NAME_SIZE 64
+#define CACHE_XML_PATH_SIZE 128
+
+struct cache_header {
+    uint32_t magic;
+    uint32_t version;
+    int64_t xml_mtime_sec;
+    int64_t xml_mtime_nsec;
+    int64_t xml_size;
+    char card_name[CACHE_CARD_NAME_SIZE];
+    char xml_path[CACHE_XML_PATH_SIZE];
+    uint32_t num_mixer_ctls;
+    uint32_t num_ctls;
+    uint32_t num_initial;
+    uint32_t num_settings;
+    uint32_t num_paths;
+    uint32_t num_values;
+    uint32_t names_size;
+    uint32_t reserved;
+};
+
+/* a ctl used by the paths, as it was when the cache was written */
+struct cache_ctl {
+    uint32_t index;
+    uint32_t type;
+    uint32_t num_values;
+    uint32_t num_enums;
+    uint32_t name;
+};
+
+struct cache_setting {
+    uint32_t ctl_index;
+    uint32_t value;
+};
+
+struct cache_path {
+    uint32_t name;
+    uint32_t first_setting;
+    uint32_t num_settings;
+};
+
+static size_t cache_file_size(const struct cache_header *hdr)
+{
+    return sizeof(*hdr) + hdr->num_ctls * sizeof(struct cache_ctl) +
+            (size_t)hdr->num_settings * sizeof(struct cache_setting) +
+            hdr->num_paths * sizeof(struct cache_path) +
+            (size_t)hdr->num_values * sizeof(int32_t) + hdr->names_size;
+}
+
+static void cache_path(char *path, size_t size, unsigned int card)
+{
+    snprintf(path, size, MIXER_CACHE_PATH, card);
+}
+
+static bool cache_matches(struct audio_route *ar, const struct cache_header *hdr,
+                          const char *xml_path, const struct stat *xml)
+{
+    return hdr->magic == CACHE_MAGIC && hdr->version == CACHE_VERSION &&
+            strncmp(hdr->xml_path, xml_path, sizeof(hdr->xml_path)) == 0 &&
+            hdr->xml_mtime_sec == (int64_t)xml->st_mtim.tv_sec &&
+            hdr->xml_mtime_nsec == (int64_t)xml->st_mtim.tv_nsec &&
+            hdr->xml_size == (int64_t)xml->st_size &&
+            hdr->num_mixer_ctls == ar->num_mixer_ctls &&
+            strncmp(hdr->card_name, mixer_get_name(ar->mixer), sizeof(hdr->card_name)) == 0;
+}
+
+/* loads the paths from the cache, returns 0 or -1 to parse the xml instead */
+static int load_cache(struct audio_route *ar, unsigned int card, const char *xml_path,
+                      const struct stat *xml)
+{
+    const struct cache_header *hdr;
+    const struct cache_ctl *ctls;
+    const struct cache_setting *settings;
+    const struct cache_path *paths;
+    int32_t *values;
+    char *names;
+    bool *used = NULL;
+    char file[PATH_MAX];
+    struct stat st;
+    void *map;
+    unsigned int i;
+    int fd;
+
+    cache_path(file, sizeof(file), card);
+    fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*hdr)) {
+        close(fd);
+        return -1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+
+    hdr = map;
+    if (!cache_matches(ar, hdr, xml_path, xml) || cache_file_size(hdr) != (size_t)st.st_size ||
+            hdr->num_initial > hdr->num_settings || hdr->names_size == 0)
+        goto stale;
+    ctls = (const struct cache_ctl *)(hdr + 1);
+    settings = (const struct cache_setting *)(ctls + hdr->num_ctls);
+    paths = (const struct cache_path *)(settings + hdr->num_settings);
+    values = (int32_t *)(paths + hdr->num_paths);
+    names = (char *)(values + hdr->num_values);
+    if (names[hdr->names_size - 1] != '\0')
+        goto stale;
+
+    /* the ctls the paths use must not have changed */
+    used = calloc(ar->num_mixer_ctls, sizeof(bool));
+    if (!used)
+        goto stale;
+    for (i = 0; i < hdr->num_ctls; i++) {
+        const struct cache_ctl *c = &ctls[i];
+        struct mixer_state *ms;
+
+        if (c->index >= ar->num_mixer_ctls || c->name >= hdr->names_size)
+            goto stale;
+        ms = &ar->mixer_state[c->index];
+        if (c->type != ms->type || c->num_values != ms->num_values || ms->num_values == 0 ||
+                strcmp(names + c->name, mixer_ctl_get_name(ms->ctl)) != 0 ||
+                (ms->type == MIXER_CTL_TYPE_ENUM &&
+                 c->num_enums != mixer_ctl_get_num_enums(ms->ctl)))
+            goto stale;
+        used[c->index] = true;
+    }
+    for (i = 0; i < hdr->num_settings; i++) {
+        const struct cache_setting *c = &settings[i];
+
+        if (c->ctl_index >= ar->num_mixer_ctls || !used[c->ctl_index] ||
+                c->value > hdr->num_values ||
+                ar->mixer_state[c->ctl_index].num_values > hdr->num_values - c->value)
+            goto stale;
+    }
+    for (i = 0; i < hdr->num_paths; i++) {
+        const struct cache_path *c = &paths[i];
+
+        if (c->name >= hdr->names_size || c->first_setting < hdr->num_initial ||
+                c->first_setting > hdr->num_settings ||
+                c->num_settings > hdr->num_settings - c->first_setting)
+            goto stale;
+    }
+
+    ar->mixer_path = calloc(hdr->num_paths, sizeof(struct mixer_path));
+    ar->cache_settings = calloc(hdr->num_settings, sizeof(struct mixer_setting));
+    if ((hdr->num_paths && !ar->mixer_path) || (hdr->num_settings && !ar->cache_settings)) {
+        free(ar->mixer_path);
+        ar->mixer_path = NULL;
+        free(ar->cache_settings);
+        ar->cache_settings = NULL;
+        goto stale;
+    }
+    for (i = 0; i < hdr->num_settings; i++) {
+        ar->cache_settings[i].ctl_index = settings[i].ctl_index;
+        ar->cache_settings[i].value = values + settings[i].value;
+    }
+    for (i = 0; i < hdr->num_paths; i++) {
+        struct mixer_path *path = &ar->mixer_path[i];
+        unsigned int bucket;
+
+        path->name = names + paths[i].name;
+        path->size = paths[i].num_settings;
+        path->length = paths[i].num_settings;
+        path->setting = ar->cache_settings + paths[i].first_setting;
+        bucket = name_hash(path->name) & (PATH_HASH_SIZE - 1);
+        path->hash_next = ar->path_hash[bucket];
+        ar->path_hash[bucket] = i + 1;
+    }
+    ar->mixer_path_size = hdr->num_paths;
+    ar->num_mixer_paths = hdr->num_paths;
+    ar->cache_map = map;
+    ar->cache_size = st.st_size;
+
+    for (i = 0; i < hdr->num_ctls; i++)
+        load_ctl(ar, ctls[i].index);
+    for (i = 0; i < hdr->num_initial; i++) {
+        struct mixer_state *ms = &ar->mixer_state[settings[i].ctl_index];
+
+        memcpy(ms->new_value, values + settings[i].value, ms->num_values * sizeof(int));
+        mark_ctl_dirty(ar, settings[i].ctl_index);
+    }
+
+    free(used);
+    ALOGV("loaded %u mixer paths from %s", hdr->num_paths, file);
+    return 0;
+
+stale:
+    ALOGI("%s is stale, parsing %s", file, xml_path);
+    free(used);
+    munmap(map, st.st_size);
+    return -1;
+}
+
+/*
+ * Saves the paths just parsed. Until update_mixer_state() runs, the dirty
+ * ctls are the ones the xml sets outside of a path.
+ */
+static void save_cache(struct audio_route *ar, unsigned int card, const char *xml_path,
+                       const struct stat *xml)
+{
+    struct cache_header hdr;
+    struct cache_ctl *ctls;
+    struct cache_setting *settings;
+    struct cache_path *paths;
+    int32_t *values;
+    char *names;
     void *buf;
-    int i;
-    struct mixer_path *path;
-    struct audio_route *ar;
+    size_t size;
+    uint32_t value = 0;
+    uint32_t name = 0;
+    uint32_t setting = 0;
+    char file[PATH_MAX];
+    char tmp[PATH_MAX + 4];
+    unsigned int i;
+    unsigned int j;
+    unsigned int n;
+    ssize_t written;
+    int fd;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = CACHE_MAGIC;
+    hdr.version = CACHE_VERSION;
+    hdr.xml_mtime_sec = xml->st_mtim.tv_sec;
+    hdr.xml_mtime_nsec = xml->st_mtim.tv_nsec;
+    hdr.xml_size = xml->st_size;
+    strncpy(hdr.card_name, mixer_get_name(ar->mixer), sizeof(hdr.card_name) - 1);
+    if (strlen(xml_path) >= sizeof(hdr.xml_path))
+        return;
+    strcpy(hdr.xml_path, xml_path);
+    hdr.num_mixer_ctls = ar->num_mixer_ctls;
+    hdr.num_initial = ar->num_dirty_ctls;
+    hdr.num_settings = ar->num_dirty_ctls;
+    hdr.num_paths = ar->num_mixer_paths;
 
-    ar = calloc(1, sizeof(struct audio_route));
-    if (!ar)
-        goto err_calloc;
+    /* the ctls read while parsing are the ones in use */
+    for (i = 0; i < ar->num_mixer_ctls; i++) {
+        if (ar->mixer_state[i].loaded) {
+            hdr.num_ctls++;
+            hdr.names_size += strlen(mixer_ctl_get_name(ar->mixer_state[i].ctl)) + 1;
+        }
+    }
+    for (i = 0; i < ar->num_dirty_ctls; i++)
+        hdr.num_values += ar->mixer_state[ar->dirty_ctls[i]].num_values;
+    for (i = 0; i < ar->num_mixer_paths; i++) {
+        hdr.num_settings += ar->mixer_path[i].length;
+        hdr.names_size += strlen(ar->mixer_path[i].name) + 1;
+        for (j = 0; j < ar->mixer_path[i].length; j++)
+            hdr.num_values += ar->mixer_state[ar->mixer_path[i].setting[j].ctl_index].num_values;
+    }
 
-    struct snd_pcm_info *info = select_card(0, PCM_OUT);
-    if (!info) {
-        ALOGW("Unable to find the mixer");
-        goto err_mixer_open;
+    size = cache_file_size(&hdr);
+    buf = calloc(1, size);
+    if (!buf)
+        return;
+    memcpy(buf, &hdr, sizeof(hdr));
+    ctls = (struct cache_ctl *)((struct cache_header *)buf + 1);
+    settings = (struct cache_setting *)(ctls + hdr.num_ctls);
+    paths = (struct cache_path *)(settings + hdr.num_settings);
+    values = (int32_t *)(paths + hdr.num_paths);
+    names = (char *)(values + hdr.num_values);
+
+    for (i = 0, n = 0; i < ar->num_mixer_ctls; i++) {
+        struct mixer_state *ms = &ar->mixer_state[i];
+        const char *ctl_name = mixer_ctl_get_name(ms->ctl);
+
+        if (!ms->loaded)
+            continue;
+        ctls[n].index = i;
+        ctls[n].type = ms->type;
+        ctls[n].num_values = ms->num_values;
+        ctls[n].num_enums = ms->type == MIXER_CTL_TYPE_ENUM ? mixer_ctl_get_num_enums(ms->ctl) : 0;
+        ctls[n].name = name;
+        strcpy(names + name, ctl_name);
+        name += strlen(ctl_name) + 1;
+        n++;
     }
-    ar->mixer = mixer_open(info->card);
-    if (!ar->mixer) {
-        ALOGE("Unable to open the mixer, aborting.");
-        goto err_mixer_open;
+    for (i = 0; i < ar->num_dirty_ctls; i++) {
+        struct mixer_state *ms = &ar->mixer_state[ar->dirty_ctls[i]];
+
+        settings[setting].ctl_index = ar->dirty_ctls[i];
+        settings[setting].value = value;
+        memcpy(values + value, ms->new_value, ms->num_values * sizeof(int));
+        value += ms->num_values;
+        setting++;
+    }
+    for (i = 0; i < ar->num_mixer_paths; i++) {
+        struct mixer_path *path = &ar->mixer_path[i];
+
+        paths[i].name = name;
+        paths[i].first_setting = setting;
+        paths[i].num_settings = path->length;
+        strcpy(names + name, path->name);
+        name += strlen(path->name) + 1;
+        for (j = 0; j < path->length; j++) {
+            unsigned int num_values = ar->mixer_state[path->setting[j].ctl_index].num_values;
+
+            settings[setting].ctl_index = path->setting[j].ctl_index;
+            settings[setting].value = value;
+            memcpy(values + value, path->setting[j].value, num_values * sizeof(int));
+            value += num_values;
+            setting++;
+        }
     }
 
-    ar->mixer_path = NULL;
-    ar->mixer_path_size = 0;
-    ar->num_mixer_paths = 0;
+    /* written aside then renamed, a reader never sees half a file */
+    cache_path(file, sizeof(file), card);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0640);
+    if (fd < 0) {
+        ALOGW("unable to write %s: %s", tmp, strerror(errno));
+        free(buf);
+        return;
+    }
+    written = write(fd, buf, size);
+    close(fd);
+    free(buf);
+    if (written < 0 || (size_t)written != size || rename(tmp, file) < 0) {
+        ALOGW("unable to write %s", file);
+        unlink(tmp);
+        return;
+    }
+    ALOGV("saved %u mixer paths to %s", hdr.num_paths, file);
+}
 
-    /* allocate space for and read current mixer settings */
-    if (alloc_mixer_state(ar) < 0)
-        goto err_mixer_state;
+/* reads the paths and the initial settings from the xml */
+static int parse_mixer_xml(struct audio_route *ar, const char *xml_path)
+{
+    struct config_parse_state state;
+    XML_Parser parser;
+    FILE *file;
+    int bytes_read;
+    void *buf;
+    int ret = -1;
 
-    file = fopen(MIXER_XML_PATH, "r");
+    file = fopen(xml_path, "r");
     if (!file) {
-        ALOGE("Failed to open %s", MIXER_XML_PATH);
-        goto err_fopen;
+        ALOGE("Failed to open %s", xml_path);
+        return -1;
     }
 
     parser = XML_ParserCreate(NULL);
@@ -476,28 +1175,67 @@ struct audio_route *audio_route_init(void)
 
         if (XML_ParseBuffer(parser, bytes_read,
                             bytes_read == 0) == XML_STATUS_ERROR) {
-            ALOGE("Error in mixer xml (%s)", MIXER_XML_PATH);
+            ALOGE("Error in mixer xml (%s)", xml_path);
             goto err_parse;
         }
 
         if (bytes_read == 0)
             break;
     }
+    ret = 0;
+
+err_parse:
+    XML_ParserFree(parser);
+err_parser_create:
+    fclose(file);
+    return ret;
+}
+
+struct audio_route *audio_route_init(unsigned int card, const char *xml_path)
+{
+    struct audio_route *ar;
+    struct stat xml;
+    bool have_xml;
+
+    ar = calloc(1, sizeof(struct audio_route));
+    if (!ar)
+        goto err_calloc;
+
+    ar->mixer = mixer_open(card);
+    if (!ar->mixer) {
+        ALOGE("Unable to open the mixer, aborting.");
+        goto err_mixer_open;
+    }
+
+    ar->mixer_path = NULL;
+    ar->mixer_path_size = 0;
+    ar->num_mixer_paths = 0;
+
+    /* allocate space for the mixer settings, each ctl is read when a path
+       first uses it */
+    if (alloc_mixer_state(ar) < 0)
+        goto err_mixer_state;
+
+    /* without xml the route has no paths, only audio_route_set_ctl() */
+    if (xml_path) {
+        have_xml = stat(xml_path, &xml) == 0;
+        if (!have_xml || load_cache(ar, card, xml_path, &xml) < 0) {
+            if (parse_mixer_xml(ar, xml_path) < 0)
+                goto err_parse;
+            if (have_xml)
+                save_cache(ar, card, xml_path, &xml);
+        }
+    }
 
     /* apply the initial mixer values, and save them so we can reset the
        mixer to the original values */
     update_mixer_state(ar);
     save_mixer_state(ar);
 
-    XML_ParserFree(parser);
-    fclose(file);
     return ar;
 
 err_parse:
-    XML_ParserFree(parser);
-err_parser_create:
-    fclose(file);
-err_fopen:
+    free_mixer_paths(ar);
     free_mixer_state(ar);
 err_mixer_state:
     mixer_close(ar->mixer);
@@ -514,6 +1252,7 @@ void audio_route_free(struct audio_route *ar)
         ALOGE("%s: invalid audio_route", __FUNCTION__);
         return;
     }
+    free_mixer_paths(ar);
     free_mixer_state(ar);
     mixer_close(ar->mixer);
     free(ar);
@@ -17,13 +17,25 @@
 #ifndef AUDIO_ROUTE_H
 #define AUDIO_ROUTE_H
 
-/* Initialises and frees the audio routes */
-struct audio_route *audio_route_init(void);
+/*
+ * Initialises and frees the audio routes of a card, from its mixer xml.
+ * With a NULL xml_path the route has no paths, for audio_route_set_ctl().
+ */
+struct audio_route *audio_route_init(unsigned int card, const char *xml_path);
 void audio_route_free(struct audio_route *ar);
 
 /* Applies an audio route path by name */
 void audio_route_apply_path(struct audio_route *ar, const char *name);
 
+/*
+ * Sets a ctl by name, values as in the mixer paths: an enum string or a list
+ * of numbers, but more numbers than the ctl has values or anything else
+ * left over is -EINVAL. Like a path, it reaches the mixer with
+ * update_mixer_state(), but reset_mixer_state() leaves it alone. Returns 0
+ * or a negative errno.
+ */
+int audio_route_set_ctl(struct audio_route *ar, const char *name, const char *values);
+
 /* Resets the mixer back to its initial state */
 void reset_mixer_state(struct audio_route *ar);
 
@@ -0,0 +1,122 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+
+#include "audio_stats.h"
+
+#define FIRST_BUCKET_NS 500000LL
+
+static const char *bucket_names[AUDIO_STATS_BUCKETS] = {
+    "<0.5", "<1", "<2", "<4", "<8", "<16", "<32", ">=32",
+};
+
+static unsigned int duration_bucket(int64_t ns)
+{
+    unsigned int i = 0;
+
+    while (i < AUDIO_STATS_BUCKETS - 1 && ns >= (FIRST_BUCKET_NS << i))
+        i++;
+    return i;
+}
+
+void audio_stats_add_call(struct audio_stats *stats, int64_t ns)
+{
+    audio_stats_count(&stats->call_hist[duration_bucket(ns)]);
+}
+
+void audio_stats_add_io(struct audio_stats *stats, int64_t ns)
+{
+    int64_t max = atomic_load_explicit(&stats->io_max_ns, memory_order_relaxed);
+
+    audio_stats_count(&stats->io_calls);
+    audio_stats_add_ns(&stats->io_ns, ns);
+    while (ns > max && !atomic_compare_exchange_weak_explicit(&stats->io_max_ns, &max, ns,
+                                                              memory_order_relaxed,
+                                                              memory_order_relaxed))
+        ;
+}
+
+void audio_stats_add_fill(struct audio_stats *stats, unsigned int frames,
+                          unsigned int buffer_frames)
+{
+    unsigned int i;
+
+    if (buffer_frames == 0)
+        return;
+    i = (uint64_t)frames * AUDIO_STATS_BUCKETS / buffer_frames;
+    if (i >= AUDIO_STATS_BUCKETS)
+        i = AUDIO_STATS_BUCKETS - 1;
+    audio_stats_count(&stats->fill_hist[i]);
+}
+
+void audio_stats_add_xrun(struct audio_stats *stats, int64_t now_ns)
+{
+    unsigned int n = atomic_fetch_add_explicit(&stats->xruns, 1, memory_order_relaxed);
+
+    atomic_store_explicit(&stats->xrun_ns[n % AUDIO_STATS_XRUN_TIMES], now_ns,
+                          memory_order_relaxed);
+}
+
+static unsigned int load(atomic_uint *counter)
+{
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+static long long load_us(atomic_int_least64_t *total)
+{
+    return atomic_load_explicit(total, memory_order_relaxed) / 1000;
+}
+
+void audio_stats_dump(struct audio_stats *stats, int fd, const char *call)
+{
+    unsigned int io_calls = load(&stats->io_calls);
+    unsigned int xruns = load(&stats->xruns);
+    unsigned int fills = 0;
+    unsigned int i;
+
+    dprintf(fd, "      %s durations (ms):", call);
+    for (i = 0; i < AUDIO_STATS_BUCKETS; i++)
+        dprintf(fd, " %s: %u", bucket_names[i], load(&stats->call_hist[i]));
+    dprintf(fd, "\n");
+
+    for (i = 0; i < AUDIO_STATS_BUCKETS; i++)
+        fills += load(&stats->fill_hist[i]);
+    if (fills) {
+        dprintf(fd, "      kernel buffer before a write (eighths):");
+        for (i = 0; i < AUDIO_STATS_BUCKETS; i++)
+            dprintf(fd, " %u: %u", i, load(&stats->fill_hist[i]));
+        dprintf(fd, "\n");
+    }
+
+    dprintf(fd, "      blocked in the PCM: %lld us in %u calls, %lld us at most\n",
+            load_us(&stats->io_ns), io_calls, load_us(&stats->io_max_ns));
+    dprintf(fd, "      throttle sleep: %lld us, resampler: %lld us\n",
+            load_us(&stats->sleep_ns), load_us(&stats->resample_ns));
+    dprintf(fd, "      standbys: %u, resumes: %u\n",
+            load(&stats->standbys), load(&stats->resumes));
+
+    dprintf(fd, "      xruns: %u", xruns);
+    if (xruns) {
+        unsigned int n = xruns < AUDIO_STATS_XRUN_TIMES ? xruns : AUDIO_STATS_XRUN_TIMES;
+
+        dprintf(fd, ", latest at (ms):");
+        for (i = 0; i < n; i++)
+            dprintf(fd, " %lld", load_us(&stats->xrun_ns[(xruns - 1 - i) %
+                                                         AUDIO_STATS_XRUN_TIMES]) / 1000);
+    }
+    dprintf(fd, "\n");
+}
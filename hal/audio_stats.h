@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef AUDIO_STATS_H
+#define AUDIO_STATS_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/*
+ * Counters of a stream since it was opened. The audio thread updates them
+ * with relaxed atomics and the dump hooks read them without any lock, so
+ * a dump may mix values from either side of a write.
+ */
+
+/* durations: below 0.5 ms, then doubling up to 32 ms and over */
+#define AUDIO_STATS_BUCKETS 8
+#define AUDIO_STATS_XRUN_TIMES 4
+
+struct audio_stats {
+    atomic_uint call_hist[AUDIO_STATS_BUCKETS]; /* duration of the write or read calls */
+    atomic_uint fill_hist[AUDIO_STATS_BUCKETS]; /* kernel buffer before a write, in eighths */
+    atomic_uint io_calls;
+    atomic_int_least64_t io_ns; /* blocked in pcm_write() or pcm_read() */
+    atomic_int_least64_t io_max_ns;
+    atomic_int_least64_t sleep_ns; /* waiting for the kernel buffer to drain */
+    atomic_int_least64_t resample_ns;
+    atomic_uint xruns;
+    atomic_int_least64_t xrun_ns[AUDIO_STATS_XRUN_TIMES]; /* CLOCK_MONOTONIC, latest ones */
+    atomic_uint standbys;
+    atomic_uint resumes;
+};
+
+static inline void audio_stats_count(atomic_uint *counter)
+{
+    atomic_fetch_add_explicit(counter, 1, memory_order_relaxed);
+}
+
+static inline void audio_stats_add_ns(atomic_int_least64_t *total, int64_t ns)
+{
+    atomic_fetch_add_explicit(total, ns, memory_order_relaxed);
+}
+
+void audio_stats_add_call(struct audio_stats *stats, int64_t ns);
+void audio_stats_add_io(struct audio_stats *stats, int64_t ns);
+/* frames queued in the kernel out of buffer_frames */
+void audio_stats_add_fill(struct audio_stats *stats, unsigned int frames,
+                          unsigned int buffer_frames);
+void audio_stats_add_xrun(struct audio_stats *stats, int64_t now_ns);
+
+/* prints the counters to fd, call names the write or read calls */
+void audio_stats_dump(struct audio_stats *stats, int fd, const char *call);
+
+#endif
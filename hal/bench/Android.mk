@@ -0,0 +1,52 @@
+# Copyright (C) 2011-2014 The Android-x86 Open Source Project
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+LOCAL_PATH := $(call my-dir)
+
+include $(CLEAR_VARS)
+
+# The HAL against a fake tinyalsa and card registry, run with
+# out/host/<os>/bin/audio_hal_bench [-r] [write|read|route|standby]...
+# and -t hal/bench/thresholds.txt to fail on a regression
+LOCAL_MODULE := audio_hal_bench
+LOCAL_MODULE_TAGS := optional
+LOCAL_SHARED_LIBRARIES := \
+	liblog \
+	libcutils \
+	libaudioutils \
+	libexpat \
+
+LOCAL_SRC_FILES := \
+	../audio_bringup.c \
+	../audio_convert.c \
+	../audio_hw.c \
+	../audio_route.c \
+	../audio_stats.c \
+	audio_hal_bench.c \
+	fake_alsa.c \
+	fake_cards.c
+
+LOCAL_C_INCLUDES := \
+	$(LOCAL_PATH)/.. \
+	external/expat/lib \
+	external/tinyalsa/include \
+	$(call include-path-for, audio-utils)
+
+BENCH_DIR := /tmp/audio_hal_bench
+LOCAL_CFLAGS := -Wno-unused-variable \
+	-DMIXER_XML_DIR=\"$(BENCH_DIR)\" \
+	-DMIXER_XML_PATH=\"$(BENCH_DIR)/mixer_paths.xml\" \
+	-DMIXER_CACHE_PATH=\"$(BENCH_DIR)/mixer_paths.card%u.cache\"
+
+include $(BUILD_HOST_EXECUTABLE)
@@ -0,0 +1,752 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Host benchmarks of the HAL data paths, against the fake tinyalsa of
+ * fake_alsa.c:
+ * write: out_write() throughput and time per call
+ * read: in_read() throughput and time per call, with and without an effect
+ * route: mixer paths init and switch time against the number of ctls
+ * standby: first write or read after a standby, and a cold start
+ *
+ * By default the fake PCMs take and give frames at once, so the times are
+ * what the HAL costs. With -r they run at their rate and the write and read
+ * times include the pacing.
+ *
+ * With -t, the case times are checked against the limits of a file like
+ * thresholds.txt, and the run fails if any case is over.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <hardware/audio.h>
+#include <hardware/audio_effect.h>
+#include <hardware/hardware.h>
+#include <system/audio.h>
+
+#include "audio_route.h"
+#include "fake_alsa.h"
+
+#ifndef MIXER_XML_DIR
+#define MIXER_XML_DIR "/tmp/audio_hal_bench"
+#endif
+#ifndef MIXER_CACHE_PATH
+#define MIXER_CACHE_PATH MIXER_XML_DIR "/mixer_paths.card%u.cache"
+#endif
+
+/* the ctls of the mixer the HAL benchmarks run with */
+#define BENCH_HAL_CTLS 64
+#define BENCH_ROUTE_SWITCHES 400
+#define BENCH_STANDBY_CYCLES 50
+#define BENCH_COLD_CYCLES 10
+#define BENCH_MAX_COUNTS 16
+#define BENCH_MAX_LIMITS 64
+
+extern struct audio_module HAL_MODULE_INFO_SYM;
+
+static bool realtime;
+static double audio_seconds = 10.0; /* of audio per write and read case */
+
+/* a case fails when its percentile pct, 100 for the max, is over us */
+struct limit {
+    char bench[16];
+    char name[32];
+    unsigned int pct;
+    double us;
+};
+
+static struct limit limits[BENCH_MAX_LIMITS];
+static unsigned int num_limits;
+static unsigned int regressions;
+
+struct samples {
+    int64_t *ns;
+    size_t count;
+    size_t max;
+};
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int samples_init(struct samples *s, size_t max)
+{
+    s->ns = malloc(max * sizeof(*s->ns));
+    s->count = 0;
+    s->max = max;
+    return s->ns ? 0 : -ENOMEM;
+}
+
+static void samples_add(struct samples *s, int64_t ns)
+{
+    if (s->count < s->max)
+        s->ns[s->count++] = ns;
+}
+
+static int cmp_ns(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const struct samples *s, unsigned int pct)
+{
+    if (s->count == 0)
+        return 0.0;
+    return s->ns[(s->count - 1) * pct / 100] / 1000.0;
+}
+
+/* one line per case, sorts the samples and checks them against the limits */
+static void report(const char *bench, const char *name, struct samples *s, const char *extra)
+{
+    unsigned int i;
+
+    qsort(s->ns, s->count, sizeof(*s->ns), cmp_ns);
+    printf("%-8s %-24s n=%-6zu p50=%.1fus p90=%.1fus p99=%.1fus max=%.1fus %s\n",
+           bench, name, s->count, percentile_us(s, 50), percentile_us(s, 90),
+           percentile_us(s, 99), percentile_us(s, 100), extra ? extra : "");
+    for (i = 0; i < num_limits; i++) {
+        const struct limit *l = &limits[i];
+        double us;
+
+        if (strcmp(l->bench, bench) != 0 || strcmp(l->name, name) != 0)
+            continue;
+        us = percentile_us(s, l->pct);
+        if (us > l->us) {
+            fprintf(stderr, "%s %s: %s=%.1fus is over the %.1fus limit\n", bench, name,
+                    l->pct == 100 ? "max" : l->pct == 99 ? "p99" : l->pct == 90 ? "p90" : "p50",
+                    us, l->us);
+            regressions++;
+        }
+    }
+    free(s->ns);
+    s->ns = NULL;
+}
+
+/*
+ * Writes mixer paths over num_ctls ctls: with a reset in between, going
+ * from speaker to headphone changes every ctl and going from main-mic to
+ * headset-mic only the last one.
+ */
+static int write_mixer_xml(const char *path, unsigned int num_ctls)
+{
+    FILE *f = fopen(path, "w");
+    unsigned int i;
+
+    if (!f)
+        return -errno;
+    fprintf(f, "<mixer>\n");
+    for (i = 0; i < num_ctls; i++)
+        fprintf(f, "  <ctl name=\"Bench Ctl %u\" value=\"0 0\" />\n", i);
+    fprintf(f, "  <path name=\"speaker\">\n");
+    for (i = 0; i < num_ctls; i += 2)
+        fprintf(f, "    <ctl name=\"Bench Ctl %u\" value=\"1 1\" />\n", i);
+    fprintf(f, "  </path>\n  <path name=\"headphone\">\n");
+    for (i = 1; i < num_ctls; i += 2)
+        fprintf(f, "    <ctl name=\"Bench Ctl %u\" value=\"1 1\" />\n", i);
+    fprintf(f, "  </path>\n");
+    fprintf(f, "  <path name=\"main-mic\">\n"
+               "    <ctl name=\"Bench Ctl %u\" value=\"1 1\" />\n"
+               "  </path>\n", num_ctls - 1);
+    fprintf(f, "  <path name=\"headset-mic\">\n"
+               "    <ctl name=\"Bench Ctl %u\" value=\"2 2\" />\n"
+               "  </path>\n", num_ctls - 1);
+    fprintf(f, "</mixer>\n");
+    return fclose(f) == 0 ? 0 : -errno;
+}
+
+static void remove_cache(unsigned int card)
+{
+    char path[256];
+
+    snprintf(path, sizeof(path), MIXER_CACHE_PATH, card);
+    unlink(path);
+}
+
+/* the mixer_paths_0.xml of the HAL was written once by main() */
+static struct audio_hw_device *open_device(void)
+{
+    struct audio_hw_device *dev;
+
+    if (fake_mixer_setup(0, BENCH_HAL_CTLS, 2) != 0)
+        return NULL;
+    if (HAL_MODULE_INFO_SYM.common.methods->open(&HAL_MODULE_INFO_SYM.common,
+            AUDIO_HARDWARE_INTERFACE, (struct hw_device_t **)&dev) != 0)
+        return NULL;
+    return dev;
+}
+
+static void close_device(struct audio_hw_device *dev)
+{
+    dev->common.close(&dev->common);
+}
+
+static struct audio_stream_out *open_output(struct audio_hw_device *dev, unsigned int rate,
+                                            audio_format_t format)
+{
+    struct audio_config config = {
+        .sample_rate = rate,
+        .channel_mask = AUDIO_CHANNEL_OUT_STEREO,
+        .format = format,
+    };
+    struct audio_stream_out *out;
+
+    if (dev->open_output_stream(dev, 0, AUDIO_DEVICE_OUT_SPEAKER, AUDIO_OUTPUT_FLAG_PRIMARY,
+                                &config, &out, NULL) != 0)
+        return NULL;
+    return out;
+}
+
+static struct audio_stream_in *open_input(struct audio_hw_device *dev, unsigned int rate)
+{
+    struct audio_config config = {
+        .sample_rate = rate,
+        .channel_mask = AUDIO_CHANNEL_IN_MONO,
+        .format = AUDIO_FORMAT_PCM_16_BIT,
+    };
+    struct audio_stream_in *in;
+
+    if (dev->open_input_stream(dev, 0, AUDIO_DEVICE_IN_BUILTIN_MIC, &config, &in,
+                               AUDIO_INPUT_FLAG_NONE, NULL, AUDIO_SOURCE_MIC) != 0)
+        return NULL;
+    return in;
+}
+
+/* a pass-through preprocessor, so that in_read() goes through process_frames() */
+static int32_t copy_process(effect_handle_t self __unused, audio_buffer_t *in_buf,
+                            audio_buffer_t *out_buf)
+{
+    size_t frames = in_buf->frameCount < out_buf->frameCount ?
+            in_buf->frameCount : out_buf->frameCount;
+
+    memcpy(out_buf->s16, in_buf->s16, frames * sizeof(int16_t));
+    in_buf->frameCount = frames;
+    out_buf->frameCount = frames;
+    return 0;
+}
+
+static const struct effect_interface_s copy_effect_itfe = {
+    .process = copy_process,
+};
+static const struct effect_interface_s *copy_effect = &copy_effect_itfe;
+
+static int bench_write_case(struct audio_hw_device *dev, const char *name,
+                            unsigned int rate, audio_format_t format, float volume)
+{
+    struct audio_stream_out *out = open_output(dev, rate, format);
+    struct samples s;
+    void *buffer;
+    size_t bytes, frames, calls, i;
+    int64_t start;
+    char extra[128];
+    struct fake_pcm_stats stats;
+
+    if (!out)
+        return -ENODEV;
+    bytes = out->common.get_buffer_size(&out->common);
+    frames = bytes / audio_stream_out_frame_size(out);
+    calls = audio_seconds * rate / frames;
+    buffer = calloc(1, bytes);
+    if (!buffer || samples_init(&s, calls) != 0) {
+        free(buffer);
+        dev->close_output_stream(dev, out);
+        return -ENOMEM;
+    }
+    if (volume != 1.0f)
+        out->set_volume(out, volume, volume);
+
+    fake_pcm_reset_stats();
+    start = now_ns();
+    for (i = 0; i < calls; i++) {
+        int64_t t = now_ns();
+
+        out->write(out, buffer, bytes);
+        samples_add(&s, now_ns() - t);
+    }
+    fake_pcm_get_stats(&stats);
+    snprintf(extra, sizeof(extra), "frames=%zu speed=%.1fx xruns=%u",
+             frames, (double)calls * frames / rate / ((now_ns() - start) / 1e9),
+             stats.xruns);
+    report("write", name, &s, extra);
+
+    free(buffer);
+    dev->close_output_stream(dev, out);
+    return 0;
+}
+
+static int bench_write(void)
+{
+    struct audio_hw_device *dev = open_device();
+    int ret;
+
+    if (!dev)
+        return -ENODEV;
+    ret = bench_write_case(dev, "48000", 48000, AUDIO_FORMAT_PCM_16_BIT, 1.0f);
+    if (ret == 0)
+        ret = bench_write_case(dev, "48000 volume", 48000, AUDIO_FORMAT_PCM_16_BIT, 0.5f);
+    if (ret == 0)
+        ret = bench_write_case(dev, "44100 resampled", 44100, AUDIO_FORMAT_PCM_16_BIT, 1.0f);
+    if (ret == 0)
+        ret = bench_write_case(dev, "48000 float", 48000, AUDIO_FORMAT_PCM_FLOAT, 1.0f);
+    if (ret == 0)
+        ret = bench_write_case(dev, "48000 float volume", 48000, AUDIO_FORMAT_PCM_FLOAT, 0.5f);
+    close_device(dev);
+    return ret;
+}
+
+static int bench_read_case(struct audio_hw_device *dev, const char *name,
+                           unsigned int rate, bool effect)
+{
+    struct audio_stream_in *in = open_input(dev, rate);
+    struct samples s;
+    void *buffer;
+    size_t bytes, frames, calls, i;
+    int64_t start;
+    char extra[128];
+
+    if (!in)
+        return -ENODEV;
+    bytes = in->common.get_buffer_size(&in->common);
+    frames = bytes / audio_stream_in_frame_size(in);
+    calls = audio_seconds * rate / frames;
+    buffer = malloc(bytes);
+    if (!buffer || samples_init(&s, calls) != 0) {
+        free(buffer);
+        dev->close_input_stream(dev, in);
+        return -ENOMEM;
+    }
+    if (effect)
+        in->common.add_audio_effect(&in->common, (effect_handle_t)&copy_effect);
+
+    start = now_ns();
+    for (i = 0; i < calls; i++) {
+        int64_t t = now_ns();
+
+        in->read(in, buffer, bytes);
+        samples_add(&s, now_ns() - t);
+    }
+    snprintf(extra, sizeof(extra), "frames=%zu speed=%.1fx",
+             frames, (double)calls * frames / rate / ((now_ns() - start) / 1e9));
+    report("read", name, &s, extra);
+
+    if (effect)
+        in->common.remove_audio_effect(&in->common, (effect_handle_t)&copy_effect);
+    free(buffer);
+    dev->close_input_stream(dev, in);
+    return 0;
+}
+
+static int bench_read(void)
+{
+    struct audio_hw_device *dev = open_device();
+    int ret;
+
+    if (!dev)
+        return -ENODEV;
+    ret = bench_read_case(dev, "48000 mono", 48000, false);
+    if (ret == 0)
+        ret = bench_read_case(dev, "16000 mono resampled", 16000, false);
+    if (ret == 0)
+        ret = bench_read_case(dev, "16000 mono effect", 16000, true);
+    close_device(dev);
+    return ret;
+}
+
+/* switches and flushes a path after a reset, as the HAL does on a reroute */
+static void switch_path(struct audio_route *ar, const char *path)
+{
+    reset_mixer_state(ar);
+    audio_route_apply_path(ar, path);
+    update_mixer_state(ar);
+}
+
+static int bench_route_case(unsigned int num_ctls)
+{
+    static const char *xml = MIXER_XML_DIR "/mixer_paths_route.xml";
+    struct audio_route *ar;
+    struct samples init = { 0 }, cached = { 0 }, all = { 0 }, one = { 0 };
+    unsigned long writes_all = 0, writes_one = 0;
+    char name[32], extra[64];
+    int i, ret;
+
+    ret = fake_mixer_setup(0, num_ctls, 2);
+    if (ret == 0)
+        ret = write_mixer_xml(xml, num_ctls);
+    if (ret != 0)
+        return ret;
+    ret = -ENOMEM;
+    if (samples_init(&init, BENCH_COLD_CYCLES) != 0 ||
+            samples_init(&cached, BENCH_COLD_CYCLES) != 0 ||
+            samples_init(&all, BENCH_ROUTE_SWITCHES) != 0 ||
+            samples_init(&one, BENCH_ROUTE_SWITCHES) != 0)
+        goto exit;
+    ret = -EINVAL;
+
+    /* parsing the xml, then loading what the previous init saved */
+    for (i = 0; i < BENCH_COLD_CYCLES; i++) {
+        int64_t t;
+
+        remove_cache(0);
+        t = now_ns();
+        ar = audio_route_init(0, xml);
+        samples_add(&init, now_ns() - t);
+        if (!ar)
+            goto exit;
+        audio_route_free(ar);
+
+        t = now_ns();
+        ar = audio_route_init(0, xml);
+        samples_add(&cached, now_ns() - t);
+        if (!ar)
+            goto exit;
+        audio_route_free(ar);
+    }
+
+    ar = audio_route_init(0, xml);
+    if (!ar)
+        goto exit;
+    switch_path(ar, "speaker");
+    fake_mixer_take_writes();
+    for (i = 0; i < BENCH_ROUTE_SWITCHES; i++) {
+        int64_t t = now_ns();
+
+        switch_path(ar, i & 1 ? "speaker" : "headphone");
+        samples_add(&all, now_ns() - t);
+    }
+    writes_all = fake_mixer_take_writes();
+
+    switch_path(ar, "main-mic");
+    fake_mixer_take_writes();
+    for (i = 0; i < BENCH_ROUTE_SWITCHES; i++) {
+        int64_t t = now_ns();
+
+        switch_path(ar, i & 1 ? "main-mic" : "headset-mic");
+        samples_add(&one, now_ns() - t);
+    }
+    writes_one = fake_mixer_take_writes();
+    audio_route_free(ar);
+    remove_cache(0);
+
+    snprintf(name, sizeof(name), "init %u ctls", num_ctls);
+    report("route", name, &init, NULL);
+    snprintf(name, sizeof(name), "init cached %u ctls", num_ctls);
+    report("route", name, &cached, NULL);
+    snprintf(name, sizeof(name), "switch all %u ctls", num_ctls);
+    snprintf(extra, sizeof(extra), "writes=%lu", writes_all / BENCH_ROUTE_SWITCHES);
+    report("route", name, &all, extra);
+    snprintf(name, sizeof(name), "switch one %u ctls", num_ctls);
+    snprintf(extra, sizeof(extra), "writes=%lu", writes_one / BENCH_ROUTE_SWITCHES);
+    report("route", name, &one, extra);
+    ret = 0;
+
+exit:
+    /* report() has freed the samples it was given */
+    free(init.ns);
+    free(cached.ns);
+    free(all.ns);
+    free(one.ns);
+    return ret;
+}
+
+static unsigned int route_counts[BENCH_MAX_COUNTS] = { 16, 64, 256, 1024 };
+static unsigned int num_route_counts = 4;
+
+static int bench_route(void)
+{
+    unsigned int i;
+    int ret = 0;
+
+    for (i = 0; i < num_route_counts && ret == 0; i++)
+        ret = bench_route_case(route_counts[i]);
+    return ret;
+}
+
+static int bench_standby(void)
+{
+    struct audio_hw_device *dev = open_device();
+    struct audio_stream_out *out;
+    struct audio_stream_in *in;
+    struct samples s;
+    struct fake_pcm_stats stats;
+    void *buffer = NULL;
+    size_t out_bytes, in_bytes;
+    char extra[64];
+    int i, ret = -ENOMEM;
+
+    if (!dev)
+        return -ENODEV;
+    out = open_output(dev, 48000, AUDIO_FORMAT_PCM_16_BIT);
+    in = open_input(dev, 48000);
+    if (!out || !in) {
+        ret = -ENODEV;
+        goto exit;
+    }
+    out_bytes = out->common.get_buffer_size(&out->common);
+    in_bytes = in->common.get_buffer_size(&in->common);
+    buffer = calloc(1, out_bytes > in_bytes ? out_bytes : in_bytes);
+    if (!buffer)
+        goto exit;
+
+    /* a warm standby keeps the PCMs, none should be opened again */
+    if (samples_init(&s, BENCH_STANDBY_CYCLES) != 0)
+        goto exit;
+    out->write(out, buffer, out_bytes);
+    fake_pcm_reset_stats();
+    for (i = 0; i < BENCH_STANDBY_CYCLES; i++) {
+        int64_t t;
+
+        out->write(out, buffer, out_bytes);
+        out->common.standby(&out->common);
+        t = now_ns();
+        out->write(out, buffer, out_bytes);
+        samples_add(&s, now_ns() - t);
+    }
+    fake_pcm_get_stats(&stats);
+    snprintf(extra, sizeof(extra), "opens=%u", stats.opens);
+    report("standby", "out resume", &s, extra);
+
+    if (samples_init(&s, BENCH_STANDBY_CYCLES) != 0)
+        goto exit;
+    in->read(in, buffer, in_bytes);
+    fake_pcm_reset_stats();
+    for (i = 0; i < BENCH_STANDBY_CYCLES; i++) {
+        int64_t t;
+
+        in->read(in, buffer, in_bytes);
+        in->common.standby(&in->common);
+        t = now_ns();
+        in->read(in, buffer, in_bytes);
+        samples_add(&s, now_ns() - t);
+    }
+    fake_pcm_get_stats(&stats);
+    snprintf(extra, sizeof(extra), "opens=%u", stats.opens);
+    report("standby", "in resume", &s, extra);
+
+    dev->close_input_stream(dev, in);
+    in = NULL;
+    dev->close_output_stream(dev, out);
+    out = NULL;
+    close_device(dev);
+    dev = NULL;
+
+    /*
+     * from nothing: opening the device and a stream, up to the first write,
+     * with the compiled mixer paths the previous opens left
+     */
+    if (samples_init(&s, BENCH_COLD_CYCLES) != 0)
+        goto exit;
+    for (i = 0; i < BENCH_COLD_CYCLES; i++) {
+        int64_t t = now_ns();
+
+        dev = open_device();
+        out = dev ? open_output(dev, 48000, AUDIO_FORMAT_PCM_16_BIT) : NULL;
+        if (!out) {
+            free(s.ns);
+            ret = -ENODEV;
+            goto exit;
+        }
+        out->write(out, buffer, out_bytes);
+        samples_add(&s, now_ns() - t);
+        dev->close_output_stream(dev, out);
+        out = NULL;
+        close_device(dev);
+        dev = NULL;
+    }
+    report("standby", "out cold start", &s, NULL);
+    ret = 0;
+
+exit:
+    free(buffer);
+    if (in)
+        dev->close_input_stream(dev, in);
+    if (out)
+        dev->close_output_stream(dev, out);
+    if (dev)
+        close_device(dev);
+    return ret;
+}
+
+static const struct {
+    const char *name;
+    int (*run)(void);
+} benches[] = {
+    { "write", bench_write },
+    { "read", bench_read },
+    { "route", bench_route },
+    { "standby", bench_standby },
+};
+
+#define NUM_BENCHES (sizeof(benches) / sizeof(benches[0]))
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-r] [-s seconds] [-c ctls,...] [-t limits] "
+            "[write|read|route|standby]...\n"
+            "  -r  run the PCMs at their rate instead of as fast as possible\n"
+            "  -s  seconds of audio per write and read case (default %.0f)\n"
+            "  -c  ctl counts of the route benchmark (default 16,64,256,1024)\n"
+            "  -t  fail if a case is over its limit in this file\n",
+            prog, audio_seconds);
+}
+
+/*
+ * Reads the limits, one per line: bench, p50, p90, p99 or max, the limit in
+ * microseconds and the case name, e.g. "write p50 20 48000 volume". Blank
+ * lines and lines starting with # are skipped.
+ */
+static int read_limits(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    char line[256];
+    unsigned int n = 0;
+    int ret = 0;
+
+    if (!f) {
+        ret = -errno;
+        fprintf(stderr, "cannot open %s: %s\n", path, strerror(-ret));
+        return ret;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        struct limit *l = &limits[num_limits];
+        char pct[8];
+
+        n++;
+        if (line[strspn(line, " \t\n")] == '\0' || line[0] == '#')
+            continue;
+        if (num_limits == BENCH_MAX_LIMITS ||
+                sscanf(line, "%15s %7s %lf %31[^\n]", l->bench, pct, &l->us, l->name) != 4) {
+            ret = -EINVAL;
+        } else if (!strcmp(pct, "p50") || !strcmp(pct, "p90") || !strcmp(pct, "p99")) {
+            l->pct = atoi(pct + 1);
+        } else if (!strcmp(pct, "max")) {
+            l->pct = 100;
+        } else {
+            ret = -EINVAL;
+        }
+        if (ret != 0) {
+            fprintf(stderr, "%s:%u: bad limit\n", path, n);
+            break;
+        }
+        l->name[strcspn(l->name, "\r")] = '\0';
+        num_limits++;
+    }
+    fclose(f);
+    return ret;
+}
+
+static int parse_counts(char *list)
+{
+    char *saveptr;
+    char *tok;
+
+    num_route_counts = 0;
+    for (tok = strtok_r(list, ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr)) {
+        int n = atoi(tok);
+
+        if (n <= 0 || num_route_counts == BENCH_MAX_COUNTS)
+            return -EINVAL;
+        route_counts[num_route_counts++] = n;
+    }
+    return num_route_counts ? 0 : -EINVAL;
+}
+
+int main(int argc, char **argv)
+{
+    bool selected[NUM_BENCHES] = { false };
+    bool any = false;
+    unsigned int i;
+    int opt, status = 0;
+
+    while ((opt = getopt(argc, argv, "rs:c:t:h")) != -1) {
+        switch (opt) {
+        case 'r':
+            realtime = true;
+            break;
+        case 's':
+            audio_seconds = atof(optarg);
+            if (audio_seconds <= 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'c':
+            if (parse_counts(optarg) != 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 't':
+            if (read_limits(optarg) != 0)
+                return 1;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    for (; optind < argc; optind++) {
+        for (i = 0; i < NUM_BENCHES; i++)
+            if (strcmp(argv[optind], benches[i].name) == 0)
+                break;
+        if (i == NUM_BENCHES) {
+            usage(argv[0]);
+            return 1;
+        }
+        selected[i] = any = true;
+    }
+
+    if (mkdir(MIXER_XML_DIR, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "cannot create %s: %s\n", MIXER_XML_DIR, strerror(errno));
+        return 1;
+    }
+    /* written once, so that the HAL finds its compiled paths from the second open on */
+    if (write_mixer_xml(MIXER_XML_DIR "/mixer_paths_0.xml", BENCH_HAL_CTLS) != 0) {
+        fprintf(stderr, "cannot write the mixer paths in %s\n", MIXER_XML_DIR);
+        return 1;
+    }
+    fake_pcm_set_clock(realtime ? FAKE_PCM_CLOCK_REALTIME : FAKE_PCM_CLOCK_FREE);
+
+    for (i = 0; i < NUM_BENCHES; i++) {
+        int ret;
+
+        if (any && !selected[i])
+            continue;
+        ret = benches[i].run();
+        if (ret != 0) {
+            fprintf(stderr, "%s failed: %s\n", benches[i].name, strerror(-ret));
+            status = 1;
+        }
+    }
+    if (regressions) {
+        fprintf(stderr, "%u cases over their limit\n", regressions);
+        status = 1;
+    }
+    return status;
+}
@@ -0,0 +1,554 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <tinyalsa/asoundlib.h>
+
+#include "fake_alsa.h"
+
+#define FAKE_CARDS_MAX 8
+
+struct pcm {
+    struct pcm_config config;
+    unsigned int flags;
+    unsigned int buffer_size;
+    bool running;
+    int64_t start_ns; /* when the hardware pointer was at hw_base */
+    uint64_t hw_base;
+    uint64_t appl; /* frames written or read by the application */
+    int16_t sample; /* next value of the captured ramp */
+};
+
+struct mixer_ctl {
+    char name[32];
+    unsigned int num_values;
+    long *values;
+};
+
+struct mixer {
+    unsigned int card;
+    char name[32];
+    unsigned int num_ctls;
+    struct mixer_ctl *ctls;
+};
+
+/* one lock for everything, the PCMs are shared between HAL threads */
+static pthread_mutex_t fake_lock = PTHREAD_MUTEX_INITIALIZER;
+static enum fake_pcm_clock fake_clock = FAKE_PCM_CLOCK_FREE;
+static struct fake_pcm_stats fake_stats;
+static struct mixer *fake_mixers[FAKE_CARDS_MAX];
+static unsigned long fake_mixer_writes;
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void fake_pcm_set_clock(enum fake_pcm_clock clock)
+{
+    pthread_mutex_lock(&fake_lock);
+    fake_clock = clock;
+    pthread_mutex_unlock(&fake_lock);
+}
+
+void fake_pcm_get_stats(struct fake_pcm_stats *stats)
+{
+    pthread_mutex_lock(&fake_lock);
+    *stats = fake_stats;
+    pthread_mutex_unlock(&fake_lock);
+}
+
+void fake_pcm_reset_stats(void)
+{
+    pthread_mutex_lock(&fake_lock);
+    memset(&fake_stats, 0, sizeof(fake_stats));
+    pthread_mutex_unlock(&fake_lock);
+}
+
+/* must be called with fake_lock held */
+static uint64_t hw_ptr(struct pcm *pcm)
+{
+    /* a free capture always has a full buffer */
+    if (fake_clock == FAKE_PCM_CLOCK_FREE)
+        return pcm->flags & PCM_IN ? pcm->appl + pcm->buffer_size : pcm->appl;
+    if (!pcm->running)
+        return pcm->hw_base;
+    return pcm->hw_base + (now_ns() - pcm->start_ns) * pcm->config.rate / 1000000000LL;
+}
+
+/* stops a running playback PCM that ran out of frames, must be called with
+ * fake_lock held */
+static bool check_xrun(struct pcm *pcm)
+{
+    if (!pcm->running || (pcm->flags & PCM_IN) || hw_ptr(pcm) <= pcm->appl)
+        return false;
+    pcm->running = false;
+    pcm->hw_base = pcm->appl;
+    fake_stats.xruns++;
+    return true;
+}
+
+static void start(struct pcm *pcm)
+{
+    pcm->hw_base = hw_ptr(pcm);
+    pcm->start_ns = now_ns();
+    pcm->running = true;
+}
+
+struct pcm *pcm_open(unsigned int card __unused, unsigned int device __unused,
+                     unsigned int flags, struct pcm_config *config)
+{
+    struct pcm *pcm = calloc(1, sizeof(*pcm));
+
+    if (!pcm)
+        return NULL;
+    pcm->config = *config;
+    if (pcm->config.period_count == 0)
+        pcm->config.period_count = 2;
+    if (pcm->config.start_threshold == 0)
+        pcm->config.start_threshold = pcm->config.period_size;
+    pcm->flags = flags;
+    pcm->buffer_size = pcm->config.period_size * pcm->config.period_count;
+
+    pthread_mutex_lock(&fake_lock);
+    fake_stats.opens++;
+    pthread_mutex_unlock(&fake_lock);
+    return pcm;
+}
+
+int pcm_close(struct pcm *pcm)
+{
+    pthread_mutex_lock(&fake_lock);
+    fake_stats.closes++;
+    pthread_mutex_unlock(&fake_lock);
+    free(pcm);
+    return 0;
+}
+
+int pcm_is_ready(struct pcm *pcm)
+{
+    return pcm != NULL;
+}
+
+const char *pcm_get_error(struct pcm *pcm __unused)
+{
+    return "fake PCM";
+}
+
+unsigned int pcm_get_buffer_size(struct pcm *pcm)
+{
+    return pcm->buffer_size;
+}
+
+unsigned int pcm_format_to_bits(enum pcm_format format)
+{
+    switch (format) {
+    case PCM_FORMAT_S32_LE:
+    case PCM_FORMAT_S24_LE:
+        return 32;
+    case PCM_FORMAT_S24_3LE:
+        return 24;
+    case PCM_FORMAT_S8:
+        return 8;
+    default:
+        return 16;
+    }
+}
+
+unsigned int pcm_frames_to_bytes(struct pcm *pcm, unsigned int frames)
+{
+    return frames * pcm->config.channels * (pcm_format_to_bits(pcm->config.format) >> 3);
+}
+
+unsigned int pcm_bytes_to_frames(struct pcm *pcm, unsigned int bytes)
+{
+    return bytes / (pcm->config.channels * (pcm_format_to_bits(pcm->config.format) >> 3));
+}
+
+int pcm_get_htimestamp(struct pcm *pcm, unsigned int *avail, struct timespec *tstamp)
+{
+    uint64_t hw;
+
+    pthread_mutex_lock(&fake_lock);
+    check_xrun(pcm);
+    hw = hw_ptr(pcm);
+    if (pcm->flags & PCM_IN)
+        *avail = hw - pcm->appl > pcm->buffer_size ? pcm->buffer_size : hw - pcm->appl;
+    else
+        *avail = pcm->buffer_size - (pcm->appl - hw);
+    pthread_mutex_unlock(&fake_lock);
+    clock_gettime(CLOCK_MONOTONIC, tstamp);
+    return 0;
+}
+
+int pcm_write(struct pcm *pcm, const void *data __unused, unsigned int count)
+{
+    unsigned int frames = pcm_bytes_to_frames(pcm, count);
+
+    pthread_mutex_lock(&fake_lock);
+    if (check_xrun(pcm) && (pcm->flags & PCM_NORESTART)) {
+        pthread_mutex_unlock(&fake_lock);
+        return -EPIPE;
+    }
+    /* blocks like the kernel until all the frames fit */
+    while (pcm->appl + frames - hw_ptr(pcm) > pcm->buffer_size) {
+        uint64_t missing = pcm->appl + frames - hw_ptr(pcm) - pcm->buffer_size;
+
+        pthread_mutex_unlock(&fake_lock);
+        usleep(missing * 1000000 / pcm->config.rate + 1);
+        pthread_mutex_lock(&fake_lock);
+    }
+    pcm->appl += frames;
+    fake_stats.frames_written += frames;
+    if (!pcm->running && pcm->appl - pcm->hw_base >= pcm->config.start_threshold)
+        start(pcm);
+    pthread_mutex_unlock(&fake_lock);
+    return 0;
+}
+
+int pcm_read(struct pcm *pcm, void *data, unsigned int count)
+{
+    unsigned int frames = pcm_bytes_to_frames(pcm, count);
+    unsigned int samples = frames * pcm->config.channels;
+    unsigned int bytes = pcm_format_to_bits(pcm->config.format) >> 3;
+    unsigned int i;
+
+    pthread_mutex_lock(&fake_lock);
+    if (!pcm->running)
+        start(pcm);
+    while (fake_clock != FAKE_PCM_CLOCK_FREE && hw_ptr(pcm) < pcm->appl + frames) {
+        uint64_t missing = pcm->appl + frames - hw_ptr(pcm);
+
+        pthread_mutex_unlock(&fake_lock);
+        usleep(missing * 1000000 / pcm->config.rate + 1);
+        pthread_mutex_lock(&fake_lock);
+    }
+    pcm->appl += frames;
+    fake_stats.frames_read += frames;
+    pthread_mutex_unlock(&fake_lock);
+
+    /* a ramp, in the upper bits of wider samples */
+    for (i = 0; i < samples; i++) {
+        int16_t v = pcm->sample++;
+
+        if (bytes == 1) {
+            ((uint8_t *)data)[i] = (uint8_t)((v >> 8) + 0x80);
+        } else if (bytes == 2) {
+            ((int16_t *)data)[i] = v;
+        } else if (bytes == 4) {
+            ((int32_t *)data)[i] = (int32_t)v << 16;
+        } else {
+            ((uint8_t *)data)[i * 3] = 0;
+            ((uint8_t *)data)[i * 3 + 1] = v & 0xff;
+            ((uint8_t *)data)[i * 3 + 2] = (v >> 8) & 0xff;
+        }
+    }
+    return 0;
+}
+
+int pcm_prepare(struct pcm *pcm)
+{
+    pthread_mutex_lock(&fake_lock);
+    pcm->running = false;
+    pcm->appl = 0;
+    pcm->hw_base = 0;
+    fake_stats.prepares++;
+    pthread_mutex_unlock(&fake_lock);
+    return 0;
+}
+
+int pcm_start(struct pcm *pcm)
+{
+    pthread_mutex_lock(&fake_lock);
+    if (!pcm->running)
+        start(pcm);
+    pthread_mutex_unlock(&fake_lock);
+    return 0;
+}
+
+int pcm_stop(struct pcm *pcm)
+{
+    pthread_mutex_lock(&fake_lock);
+    pcm->running = false;
+    pcm->appl = 0;
+    pcm->hw_base = 0;
+    pthread_mutex_unlock(&fake_lock);
+    return 0;
+}
+
+int pcm_wait(struct pcm *pcm, int timeout)
+{
+    unsigned int avail;
+    struct timespec ts;
+
+    pcm_get_htimestamp(pcm, &avail, &ts);
+    if (avail < pcm->config.period_size) {
+        int64_t us = (int64_t)(pcm->config.period_size - avail) * 1000000 / pcm->config.rate;
+
+        if (timeout >= 0 && us > timeout * 1000LL)
+            us = timeout * 1000LL;
+        usleep(us);
+    }
+    return 1;
+}
+
+int pcm_get_poll_fd(struct pcm *pcm __unused)
+{
+    return -1;
+}
+
+int pcm_set_avail_min(struct pcm *pcm __unused, int avail_min __unused)
+{
+    return 0;
+}
+
+long pcm_get_delay(struct pcm *pcm)
+{
+    long delay;
+
+    pthread_mutex_lock(&fake_lock);
+    delay = pcm->appl - hw_ptr(pcm);
+    pthread_mutex_unlock(&fake_lock);
+    return delay;
+}
+
+/* no mmap: the HAL falls back to its regular paths */
+int pcm_mmap_begin(struct pcm *pcm __unused, void **areas __unused,
+                   unsigned int *offset __unused, unsigned int *frames __unused)
+{
+    return -ENOSYS;
+}
+
+int pcm_mmap_commit(struct pcm *pcm __unused, unsigned int offset __unused,
+                    unsigned int frames __unused)
+{
+    return -ENOSYS;
+}
+
+int pcm_mmap_avail(struct pcm *pcm __unused)
+{
+    return -ENOSYS;
+}
+
+int pcm_mmap_get_hw_ptr(struct pcm *pcm __unused, unsigned int *hw_ptr __unused,
+                        struct timespec *tstamp __unused)
+{
+    return -ENOSYS;
+}
+
+int pcm_mmap_write(struct pcm *pcm __unused, const void *data __unused,
+                   unsigned int count __unused)
+{
+    return -ENOSYS;
+}
+
+int pcm_mmap_read(struct pcm *pcm __unused, void *data __unused, unsigned int count __unused)
+{
+    return -ENOSYS;
+}
+
+struct pcm_params *pcm_params_get(unsigned int card __unused, unsigned int device __unused,
+                                  unsigned int flags __unused)
+{
+    return NULL;
+}
+
+void pcm_params_free(struct pcm_params *pcm_params __unused)
+{
+}
+
+int fake_mixer_setup(unsigned int card, unsigned int num_ctls, unsigned int num_values)
+{
+    struct mixer *mixer;
+    unsigned int i;
+
+    if (card >= FAKE_CARDS_MAX)
+        return -EINVAL;
+
+    mixer = calloc(1, sizeof(*mixer));
+    if (!mixer)
+        return -ENOMEM;
+    mixer->card = card;
+    snprintf(mixer->name, sizeof(mixer->name), "Bench card %u", card);
+    mixer->num_ctls = num_ctls;
+    mixer->ctls = calloc(num_ctls, sizeof(*mixer->ctls));
+    if (num_ctls && !mixer->ctls)
+        goto err;
+    for (i = 0; i < num_ctls; i++) {
+        snprintf(mixer->ctls[i].name, sizeof(mixer->ctls[i].name), "Bench Ctl %u", i);
+        mixer->ctls[i].num_values = num_values;
+        mixer->ctls[i].values = calloc(num_values, sizeof(long));
+        if (num_values && !mixer->ctls[i].values)
+            goto err;
+    }
+
+    pthread_mutex_lock(&fake_lock);
+    if (fake_mixers[card]) {
+        for (i = 0; i < fake_mixers[card]->num_ctls; i++)
+            free(fake_mixers[card]->ctls[i].values);
+        free(fake_mixers[card]->ctls);
+        free(fake_mixers[card]);
+    }
+    fake_mixers[card] = mixer;
+    pthread_mutex_unlock(&fake_lock);
+    return 0;
+
+err:
+    if (mixer->ctls)
+        for (i = 0; i < num_ctls; i++)
+            free(mixer->ctls[i].values);
+    free(mixer->ctls);
+    free(mixer);
+    return -ENOMEM;
+}
+
+unsigned long fake_mixer_take_writes(void)
+{
+    unsigned long writes;
+
+    pthread_mutex_lock(&fake_lock);
+    writes = fake_mixer_writes;
+    fake_mixer_writes = 0;
+    pthread_mutex_unlock(&fake_lock);
+    return writes;
+}
+
+/* the mixers stay allocated until the next fake_mixer_setup() of the card */
+struct mixer *mixer_open(unsigned int card)
+{
+    return card < FAKE_CARDS_MAX ? fake_mixers[card] : NULL;
+}
+
+void mixer_close(struct mixer *mixer __unused)
+{
+}
+
+const char *mixer_get_name(struct mixer *mixer)
+{
+    return mixer->name;
+}
+
+unsigned int mixer_get_num_ctls(struct mixer *mixer)
+{
+    return mixer->num_ctls;
+}
+
+struct mixer_ctl *mixer_get_ctl(struct mixer *mixer, unsigned int id)
+{
+    return id < mixer->num_ctls ? &mixer->ctls[id] : NULL;
+}
+
+struct mixer_ctl *mixer_get_ctl_by_name(struct mixer *mixer, const char *name)
+{
+    unsigned int i;
+
+    for (i = 0; i < mixer->num_ctls; i++)
+        if (strcmp(mixer->ctls[i].name, name) == 0)
+            return &mixer->ctls[i];
+    return NULL;
+}
+
+const char *mixer_ctl_get_name(struct mixer_ctl *ctl)
+{
+    return ctl->name;
+}
+
+enum mixer_ctl_type mixer_ctl_get_type(struct mixer_ctl *ctl __unused)
+{
+    return MIXER_CTL_TYPE_INT;
+}
+
+const char *mixer_ctl_get_type_string(struct mixer_ctl *ctl __unused)
+{
+    return "INT";
+}
+
+unsigned int mixer_ctl_get_num_values(struct mixer_ctl *ctl)
+{
+    return ctl->num_values;
+}
+
+unsigned int mixer_ctl_get_num_enums(struct mixer_ctl *ctl __unused)
+{
+    return 0;
+}
+
+const char *mixer_ctl_get_enum_string(struct mixer_ctl *ctl __unused,
+                                      unsigned int enum_id __unused)
+{
+    return NULL;
+}
+
+int mixer_ctl_get_value(struct mixer_ctl *ctl, unsigned int id)
+{
+    return id < ctl->num_values ? (int)ctl->values[id] : -EINVAL;
+}
+
+int mixer_ctl_get_array(struct mixer_ctl *ctl, void *array, size_t count)
+{
+    if (count > ctl->num_values)
+        return -EINVAL;
+    memcpy(array, ctl->values, count * sizeof(long));
+    return 0;
+}
+
+int mixer_ctl_set_value(struct mixer_ctl *ctl, unsigned int id, int value)
+{
+    if (id >= ctl->num_values)
+        return -EINVAL;
+    pthread_mutex_lock(&fake_lock);
+    ctl->values[id] = value;
+    fake_mixer_writes++;
+    pthread_mutex_unlock(&fake_lock);
+    return 0;
+}
+
+int mixer_ctl_set_array(struct mixer_ctl *ctl, const void *array, size_t count)
+{
+    if (count > ctl->num_values)
+        return -EINVAL;
+    pthread_mutex_lock(&fake_lock);
+    memcpy(ctl->values, array, count * sizeof(long));
+    fake_mixer_writes++;
+    pthread_mutex_unlock(&fake_lock);
+    return 0;
+}
+
+int mixer_ctl_set_enum_by_string(struct mixer_ctl *ctl __unused, const char *string __unused)
+{
+    return -EINVAL;
+}
+
+int mixer_ctl_get_range_min(struct mixer_ctl *ctl __unused)
+{
+    return 0;
+}
+
+int mixer_ctl_get_range_max(struct mixer_ctl *ctl __unused)
+{
+    return 100;
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FAKE_ALSA_H
+#define FAKE_ALSA_H
+
+#include <stdint.h>
+
+/*
+ * Host implementation of the tinyalsa calls made by the HAL, with one
+ * playback and one capture PCM per card and a mixer of generated ctls.
+ */
+
+/* how the hardware pointer of the PCMs moves */
+enum fake_pcm_clock {
+    FAKE_PCM_CLOCK_FREE, /* the device takes or gives any amount at once */
+    FAKE_PCM_CLOCK_REALTIME, /* at the PCM rate, on CLOCK_MONOTONIC */
+};
+
+void fake_pcm_set_clock(enum fake_pcm_clock clock);
+
+struct fake_pcm_stats {
+    unsigned int opens;
+    unsigned int closes;
+    unsigned int prepares;
+    unsigned int xruns;
+    uint64_t frames_written;
+    uint64_t frames_read;
+};
+
+void fake_pcm_get_stats(struct fake_pcm_stats *stats);
+void fake_pcm_reset_stats(void);
+
+/*
+ * Gives the mixer of a card num_ctls integer ctls of num_values values each,
+ * named "Bench Ctl <n>" and all at 0. Returns 0 or a negative errno.
+ */
+int fake_mixer_setup(unsigned int card, unsigned int num_ctls, unsigned int num_values);
+
+/* how many times a ctl was written since the last call */
+unsigned long fake_mixer_take_writes(void);
+
+#endif
@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include "audio_cards.h"
+
+/*
+ * The card registry of the bench: card 0 with a playback and a capture PCM,
+ * taking 16 or 32 bit stereo at 48 kHz only so that other rates go through
+ * the resampler.
+ */
+
+static struct snd_pcm_info bench_pcms[2] = {
+    { .card = 0, .device = 0, .stream = SNDRV_PCM_STREAM_PLAYBACK },
+    { .card = 0, .device = 0, .stream = SNDRV_PCM_STREAM_CAPTURE },
+};
+
+static const struct audio_card bench_card = { 0, "Bench", "HDA-Intel" };
+
+int audio_cards_init(void)
+{
+    return 0;
+}
+
+void audio_cards_release(void)
+{
+}
+
+void audio_cards_refresh(void)
+{
+}
+
+struct snd_pcm_info *audio_cards_find(enum audio_card_slot slot)
+{
+    switch (slot) {
+    case AUDIO_CARD_OUT_HDMI:
+    case AUDIO_CARD_IN_HDMI:
+        return NULL;
+    case AUDIO_CARD_IN_MIC:
+    case AUDIO_CARD_IN_HEADSET:
+        return &bench_pcms[1];
+    default:
+        return &bench_pcms[0];
+    }
+}
+
+int audio_cards_get_caps(const struct snd_pcm_info *info __unused, struct audio_pcm_caps *caps)
+{
+    memset(caps, 0, sizeof(*caps));
+    caps->num_rates = 1;
+    caps->rates[0] = 48000;
+    caps->channels_min = 2;
+    caps->channels_max = 2;
+    caps->formats = 1ULL << SNDRV_PCM_FORMAT_S16_LE | 1ULL << SNDRV_PCM_FORMAT_S32_LE;
+    return 0;
+}
+
+unsigned int audio_cards_list(struct audio_card *cards, unsigned int max)
+{
+    if (max == 0)
+        return 0;
+    cards[0] = bench_card;
+    return 1;
+}
+
+bool audio_cards_primary_hdmi(bool def)
+{
+    return def;
+}
+
+unsigned int audio_cards_generation(void)
+{
+    return 1;
+}
+
+int audio_cards_add_listener(audio_cards_listener_t fn __unused, void *context __unused)
+{
+    return 0;
+}
+
+void audio_cards_remove_listener(audio_cards_listener_t fn __unused, void *context __unused)
+{
+}